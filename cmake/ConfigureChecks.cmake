@@ -1,18 +1,22 @@
 include(CheckIncludeFile)
 check_include_file("arpa/inet.h" HAVE_ARPA_INET_H)
+check_include_file("cpuid.h" HAVE_CPUID_H)
 check_include_file("dlfcn.h" HAVE_DLFCN_H)
 check_include_file("gssapi/gssapi.h" HAVE_GSSAPI_GSSAPI_H)
 check_include_file("inttypes.h" HAVE_INTTYPES_H)
+check_include_file("linux/io_uring.h" HAVE_LINUX_IO_URING_H)
 check_include_file("memory.h" HAVE_MEMORY_H)
 check_include_file("netdb.h" HAVE_NETDB_H)
 check_include_file("netinet/in.h" HAVE_NETINET_IN_H)
 check_include_file("netinet/tcp.h" HAVE_NETINET_TCP_H)
 check_include_file("net/if.h" HAVE_NET_IF_H)
 check_include_file("poll.h" HAVE_POLL_H)
+check_include_file("pthread.h" HAVE_PTHREAD_H)
 check_include_file("stdint.h" HAVE_STDINT_H)
 check_include_file("stdlib.h" HAVE_STDLIB_H)
 check_include_file("strings.h" HAVE_STRINGS_H)
 check_include_file("string.h" HAVE_STRING_H)
+check_include_file("sys/eventfd.h" HAVE_SYS_EVENTFD_H)
 check_include_file("sys/filio.h" HAVE_SYS_FILIO_H)
 check_include_file("sys/ioctl.h" HAVE_SYS_IOCTL_H)
 check_include_file("sys/socket.h" HAVE_SYS_SOCKET_H)
@@ -26,8 +30,13 @@ check_include_file("sys/uio.h" HAVE_SYS_UIO_H)
 check_include_file("sys/vfs.h" HAVE_SYS_VFS_H)
 check_include_file("unistd.h" HAVE_UNISTD_H)
 check_include_file("utime.h" HAVE_UTIME_H)
+check_include_file("immintrin.h" HAVE_IMMINTRIN_H)
+check_include_file("wmmintrin.h" HAVE_WMMINTRIN_H)
 check_include_file("stddef.h" STDC_HEADERS)
 
+include(CheckIncludeFiles)
+check_include_files("sys/time.h;linux/errqueue.h" HAVE_LINUX_ERRQUEUE_H)
+
 include(CheckStructHasMember)
 check_struct_has_member("struct sockaddr" sa_len sys/socket.h HAVE_SOCKADDR_LEN)
 check_struct_has_member("struct sockaddr_storage" ss_family sys/socket.h HAVE_SOCKADDR_STORAGE)
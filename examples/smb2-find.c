@@ -0,0 +1,177 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+Redistribution and use in source and binary forms, with or without modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this list of conditions and the following disclaimer.
+
+2. Redistributions in binary form must reproduce the above copyright notice, this list of conditions and the following disclaimer in the documentation and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE
+
+#include <fnmatch.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+
+struct find_data {
+        const char *name;
+        const char *prune;
+        int bench;
+        uint64_t entries;
+        uint64_t dirs;
+        uint64_t errors;
+};
+
+int usage(void)
+{
+        fprintf(stderr, "Usage:\n"
+                "smb2-find [-b] [-B] [-j <dirs>] [-q <queue>] "
+                "[-n <pattern>] [-p <pattern>] <smb2-url>\n\n"
+                "  -b  Breadth-first instead of depth-first\n"
+                "  -B  Benchmark, count entries instead of printing them\n"
+                "  -j  Directories read at once\n"
+                "  -q  Directories waiting to be read\n"
+                "  -n  Only print entries whose name matches pattern\n"
+                "  -p  Do not descend into directories whose name matches "
+                "pattern\n\n"
+                "URL format: "
+                "smb://[<domain;][<username>@]<host>[:<port>]/<share>/<path>\n");
+        exit(1);
+}
+
+static int entry_cb(struct smb2_context *smb2, const char *path,
+                    struct smb2dirent *ent, void *cb_data)
+{
+        struct find_data *fd = cb_data;
+
+        fd->entries++;
+        if (fd->bench) {
+                return 0;
+        }
+        if (fd->name && fnmatch(fd->name, ent->name, 0)) {
+                return 0;
+        }
+        printf("%s%s\n", path,
+               ent->st.smb2_type == SMB2_TYPE_DIRECTORY ? "/" : "");
+        return 0;
+}
+
+static int prune_cb(struct smb2_context *smb2, const char *path,
+                    struct smb2dirent *ent, void *cb_data)
+{
+        struct find_data *fd = cb_data;
+
+        return fd->prune && !fnmatch(fd->prune, ent->name, 0);
+}
+
+static void dir_cb(struct smb2_context *smb2, const char *path,
+                   int status, void *cb_data)
+{
+        struct find_data *fd = cb_data;
+
+        if (status < 0) {
+                fprintf(stderr, "%s: %s\n", path, smb2_get_error(smb2));
+                fd->errors++;
+                return;
+        }
+        fd->dirs++;
+}
+
+int main(int argc, char *argv[])
+{
+        struct smb2_context *smb2;
+        struct smb2_url *url;
+        struct smb2_walk_options opts;
+        struct find_data fd;
+        struct timespec start, end;
+        double secs;
+        int c, rc;
+
+        memset(&opts, 0, sizeof(opts));
+        memset(&fd, 0, sizeof(fd));
+        while ((c = getopt(argc, argv, "bBj:q:n:p:")) != -1) {
+                switch (c) {
+                case 'b':
+                        opts.order = SMB2_WALK_BREADTH_FIRST;
+                        break;
+                case 'B':
+                        fd.bench = 1;
+                        break;
+                case 'j':
+                        opts.max_dirs = atoi(optarg);
+                        break;
+                case 'q':
+                        opts.max_queue = atoi(optarg);
+                        break;
+                case 'n':
+                        fd.name = optarg;
+                        break;
+                case 'p':
+                        fd.prune = optarg;
+                        break;
+                default:
+                        usage();
+                }
+        }
+        if (optind >= argc) {
+                usage();
+        }
+        opts.entry_cb = entry_cb;
+        opts.prune_cb = prune_cb;
+        opts.dir_cb = dir_cb;
+        opts.cb_data = &fd;
+
+        smb2 = smb2_init_context();
+        if (smb2 == NULL) {
+                fprintf(stderr, "Failed to init context\n");
+                exit(0);
+        }
+
+        url = smb2_parse_url(smb2, argv[optind]);
+        if (url == NULL) {
+                fprintf(stderr, "Failed to parse url: %s\n",
+                        smb2_get_error(smb2));
+                exit(0);
+        }
+
+        smb2_set_security_mode(smb2, SMB2_NEGOTIATE_SIGNING_ENABLED);
+
+        if (smb2_connect_share(smb2, url->server, url->share, url->user) < 0) {
+                printf("smb2_connect_share failed. %s\n", smb2_get_error(smb2));
+                exit(10);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = smb2_walk(smb2, url->path, &opts);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (rc < 0) {
+                printf("smb2_walk failed. %s\n", smb2_get_error(smb2));
+                exit(10);
+        }
+
+        if (fd.bench) {
+                secs = (end.tv_sec - start.tv_sec) +
+                        (end.tv_nsec - start.tv_nsec) / 1e9;
+                printf("%llu directories, %llu entries, %llu errors "
+                       "in %.3f s: %.0f entries/s, %.0f directories/s\n",
+                       (unsigned long long)fd.dirs,
+                       (unsigned long long)fd.entries,
+                       (unsigned long long)fd.errors, secs,
+                       fd.entries / secs, fd.dirs / secs);
+        }
+
+        smb2_disconnect_share(smb2);
+        smb2_destroy_url(url);
+        smb2_destroy_context(smb2);
+
+        return 0;
+}
@@ -36,6 +36,7 @@ extern "C" {
 #define MAX_ERROR_SIZE 256
 
 #define PAD_TO_32BIT(len) ((len + 0x03) & 0xfffffffc)
+#define PAD_TO_64BIT(len) ((len + 0x07) & 0xfffffff8)
 
 #define SMB2_SPL_SIZE 4
 #define SMB2_HEADER_SIZE 64
@@ -43,13 +44,25 @@ extern "C" {
 #define SMB2_SIGNATURE_SIZE 16
 #define SMB2_KEY_SIZE 16
 
+#define SMB2_TRANSFORM_HEADER_SIZE 52
+#define SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE 16
+
 #define SMB2_MAX_VECTORS 256
 
+/* Number of vectors stored inline in struct smb2_io_vectors.
+ * This covers almost every PDU so the vector array only needs to be
+ * allocated, and grown up to SMB2_MAX_VECTORS, for long compound chains.
+ */
+#define SMB2_INLINE_VECTORS 8
+
 struct smb2_io_vectors {
         size_t num_done;
         size_t total_size;
         int niov;
-        struct smb2_iovec iov[SMB2_MAX_VECTORS];
+        int max_iov;
+        /* Either points to inline_iov or to an allocated array */
+        struct smb2_iovec *iov;
+        struct smb2_iovec inline_iov[SMB2_INLINE_VECTORS];
 };
 
 struct smb2_async {
@@ -85,10 +98,16 @@ struct smb2_header {
  * 3: SMB2_RECV_FIXED      The fixed part of the payload. 
  * 4: SMB2_RECV_VARIABLE   Optional variable part of the payload.
  * 5: SMB2_RECV_PAD        Optional padding
+ * 6: SMB2_RECV_TRANSFORM  The rest of an encrypted chain
+ * 7: SMB2_RECV_COMPRESSED The rest of a compressed chain
  *
  * 2-5 will be repeated for compound commands.
  * 4-5 are optional and may or may not be present depending on the
  *     type of command.
+ * 6 follows 2 when the header turns out to be a TRANSFORM_HEADER. The
+ *     decrypted chain is then run through 1-5 from memory.
+ * 7 follows 2 when the header is a COMPRESSION_TRANSFORM_HEADER and the
+ *     decompressed chain is run through 1-5 the same way.
  */
 enum smb2_recv_state {
         SMB2_RECV_SPL = 0,
@@ -96,6 +115,8 @@ enum smb2_recv_state {
         SMB2_RECV_FIXED,
         SMB2_RECV_VARIABLE,
         SMB2_RECV_PAD,
+        SMB2_RECV_TRANSFORM,
+        SMB2_RECV_COMPRESSED,
 };
 
 enum smb2_sec {
@@ -106,6 +127,43 @@ enum smb2_sec {
 
 #define MAX_CREDITS 1024
 
+/* Smallest credit window we ask the server for */
+#define SMB2_MIN_CREDIT_TARGET 64
+
+/* A chain that is waiting for credits can be overtaken by smaller ones at
+ * most this many times. We look this far into the outqueue for them.
+ */
+#define SMB2_MAX_CREDIT_BYPASS 32
+#define SMB2_CREDIT_BYPASS_SCAN 32
+
+/* Maximum number of released PDUs we keep around for reuse */
+#define SMB2_PDU_POOL_SIZE 64
+
+/* Initial size of the receive scratch buffer */
+#define SMB2_RECV_BUF_SIZE 4096
+
+/* Size of the socket readahead buffer */
+#define SMB2_READAHEAD_SIZE 65536
+
+struct smb2_pdu;
+struct smb2_io_uring;
+struct smb2_thread;
+struct AES_ctx;
+struct iovec;
+
+struct smb2_pdu_queue {
+        struct smb2_pdu *head;
+        struct smb2_pdu *tail;
+};
+
+/* PDUs that are waiting for a reply are hashed on their message id.
+ * Message ids are handed out sequentially and we never have more than
+ * MAX_CREDITS of them in flight so using the low bits of the message id
+ * as the index means a bucket rarely holds more than a single PDU.
+ */
+#define SMB2_WAITHASH_SIZE MAX_CREDITS
+#define SMB2_WAITHASH(message_id) ((message_id) & (SMB2_WAITHASH_SIZE - 1))
+
 struct smb2_context {
 
         t_socket fd;
@@ -143,12 +201,76 @@ struct smb2_context {
 
         uint8_t signing_required;
         uint8_t signing_key[SMB2_KEY_SIZE];
+        /* signing_key expanded for AES-CMAC, created on first use */
+        struct AES_ctx *signing_ctx;
+        /* HMAC-SHA256 state with both pads of signing_key absorbed,
+         * copied for every SMB 2.x signature. Created on first use.
+         */
+        struct HMACContext *signing_hmac;
+        /* AES-CMAC unless SMB 3.1.1 negotiated AES-GMAC */
+        uint16_t signing_algorithm;
+        /* Signing statistics */
+        uint64_t sign_count;
+        uint64_t sign_ns;
+        uint64_t verify_count;
+        uint64_t verify_failures;
+        uint64_t verify_bytes;
+        uint64_t verify_ns;
+
+        /* SMB 3.1.1 preauth integrity hash. While preauth is set every
+         * NEGOTIATE and SESSION_SETUP message is chained into the hash,
+         * the final SESSION_SETUP reply excepted. The keys of the session
+         * are then derived from it.
+         */
+        int preauth;
+        uint8_t preauth_hash[SMB2_PREAUTH_HASH_SIZE];
+
+        /* Encryption. seal is set when the application asks for it or
+         * the server requires it for the session or the share. The keys
+         * are derived at session setup and expanded on first use.
+         */
+        uint8_t seal;
+        uint8_t have_seal_keys;
+        uint16_t cipher;
+        uint8_t serverin_key[SMB2_KEY_SIZE];
+        uint8_t serverout_key[SMB2_KEY_SIZE];
+        struct AES_ctx *serverin_ctx;
+        struct AES_ctx *serverout_ctx;
+        uint64_t seal_nonce;
+        /* Buffer an encrypted chain is received and decrypted into */
+        uint8_t *enc;
+        size_t enc_size;
+        /* Set while the decrypted chain is being processed */
+        int decrypting;
+
+        /* SMB 3.1.1 compression. WRITEs and READ replies of at least
+         * compression_threshold bytes are compressed, 0 disables it.
+         * compression_algorithms has bit (1 << algorithm) set for each
+         * algorithm the server agreed to.
+         */
+        size_t compression_threshold;
+        uint32_t compression_algorithms;
+        uint8_t compression_chained;
+        /* Buffers a compressed chain is received and decompressed into */
+        uint8_t *cmp;
+        size_t cmp_size;
+        uint8_t *dec;
+        size_t dec_size;
+        /* Set while the decompressed chain is being processed */
+        int decompressing;
 
         /*
          * For sending PDUs
          */
-	struct smb2_pdu *outqueue;
-	struct smb2_pdu *waitqueue;
+	struct smb2_pdu_queue outqueue;
+        /* The chain that is currently being written to the socket */
+        struct smb2_pdu *writing;
+        /* PDUs we have sent and are waiting for a reply to, in the order
+         * they were sent and also hashed on message id for the lookup when
+         * the reply arrives.
+         */
+	struct smb2_pdu_queue waitqueue;
+	struct smb2_pdu *waithash[SMB2_WAITHASH_SIZE];
 
 
         /*
@@ -164,6 +286,44 @@ struct smb2_context {
         /* Offset into smb2->in where the payload for the current PDU starts */
         size_t payload_offset;
 
+        /* Scratch buffer for the parts of a reply chain that do not go
+         * straight into application buffers: fixed parts, variable parts,
+         * padding and the bodies of PENDING replies. It is carved up
+         * sequentially while a chain is received and reset when the next
+         * chain starts. If a chain does not fit we fall back to malloc()
+         * and grow the buffer to the new high water mark before the next
+         * chain, so a steady stream of replies needs no allocations.
+         */
+        uint8_t *recv_buf;
+        size_t recv_buf_size;
+        size_t recv_buf_used;
+        size_t recv_buf_needed;
+        /* Number of allocations made by the receive path, see
+         * smb2_get_recv_stats().
+         */
+        uint64_t recv_alloc_count;
+
+        /* Readahead buffer for the socket. Every readv() also reads into
+         * this buffer after the vectors for the current receive phase so
+         * that a single syscall picks up as many replies as are available.
+         * Following phases are then served from this buffer until it is
+         * drained. It is always empty when smb2_read_from_socket() returns.
+         */
+        uint8_t *readahead;
+        size_t readahead_start;
+        size_t readahead_end;
+
+        /* io_uring transport, see io-uring.c. io_uring_entries is non-zero
+         * if the application asked for it and the ring is created once the
+         * socket is connected.
+         */
+        struct smb2_io_uring *io_uring;
+        int io_uring_entries;
+        int io_uring_attach_fd;
+
+        /* Thread-safe mode, see thread.c. NULL unless it is turned on. */
+        struct smb2_thread *thread;
+
         /* Pointer to the current PDU that we are receiving the reply for.
          * Only valid once the full smb2 header has been received.
          */
@@ -171,24 +331,65 @@ struct smb2_context {
 
         /* Server capabilities */
         uint8_t supports_multi_credit;
+        uint8_t supports_encryption;
 
         uint32_t max_transact_size;
         uint32_t max_read_size;
         uint32_t max_write_size;
         uint16_t dialect;
 
+        /* Largest QUERY_DIRECTORY reply to ask for, 0 means
+         * max_transact_size. See smb2_set_dir_query_size().
+         */
+        uint32_t dir_query_size;
+
         char error_string[MAX_ERROR_SIZE];
 
         /* Open filehandles */
         struct smb2fh *fhs;
         /* Open dirhandles */
         struct smb2dir *dirs;
+
+        /* Credit accounting. smb2->credits is what we can spend right now,
+         * credits_queued is needed by the outqueue, credits_outstanding
+         * was spent on requests we are waiting for a reply to and
+         * credits_requested is what we asked for in requests we have not
+         * seen the final reply to yet.
+         */
+        int credits_queued;
+        int credits_outstanding;
+        int credits_requested;
+        int credit_target;
+        uint64_t credits_granted;
+        uint64_t credit_stalls;
+        uint64_t credit_bypasses;
+
+        /* Released PDUs that can be reused by smb2_allocate_pdu() */
+        struct smb2_pdu *pdu_pool;
+        int pdu_pool_size;
+
+        /* MSG_ZEROCOPY sends for chains containing WRITEs at least this
+         * large. 0 means disabled.
+         * Every successful zerocopy send is numbered by the kernel and the
+         * kernel reports ranges of sends whose pages it has released on the
+         * socket error queue. WRITE PDUs whose reply arrives before that
+         * are parked on zerocopy_queue and completed from there.
+         */
+        size_t zerocopy_threshold;
+        uint32_t zerocopy_next;
+        uint32_t zerocopy_done;
+        struct smb2_pdu_queue zerocopy_queue;
+        /* Number of sends the kernel ended up copying anyway */
+        uint64_t zerocopy_copied;
 };
 
 #define SMB2_MAX_PDU_SIZE 16*1024*1024
 
 struct smb2_pdu {
         struct smb2_pdu *next;
+        struct smb2_pdu *prev;
+        /* Chain for the waithash bucket */
+        struct smb2_pdu *next_hash;
         struct smb2_header header;
 
         struct smb2_pdu *next_compound;
@@ -202,6 +403,40 @@ struct smb2_pdu {
         /* pointer to the unmarshalled payload in a reply */
         void *payload;
 
+        /* Data we need to retain between request/reply for QUERY INFO */
+        uint8_t info_type;
+        uint8_t file_info_class;
+
+        /* SPL of the chain when this is the first PDU in it. It must stay
+         * valid until the data is acknowledged when sending with
+         * MSG_ZEROCOPY.
+         */
+        uint32_t spl;
+
+        /* Number of times smaller chains were sent ahead of this one */
+        int bypassed;
+
+        /* Set on the PDUs of a chain that must be encrypted. The whole
+         * chain is encrypted into crypt of the first PDU when it is about
+         * to be written and the reply must arrive encrypted too.
+         */
+        int seal;
+        uint8_t *crypt;
+        size_t crypt_len;
+        /* Set once the chain has been compressed and/or encrypted. A WRITE
+         * may be compressed into crypt as well, in which case it is sent
+         * compressed whether it is encrypted or not.
+         */
+        uint8_t transformed;
+
+        /* Sent with MSG_ZEROCOPY as send number zerocopy_seq */
+        int zerocopy;
+        uint32_t zerocopy_seq;
+        /* Status of the reply while waiting for the kernel to release
+         * the pages.
+         */
+        uint32_t zerocopy_status;
+
         /* For sending/receiving
          * out contains at least two vectors:
          * [0]  64 bytes for the smb header
@@ -209,13 +444,12 @@ struct smb2_pdu {
          *
          * in contains at least one vector:
          * [0+] command and and extra parameters
+         *
+         * These must be the last members of the structure. When a PDU is
+         * reused from the pool only the members before them are cleared.
          */
         struct smb2_io_vectors out;
         struct smb2_io_vectors in;
-
-        /* Data we need to retain between request/reply for QUERY INFO */
-        uint8_t info_type;
-        uint8_t file_info_class;
 };
 
 /* UCS2 is always in Little Endianness */
@@ -234,6 +468,14 @@ struct ucs2 *utf8_to_ucs2(const char *utf8);
  */
 const char *ucs2_to_utf8(const uint16_t *str, int len);
 
+/* Returns how many bytes, terminating NUL included, the UTF8 form of a
+ * UCS2 string needs.
+ */
+int ucs2_to_utf8_len(const uint16_t *str, int len);
+
+/* Converts a UCS2 string to UTF8 in a buffer of ucs2_to_utf8_len() bytes */
+void ucs2_to_utf8_buf(const uint16_t *str, int len, char *utf8);
+
 /* Convert a win timestamp to a unix timeval */
 void win_to_timeval(uint64_t smb2_time, struct smb2_timeval *tv);
 
@@ -256,6 +498,7 @@ int smb2_pad_to_64bit(struct smb2_context *smb2, struct smb2_io_vectors *v);
 struct smb2_pdu *smb2_allocate_pdu(struct smb2_context *smb2,
                                    enum smb2_command command,
                                    smb2_command_cb cb, void *cb_data);
+void smb2_encode_chain(struct smb2_context *smb2, struct smb2_pdu *pdu);
 int smb2_process_payload_fixed(struct smb2_context *smb2,
                                struct smb2_pdu *pdu);
 int smb2_process_payload_variable(struct smb2_context *smb2,
@@ -263,7 +506,34 @@ int smb2_process_payload_variable(struct smb2_context *smb2,
 int smb2_get_fixed_size(struct smb2_context *smb2, struct smb2_pdu *pdu);
         
 struct smb2_pdu *smb2_find_pdu(struct smb2_context *smb2, uint64_t message_id);
+void smb2_add_to_waitqueue(struct smb2_context *smb2, struct smb2_pdu *pdu);
+void smb2_remove_from_waitqueue(struct smb2_context *smb2,
+                                struct smb2_pdu *pdu);
 void smb2_free_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v);
+void smb2_destroy_iovector(struct smb2_context *smb2,
+                           struct smb2_io_vectors *v);
+void smb2_free_pdu_pool(struct smb2_context *smb2);
+void smb2_zerocopy_flush(struct smb2_context *smb2);
+
+int smb2_is_service_thread(struct smb2_context *smb2);
+void smb2_submit_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
+int smb2_drain_submitted(struct smb2_context *smb2);
+void smb2_lock(struct smb2_context *smb2);
+void smb2_unlock(struct smb2_context *smb2);
+char *smb2_error_buffer(struct smb2_context *smb2);
+void smb2_free_thread(struct smb2_context *smb2);
+
+int smb2_io_uring_start(struct smb2_context *smb2);
+void smb2_io_uring_stop(struct smb2_context *smb2);
+int smb2_io_uring_get_fd(struct smb2_context *smb2);
+int smb2_io_uring_write_busy(struct smb2_context *smb2);
+int smb2_io_uring_writev(struct smb2_context *smb2, struct iovec *iov,
+                         int niov);
+int smb2_io_uring_process(struct smb2_context *smb2,
+                          int (*recv_cb)(struct smb2_context *smb2,
+                                         uint8_t *buf, size_t len),
+                          void (*write_cb)(struct smb2_context *smb2,
+                                           size_t count));
 
 int smb2_decode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
                        struct smb2_header *hdr);
@@ -325,10 +595,19 @@ int smb2_process_ioctl_fixed(struct smb2_context *smb2,
 int smb2_process_ioctl_variable(struct smb2_context *smb2,
                                 struct smb2_pdu *pdu);
 
+/* Size of the UTF8 name, terminating NUL included, of the entry at the
+ * start of vec, or -1 if the entry does not fit in vec.
+ */
+int smb2_fileidfulldirectoryinformation_name_size(
+        struct smb2_context *smb2,
+        struct smb2_iovec *vec);
+/* The name is converted into name, which must hold
+ * smb2_fileidfulldirectoryinformation_name_size() bytes.
+ */
 int smb2_decode_fileidfulldirectoryinformation(
         struct smb2_context *smb2,
         struct smb2_fileidfulldirectoryinformation *fs,
-        struct smb2_iovec *vec);
+        struct smb2_iovec *vec, char *name);
 
 int smb2_decode_file_basic_info(struct smb2_context *smb2,
                                 void *memctx,
@@ -375,6 +654,14 @@ int smb2_decode_file_fs_sector_size_info(struct smb2_context *smb2,
                                      struct smb2_iovec *vec);
 void smb2_free_all_fhs(struct smb2_context *smb2);
 void smb2_free_all_dirs(struct smb2_context *smb2);
+int smb2_any_write_behind(struct smb2_context *smb2);
+/* smb2_opendir_stream_async() asking for at most query_size bytes per
+ * QUERY_DIRECTORY instead of the smb2_set_dir_query_size() setting.
+ */
+int smb2_opendir_sized_async(struct smb2_context *smb2, const char *path,
+                             uint32_t query_size, smb2_command_cb cb,
+                             void *cb_data);
+uint64_t smb2_max_message_size(struct smb2_context *smb2);
 #ifdef __cplusplus
 }
 #endif
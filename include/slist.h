@@ -60,4 +60,36 @@
 		(*list) = head; \
 	} while (0);
 
+/* Doubly linked queues. The list is a structure holding a head and a
+ * tail pointer and the items carry both a next and a prev pointer so that
+ * both appending and removing an item are O(1).
+ */
+#define SMB2_DLIST_ADD_END(list, item) \
+	do {							\
+		(item)->next = NULL;				\
+		(item)->prev = (list)->tail;			\
+		if ((list)->tail) {				\
+			(list)->tail->next = (item);		\
+		} else {					\
+			(list)->head = (item);			\
+		}						\
+		(list)->tail = (item);				\
+	} while (0);
+
+#define SMB2_DLIST_REMOVE(list, item) \
+	do {							\
+		if ((item)->prev) {				\
+			(item)->prev->next = (item)->next;	\
+		} else {					\
+			(list)->head = (item)->next;		\
+		}						\
+		if ((item)->next) {				\
+			(item)->next->prev = (item)->prev;	\
+		} else {					\
+			(list)->tail = (item)->prev;		\
+		}						\
+		(item)->next = NULL;				\
+		(item)->prev = NULL;				\
+	} while (0);
+
 #endif /* __smb2_slist_h__ */
@@ -129,6 +129,231 @@ int smb2_which_events(struct smb2_context *smb2);
  */
 int smb2_service(struct smb2_context *smb2, int revents);
 
+/*
+ * Credit statistics for the connection.
+ */
+struct smb2_credit_stats {
+        /* Credits we can spend right now */
+        uint32_t available;
+        /* Credits spent on requests that are waiting for a reply */
+        uint32_t outstanding;
+        /* Credits needed by requests waiting to be sent */
+        uint32_t queued;
+        /* The window of credits we are asking the server for */
+        uint32_t target;
+        /* Total number of credits the server has granted */
+        uint64_t granted;
+        /* Number of times no request could be sent for lack of credits */
+        uint64_t stalls;
+        /* Number of times a request was sent ahead of one waiting for
+         * credits.
+         */
+        uint64_t bypasses;
+};
+
+void smb2_get_credit_stats(struct smb2_context *smb2,
+                           struct smb2_credit_stats *stats);
+
+/*
+ * Receive path statistics for the connection.
+ */
+struct smb2_recv_stats {
+        /* Number of buffers the receive path has allocated or grown.
+         * Steady traffic reuses them so this stops growing once the
+         * largest replies have been seen.
+         */
+        uint64_t alloc_count;
+};
+
+void smb2_get_recv_stats(struct smb2_context *smb2,
+                         struct smb2_recv_stats *stats);
+
+/*
+ * Signing statistics for the connection. Signatures are verified on every
+ * signed reply before its callback is invoked.
+ */
+struct smb2_signing_stats {
+        /* Number of requests signed and the time spent signing them */
+        uint64_t sign_count;
+        uint64_t sign_ns;
+        /* Number of replies verified, the bytes covered by the
+         * signatures and the time spent verifying them.
+         */
+        uint64_t verify_count;
+        uint64_t verify_bytes;
+        uint64_t verify_ns;
+        /* Number of replies that failed verification */
+        uint64_t verify_failures;
+};
+
+void smb2_get_signing_stats(struct smb2_context *smb2,
+                            struct smb2_signing_stats *stats);
+
+/*
+ * Use io_uring instead of readv()/writev() for the socket.
+ * Only available on Linux and must be called before connecting.
+ *
+ * Once the socket is connected smb2_get_fd() returns the file descriptor
+ * of the ring instead of the socket. It is polled and serviced just like
+ * the socket through smb2_which_events() and smb2_service().
+ *
+ * entries is the size of the submission queue.
+ * attach_fd is the file descriptor of an application owned io_uring whose
+ * kernel worker pool should be shared with the one used by libsmb2, or -1.
+ *
+ * Returns:
+ *  0 : Success
+ * <0 : io_uring is not available in this build.
+ */
+int smb2_set_io_uring(struct smb2_context *smb2, int entries, int attach_fd);
+
+/*
+ * Send WRITE requests of at least threshold bytes with MSG_ZEROCOPY so the
+ * kernel sends straight from the application buffer instead of copying it.
+ * Only available on Linux. 0 disables zerocopy, which is the default.
+ *
+ * The callback for such a WRITE is deferred until the kernel has released
+ * the buffer, so the application must not touch the buffer before then.
+ * Completions are reported through the socket error queue which raises
+ * POLLERR, so the application must pass POLLERR on to smb2_service().
+ * Zerocopy is not used together with io_uring.
+ *
+ * Returns:
+ *  0 : Success
+ * <0 : Zerocopy is not supported.
+ */
+int smb2_set_zerocopy_threshold(struct smb2_context *smb2, size_t threshold);
+
+/*
+ * Allow other threads to submit requests on the context.
+ *
+ * The thread that turns this on becomes the service thread. It alone may
+ * call smb2_which_events(), smb2_service(), the synchronous functions and
+ * smb2_destroy_context(). Any thread may call the *_async functions
+ * and smb2_queue_pdu(). Requests from other threads are handed to the
+ * service thread through a lock-free queue and sent in the order they
+ * were submitted. Callbacks are always invoked on the service thread.
+ *
+ * The service thread must poll smb2_get_wakeup_fd() for POLLIN alongside
+ * smb2_get_fd() and call smb2_service() when either is ready, with the
+ * events of smb2_get_fd(), which may be 0.
+ *
+ * A file handle or directory must not be used by two threads at the same
+ * time. smb2_read_async() and smb2_write_async() use the offset of the
+ * file handle, use smb2_pread_async() and smb2_pwrite_async() on handles
+ * that are shared between threads.
+ *
+ * Write-behind, see smb2_set_write_behind(), can not be used in
+ * thread-safe mode. Turning thread-safe mode on fails with -EINVAL while
+ * a file handle has it enabled.
+ *
+ * Thread-safe mode can only be turned off again by the service thread
+ * once no other thread uses the context.
+ *
+ * Returns:
+ *  0 : Success
+ * <0 : Threads are not supported in this build or the wakeup fd could not
+ *      be created.
+ */
+int smb2_set_thread_safe(struct smb2_context *smb2, int val);
+
+/*
+ * File descriptor that becomes readable when other threads have submitted
+ * requests, or -1 if the context is not in thread-safe mode.
+ */
+t_socket smb2_get_wakeup_fd(struct smb2_context *smb2);
+
+/*
+ * Completion queues.
+ *
+ * As an alternative to a callback per request, any smb2_*_async()
+ * function can be given smb2_cq_cb as the callback and a struct smb2_cqe
+ * prepared with smb2_cqe_prep() as cb_data. When the request completes
+ * smb2_cq_cb only appends the entry to its queue, and the application
+ * harvests the completions in batches with smb2_cq_harvest() once
+ * smb2_service() has returned. No application code runs from inside
+ * smb2_service() and nothing is allocated per request.
+ *
+ *     struct smb2_cqe cqe[N], *done[64];
+ *
+ *     smb2_cqe_prep(cq, &cqe[i], my_request);
+ *     smb2_pread_async(smb2, fh, buf, count, offset, smb2_cq_cb, &cqe[i]);
+ *     ...
+ *     smb2_service(smb2, revents);
+ *     n = smb2_cq_harvest(cq, done, 64);
+ *
+ * A queue can be shared by several contexts. In thread-safe mode, see
+ * smb2_set_thread_safe(), each thread can submit with a queue of its own
+ * and harvest it itself while the service thread fills it. A queue must
+ * only be harvested by one thread at a time.
+ *
+ * The entry belongs to the application and must not be touched from
+ * submission until it has been harvested. If the async function fails no
+ * entry is queued.
+ */
+struct smb2_cq;
+
+struct smb2_cqe {
+        /* Set by smb2_cqe_prep() */
+        void *user_data;
+        /* Set on completion, as passed to a smb2_command_cb */
+        int status;
+        /*
+         * Only valid for data that outlives the callback, like the
+         * handle from smb2_open_async() or smb2_opendir_async(). The
+         * replies passed to the callbacks of the smb2_cmd_*_async()
+         * functions are freed before the entry is harvested.
+         */
+        void *command_data;
+        /* Private */
+        struct smb2_cq *cq;
+        struct smb2_cqe *next;
+};
+
+/*
+ * Create a completion queue.
+ * Function returns
+ *  NULL : Failed to create the queue.
+ *  *cq  : A pointer to the completion queue.
+ */
+struct smb2_cq *smb2_init_cq(void);
+
+/*
+ * Destroy a completion queue. Entries still queued are not touched.
+ * The queue must outlive every request submitted with it, destroying the
+ * context first completes any that are still outstanding.
+ */
+void smb2_destroy_cq(struct smb2_cq *cq);
+
+/*
+ * File descriptor that is readable, POLLIN, while there are completions
+ * to harvest, for use with poll(), epoll or io_uring. -1 on platforms
+ * without eventfd or pipes.
+ */
+t_socket smb2_cq_get_fd(struct smb2_cq *cq);
+
+/*
+ * Prepare cqe for a request that completes on cq. user_data is handed
+ * back unchanged in the harvested entry.
+ */
+void smb2_cqe_prep(struct smb2_cq *cq, struct smb2_cqe *cqe,
+                   void *user_data);
+
+/*
+ * Callback to pass to the smb2_*_async() functions together with a
+ * prepared struct smb2_cqe as cb_data.
+ */
+void smb2_cq_cb(struct smb2_context *smb2, int status,
+                void *command_data, void *cb_data);
+
+/*
+ * Harvest up to max completed entries, oldest first, into cqes.
+ * Entries beyond max are kept for the next call.
+ *
+ * Returns the number of entries harvested, 0 if there were none.
+ */
+int smb2_cq_harvest(struct smb2_cq *cq, struct smb2_cqe **cqes, int max);
+
 /*
  * Set the security mode for the connection.
  * This is a combination of the flags SMB2_NEGOTIATE_SIGNING_ENABLED
@@ -137,6 +362,39 @@ int smb2_service(struct smb2_context *smb2, int revents);
  */
 void smb2_set_security_mode(struct smb2_context *smb2, uint16_t security_mode);
 
+/*
+ * Set whether all traffic on the session should be encrypted.
+ * This requires SMB 3.0 or later and fails the connect if the server
+ * does not support encryption. Encryption is always used when the server
+ * requires it for the session or the share.
+ * Default is 0.
+ */
+void smb2_set_seal(struct smb2_context *smb2, int val);
+
+/*
+ * Compress WRITE requests and ask for compressed READ replies when they
+ * carry at least threshold bytes. Compression is offered when connecting
+ * with SMB 3.1.1 and only used if the server agrees to LZ77 or
+ * LZ77+Huffman. Runs of identical bytes, such as the holes of sparse
+ * files, are sent as Pattern_V1 payloads if the server supports chained
+ * compression. Data that does not compress is sent as is. Compressed
+ * WRITEs are not sent with MSG_ZEROCOPY.
+ * This must be set before connecting. 0 disables compression, which is
+ * the default.
+ */
+void smb2_set_compression_threshold(struct smb2_context *smb2,
+                                    size_t threshold);
+
+/*
+ * Largest reply to ask for when listing a directory. Each QUERY_DIRECTORY
+ * asks for this many bytes of entries, as long as the server's
+ * max_transact_size allows it, and is charged the matching number of
+ * credits. Without multi-credit support replies are limited to 64 KiB.
+ * 0 means max_transact_size, which is the default. Smaller values make
+ * for smaller batches with smb2_opendir_stream_async().
+ */
+void smb2_set_dir_query_size(struct smb2_context *smb2, uint32_t size);
+
 /*
  * Set the username that we will try to authenticate as.
  * Default is to try to authenticate as the current user.
@@ -305,6 +563,10 @@ struct smb2dir;
 /*
  * Async opendir()
  *
+ * The directory is opened and read in the same compound request, a
+ * directory whose entries fit in one reply is listed in a single round
+ * trip.
+ *
  * Returns
  *  0 : The operation was initiated. Result of the operation will be reported
  * through the callback function.
@@ -327,6 +589,154 @@ int smb2_opendir_async(struct smb2_context *smb2, const char *path,
  */
 struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path);
 
+/*
+ * Async streaming opendir()
+ *
+ * Like smb2_opendir_async() but the callback is invoked as soon as the
+ * first batch of entries has arrived instead of after the whole
+ * directory has been read. smb2_readdir() returns the entries of the
+ * current batch and then NULL, smb2_readdir_next_async() moves on to the
+ * next batch. The batch after the current one is always being fetched in
+ * the background, so at most two batches are held in memory.
+ *
+ * smb2_telldir() counts from the start of the directory but
+ * smb2_seekdir() and smb2_rewinddir() can only move within the current
+ * batch.
+ *
+ * Returns
+ *  0 : The operation was initiated. Result of the operation will be reported
+ * through the callback function.
+ * <0 : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : Success.
+ *          Command_data is struct smb2dir.
+ *          This structure is freed using smb2_closedir().
+ * -errno : An error occured.
+ *          Command_data is NULL.
+ */
+int smb2_opendir_stream_async(struct smb2_context *smb2, const char *path,
+                              smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync streaming opendir()
+ *
+ * Returns NULL on failure.
+ */
+struct smb2dir *smb2_opendir_stream(struct smb2_context *smb2,
+                                    const char *path);
+
+/*
+ * Async move to the next batch of a directory opened with
+ * smb2_opendir_stream_async(). The entries of the current batch are
+ * freed. If the next batch has already arrived the callback is invoked
+ * before smb2_readdir_next_async() returns.
+ *
+ * Returns
+ *  0 : The operation was initiated. Result of the operation will be reported
+ * through the callback function.
+ * <0 : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *     >0 : Number of entries in the new batch.
+ *      0 : There are no more entries.
+ * -errno : An error occured.
+ */
+int smb2_readdir_next_async(struct smb2_context *smb2, struct smb2dir *dir,
+                            smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync move to the next batch of a streaming directory.
+ *
+ * Returns the number of entries in the new batch, 0 at the end of the
+ * directory or -errno.
+ */
+int smb2_readdir_next(struct smb2_context *smb2, struct smb2dir *dir);
+
+/*
+ * Recursive directory walk.
+ *
+ * smb2_walk_async() lists path and every directory below it. Several
+ * directories are opened and read at once, up to max_dirs of them, while
+ * the directories found and not opened yet wait in a work queue of at
+ * most max_queue entries. A directory whose next subdirectory does not
+ * fit in the queue is paused until there is room again. If every open
+ * directory is paused that subdirectory is opened right away, so at most
+ * max_dirs plus the depth of the tree directories are open at once.
+ *
+ * order picks the next directory to open from the queue:
+ * SMB2_WALK_DEPTH_FIRST takes the one found last, which keeps the queue
+ * short, SMB2_WALK_BREADTH_FIRST the one found first. As directories are
+ * read concurrently entries are not reported in a strict order.
+ *
+ * Directories are read 64 KiB at a time, or in smaller batches if
+ * smb2_set_dir_query_size() asks for it, so that the queries of many
+ * directories fit in the credit window.
+ *
+ * The callbacks in struct smb2_walk_options, all of them optional, are
+ * invoked from smb2_service() with its cb_data. path is relative to the
+ * share and only valid during the call.
+ *
+ * entry_cb is invoked for every entry but "." and "..". Returning <0
+ * stops the walk with that status.
+ * prune_cb is invoked for every subdirectory, after entry_cb. Returning
+ * non-zero skips it and everything below it.
+ * dir_cb is invoked once a directory has been read to the end, with
+ * status 0, or when it could not be opened or read, with -errno. The
+ * walk goes on with the other directories.
+ */
+#define SMB2_WALK_DEPTH_FIRST   0
+#define SMB2_WALK_BREADTH_FIRST 1
+
+typedef int (*smb2_walk_entry_cb)(struct smb2_context *smb2, const char *path,
+                                  struct smb2dirent *ent, void *cb_data);
+typedef int (*smb2_walk_prune_cb)(struct smb2_context *smb2, const char *path,
+                                  struct smb2dirent *ent, void *cb_data);
+typedef void (*smb2_walk_dir_cb)(struct smb2_context *smb2, const char *path,
+                                 int status, void *cb_data);
+
+struct smb2_walk_options {
+        int order;
+        /* Directories being opened or read at once. 0 picks a value that
+         * fits the credits granted so far.
+         */
+        int max_dirs;
+        /* Directories waiting to be opened. 0 means 4096. */
+        int max_queue;
+        smb2_walk_entry_cb entry_cb;
+        smb2_walk_prune_cb prune_cb;
+        smb2_walk_dir_cb dir_cb;
+        void *cb_data;
+};
+
+/*
+ * Async recursive directory walk. opts can be NULL for the defaults and
+ * is copied. The walk is driven from smb2_service() and must be started
+ * from the thread calling it.
+ *
+ * Returns
+ *  0 : The operation was initiated. Result of the operation will be reported
+ * through the callback function.
+ * <0 : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *      0 : The whole tree has been walked.
+ * -errno : path could not be opened, or the walk was stopped by entry_cb
+ *          or by a failure to allocate memory.
+ *          Command_data is NULL.
+ */
+int smb2_walk_async(struct smb2_context *smb2, const char *path,
+                    const struct smb2_walk_options *opts,
+                    smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync recursive directory walk.
+ *
+ * Returns 0 on success or -errno.
+ */
+int smb2_walk(struct smb2_context *smb2, const char *path,
+              const struct smb2_walk_options *opts);
+
 /*
  * closedir()
  */
@@ -495,6 +905,36 @@ int smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
 int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                uint8_t *buf, uint32_t count, uint64_t offset);
 
+/*
+ * Async parallel pread()
+ * Unlike smb2_pread_async() the read is not limited to the maximum read
+ * size of the server. The range is split into READs of up to the maximum
+ * read size and as many of them are kept in flight as the credits granted
+ * by the server allow. The data is placed directly into buf.
+ * count must not exceed INT32_MAX.
+ *
+ * Returns
+ *  0     : The operation was initiated. Result of the operation will be
+ *          reported through the callback function.
+ * -errno : There was an error. The callback function will not be invoked.
+ *
+ * When the callback is invoked, status indicates the result:
+ *    >=0 : Number of bytes read. This is less than count only if the
+ *          end of the file was reached.
+ * -errno : An error occured.
+ *
+ * Command_data is always NULL.
+ */
+int smb2_pread_parallel_async(struct smb2_context *smb2, struct smb2fh *fh,
+                              uint8_t *buf, uint32_t count, uint64_t offset,
+                              smb2_command_cb cb, void *cb_data);
+
+/*
+ * Sync parallel pread()
+ */
+int smb2_pread_parallel(struct smb2_context *smb2, struct smb2fh *fh,
+                        uint8_t *buf, uint32_t count, uint64_t offset);
+
 /*
  * PWRITE
  */
@@ -526,6 +966,36 @@ int smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
 int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
                 uint8_t *buf, uint32_t count, uint64_t offset);
 
+/*
+ * Enable write-behind for a file handle.
+ *
+ * With write-behind enabled, smb2_pwrite*() and smb2_write*() copy the data
+ * and complete right away, up to max_inflight WRITEs are kept in flight
+ * and adjacent writes are coalesced into WRITEs of up to the maximum write
+ * size while the pipeline is full. The callback of a write is only held
+ * back while there is more data buffered than fits in the pipeline.
+ * Writes are not limited to the maximum write size.
+ *
+ * An error from a WRITE is reported by the next write, fsync or close on
+ * the handle. smb2_fsync*() and smb2_close*() wait until all buffered data
+ * is written. Reads wait until all data written before them has been
+ * written, and writes issued after such a read wait for the read to be
+ * sent.
+ *
+ * max_inflight of 0 disables write-behind again, which is the default.
+ * This fails with -EBUSY until all data written has been written, call
+ * smb2_fsync() first.
+ *
+ * Write-behind can not be enabled in thread-safe mode, see
+ * smb2_set_thread_safe().
+ *
+ * Returns:
+ *  0     : Success
+ * -errno : An error occured.
+ */
+int smb2_set_write_behind(struct smb2_context *smb2, struct smb2fh *fh,
+                          int max_inflight);
+
 /*
  * READ
  */
@@ -82,7 +82,8 @@ enum smb2_negotiate_version {
         SMB2_VERSION_0202 = 0x0202,
         SMB2_VERSION_0210 = 0x0210,
         SMB2_VERSION_0300 = 0x0300,
-        SMB2_VERSION_0302 = 0x0302
+        SMB2_VERSION_0302 = 0x0302,
+        SMB2_VERSION_0311 = 0x0311
 };
 
 #define SMB2_GLOBAL_CAP_DFS                0x00000001
@@ -93,7 +94,42 @@ enum smb2_negotiate_version {
 #define SMB2_GLOBAL_CAP_DIRECTORY_LEASING  0x00000020
 #define SMB2_GLOBAL_CAP_ENCRYPTION         0x00000040
 
+/* Cipher ids used in the TRANSFORM_HEADER and the encryption
+ * negotiate context.
+ */
+#define SMB2_ENCRYPTION_AES128_CCM         0x0001
+#define SMB2_ENCRYPTION_AES128_GCM         0x0002
+
+/* SMB 3.1.1 negotiate contexts */
+#define SMB2_PREAUTH_INTEGRITY_CAPABILITIES 0x0001
+#define SMB2_ENCRYPTION_CAPABILITIES        0x0002
+#define SMB2_COMPRESSION_CAPABILITIES       0x0003
+#define SMB2_SIGNING_CAPABILITIES           0x0008
+
+#define SMB2_PREAUTH_INTEGRITY_SHA512       0x0001
+#define SMB2_PREAUTH_SALT_SIZE              32
+#define SMB2_PREAUTH_HASH_SIZE              64
+
+#define SMB2_SIGNING_HMAC_SHA256            0x0000
+#define SMB2_SIGNING_AES_CMAC               0x0001
+#define SMB2_SIGNING_AES_GMAC               0x0002
+
+/* Compression algorithms used in the COMPRESSION_TRANSFORM_HEADER and the
+ * compression negotiate context.
+ */
+#define SMB2_COMPRESSION_NONE               0x0000
+#define SMB2_COMPRESSION_LZNT1              0x0001
+#define SMB2_COMPRESSION_LZ77               0x0002
+#define SMB2_COMPRESSION_LZ77_HUFFMAN       0x0003
+#define SMB2_COMPRESSION_PATTERN_V1         0x0004
+
+#define SMB2_COMPRESSION_CAPABILITIES_FLAG_NONE    0x00000000
+#define SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED 0x00000001
+
 #define SMB2_NEGOTIATE_MAX_DIALECTS 10
+#define SMB2_NEGOTIATE_MAX_CIPHERS 4
+#define SMB2_NEGOTIATE_MAX_SIGNING_ALGORITHMS 4
+#define SMB2_NEGOTIATE_MAX_COMPRESSION_ALGORITHMS 4
 
 #define SMB2_NEGOTIATE_REQUEST_SIZE 36
 
@@ -107,6 +143,18 @@ struct smb2_negotiate_request {
         smb2_guid client_guid;
         uint64_t client_start_time;
         uint16_t dialects[SMB2_NEGOTIATE_MAX_DIALECTS];
+
+        /* Negotiate contexts. These are only sent, in place of
+         * client_start_time, if SMB2_VERSION_0311 is one of the dialects.
+         */
+        uint8_t preauth_salt[SMB2_PREAUTH_SALT_SIZE];
+        uint16_t cipher_count;
+        uint16_t ciphers[SMB2_NEGOTIATE_MAX_CIPHERS];
+        uint16_t signing_algorithm_count;
+        uint16_t signing_algorithms[SMB2_NEGOTIATE_MAX_SIGNING_ALGORITHMS];
+        uint16_t compression_algorithm_count;
+        uint16_t compression_algorithms[SMB2_NEGOTIATE_MAX_COMPRESSION_ALGORITHMS];
+        uint32_t compression_flags;
 };
 
 #define SMB2_NEGOTIATE_REPLY_SIZE 65
@@ -124,6 +172,19 @@ struct smb2_negotiate_reply {
         uint16_t security_buffer_length;
         uint16_t security_buffer_offset;
         uint8_t *security_buffer;
+
+        uint16_t negotiate_context_count;
+        uint32_t negotiate_context_offset;
+
+        /* Negotiate contexts selected by an SMB 3.1.1 server.
+         * Zero if the context was not present.
+         */
+        uint16_t preauth_hash_algorithm;
+        uint16_t cipher;
+        uint16_t signing_algorithm;
+        uint16_t compression_algorithm_count;
+        uint16_t compression_algorithms[SMB2_NEGOTIATE_MAX_COMPRESSION_ALGORITHMS];
+        uint32_t compression_flags;
 };
 
 /* session setup flags */
@@ -431,7 +492,8 @@ struct smb2_query_directory_reply {
 
 #define SMB2_READ_REQUEST_SIZE 49
 
-#define SMB2_READFLAG_READ_UNBUFFERED 0x01
+#define SMB2_READFLAG_READ_UNBUFFERED    0x01
+#define SMB2_READFLAG_REQUEST_COMPRESSED 0x04
 
 #define SMB2_CHANNEL_NONE               0x00000000
 #define SMB2_CHANNEL_RDMA_V1            0x00000001
@@ -28,10 +28,22 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /*****************************************************************************/
 /* Includes:                                                                 */
 /*****************************************************************************/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
 
+#if defined(HAVE_CPUID_H) && defined(HAVE_WMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define AES_USE_AESNI 1
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -57,19 +69,9 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 /* Private variables:                                                        */
 /*****************************************************************************/
 // state - array holding the intermediate results during decryption.
+// There is no file level state. The round keys and the CBC Iv live in
+// struct AES_ctx so any number of threads can use their own contexts.
 typedef uint8_t state_t[4][4];
-static state_t* state;
-
-// The array that stores the round keys.
-static uint8_t RoundKey[176];
-
-// The Key input to the AES Program
-static const uint8_t* Key;
-
-#if defined(CBC) && CBC
-  // Initial Vector used only for CBC mode
-  static uint8_t* Iv;
-#endif
 
 // The lookup-tables are marked const so they can be placed in read-only storage instead of RAM
 // The numbers below can be computed dynamically trading ROM for RAM - 
@@ -148,7 +150,7 @@ static uint8_t getSBoxInvert(uint8_t num)
 }
 
 // This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(void)
+static void KeyExpansion(uint8_t* RoundKey, const uint8_t* Key)
 {
   uint32_t i, j, k;
   uint8_t tempa[4]; // Used for the column/row operations
@@ -215,7 +217,7 @@ static void KeyExpansion(void)
 
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
-static void AddRoundKey(uint8_t round)
+static void AddRoundKey(uint8_t round, state_t* state, const uint8_t* RoundKey)
 {
   uint8_t i,j;
   for(i=0;i<4;++i)
@@ -229,7 +231,7 @@ static void AddRoundKey(uint8_t round)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void SubBytes(void)
+static void SubBytes(state_t* state)
 {
   uint8_t i, j;
   for(i = 0; i < 4; ++i)
@@ -244,7 +246,7 @@ static void SubBytes(void)
 // The ShiftRows() function shifts the rows in the state to the left.
 // Each row is shifted with different offset.
 // Offset = Row number. So the first row is not shifted.
-static void ShiftRows(void)
+static void ShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -278,7 +280,7 @@ static uint8_t xtime(uint8_t x)
 }
 
 // MixColumns function mixes the columns of the state matrix
-static void MixColumns(void)
+static void MixColumns(state_t* state)
 {
   uint8_t i;
   uint8_t Tmp,Tm,t;
@@ -316,7 +318,7 @@ static uint8_t Multiply(uint8_t x, uint8_t y)
 // MixColumns function mixes the columns of the state matrix.
 // The method used to multiply may be difficult to understand for the inexperienced.
 // Please use the references to gain more information.
-static void InvMixColumns(void)
+static void InvMixColumns(state_t* state)
 {
   int i;
   uint8_t a,b,c,d;
@@ -337,7 +339,7 @@ static void InvMixColumns(void)
 
 // The SubBytes Function Substitutes the values in the
 // state matrix with values in an S-box.
-static void InvSubBytes(void)
+static void InvSubBytes(state_t* state)
 {
   uint8_t i,j;
   for(i=0;i<4;++i)
@@ -349,7 +351,7 @@ static void InvSubBytes(void)
   }
 }
 
-static void InvShiftRows(void)
+static void InvShiftRows(state_t* state)
 {
   uint8_t temp;
 
@@ -379,54 +381,54 @@ static void InvShiftRows(void)
 
 
 // Cipher is the main function that encrypts the PlainText.
-static void Cipher(void)
+static void Cipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round = 0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(0); 
+  AddRoundKey(0, state, RoundKey); 
   
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round = 1; round < Nr; ++round)
   {
-    SubBytes();
-    ShiftRows();
-    MixColumns();
-    AddRoundKey(round);
+    SubBytes(state);
+    ShiftRows(state);
+    MixColumns(state);
+    AddRoundKey(round, state, RoundKey);
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  SubBytes();
-  ShiftRows();
-  AddRoundKey(Nr);
+  SubBytes(state);
+  ShiftRows(state);
+  AddRoundKey(Nr, state, RoundKey);
 }
 
-static void InvCipher(void)
+static void InvCipher(state_t* state, const uint8_t* RoundKey)
 {
   uint8_t round=0;
 
   // Add the First round key to the state before starting the rounds.
-  AddRoundKey(Nr); 
+  AddRoundKey(Nr, state, RoundKey); 
 
   // There will be Nr rounds.
   // The first Nr-1 rounds are identical.
   // These Nr-1 rounds are executed in the loop below.
   for(round=Nr-1;round>0;round--)
   {
-    InvShiftRows();
-    InvSubBytes();
-    AddRoundKey(round);
-    InvMixColumns();
+    InvShiftRows(state);
+    InvSubBytes(state);
+    AddRoundKey(round, state, RoundKey);
+    InvMixColumns(state);
   }
   
   // The last round is given below.
   // The MixColumns function is not here in the last round.
-  InvShiftRows();
-  InvSubBytes();
-  AddRoundKey(0);
+  InvShiftRows(state);
+  InvSubBytes(state);
+  AddRoundKey(0, state, RoundKey);
 }
 
 static void BlockCopy(uint8_t* output, uint8_t* input)
@@ -440,36 +442,207 @@ static void BlockCopy(uint8_t* output, uint8_t* input)
 
 
 
+#if defined(AES_USE_AESNI)
+// AES-NI versions of the block cipher. The round keys produced by
+// KeyExpansion() are already in the byte order the instructions expect
+// so they are shared with the portable code.
+static int AESNI_supported(void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+  {
+    return 0;
+  }
+  return (ecx & bit_AES) && (edx & bit_SSE2);
+}
+
+__attribute__((target("aes,sse2")))
+static void AESNI_CBC_MAC(const uint8_t* RoundKey, uint8_t* mac, const uint8_t* input, size_t nblocks)
+{
+  __m128i rk[Nr + 1];
+  __m128i m;
+  uint8_t round;
+
+  for (round = 0; round <= Nr; ++round)
+  {
+    rk[round] = _mm_loadu_si128((const __m128i*)(RoundKey + round * KEYLEN));
+  }
+
+  m = _mm_loadu_si128((const __m128i*)mac);
+  while (nblocks--)
+  {
+    m = _mm_xor_si128(m, _mm_loadu_si128((const __m128i*)input));
+    m = _mm_xor_si128(m, rk[0]);
+    for (round = 1; round < Nr; ++round)
+    {
+      m = _mm_aesenc_si128(m, rk[round]);
+    }
+    m = _mm_aesenclast_si128(m, rk[Nr]);
+    input += KEYLEN;
+  }
+  _mm_storeu_si128((__m128i*)mac, m);
+}
+
+__attribute__((target("aes,sse2")))
+static void AESNI_CTR32(const uint8_t* RoundKey, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t nblocks)
+{
+  __m128i rk[Nr + 1];
+  __m128i b[4];
+  uint8_t blocks[4 * KEYLEN];
+  uint32_t c;
+  size_t i, n;
+  uint8_t round;
+
+  for (round = 0; round <= Nr; ++round)
+  {
+    rk[round] = _mm_loadu_si128((const __m128i*)(RoundKey + round * KEYLEN));
+  }
+
+  // Four counter blocks at a time to keep the AES unit busy
+  while (nblocks)
+  {
+    n = nblocks < 4 ? nblocks : 4;
+    for (i = 0; i < n; ++i)
+    {
+      memcpy(&blocks[i * KEYLEN], ctr, KEYLEN);
+      c = ((uint32_t)ctr[12] << 24) | ((uint32_t)ctr[13] << 16) | ((uint32_t)ctr[14] << 8) | ctr[15];
+      c++;
+      ctr[12] = c >> 24; ctr[13] = c >> 16; ctr[14] = c >> 8; ctr[15] = c;
+      b[i] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blocks[i * KEYLEN]), rk[0]);
+    }
+    for (round = 1; round < Nr; ++round)
+    {
+      for (i = 0; i < n; ++i)
+      {
+        b[i] = _mm_aesenc_si128(b[i], rk[round]);
+      }
+    }
+    for (i = 0; i < n; ++i)
+    {
+      b[i] = _mm_aesenclast_si128(b[i], rk[Nr]);
+      b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i*)input));
+      _mm_storeu_si128((__m128i*)output, b[i]);
+      input += KEYLEN;
+      output += KEYLEN;
+    }
+    nblocks -= n;
+  }
+}
+#endif // #if defined(AES_USE_AESNI)
+
+
+
 /*****************************************************************************/
 /* Public functions:                                                         */
 /*****************************************************************************/
+
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key)
+{
+  KeyExpansion(ctx->RoundKey, key);
+#if defined(AES_USE_AESNI)
+  ctx->aesni = AESNI_supported();
+#else
+  ctx->aesni = 0;
+#endif
+}
+
+void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf)
+{
+#if defined(AES_USE_AESNI)
+  if (ctx->aesni)
+  {
+    uint8_t zero[KEYLEN] = {0};
+
+    AESNI_CBC_MAC(ctx->RoundKey, zero, buf, 1);
+    BlockCopy(buf, zero);
+    return;
+  }
+#endif
+  Cipher((state_t*)buf, ctx->RoundKey);
+}
+
+void AES_CBC_MAC(const struct AES_ctx* ctx, uint8_t* mac, const uint8_t* input, size_t nblocks)
+{
+  uint8_t i;
+
+#if defined(AES_USE_AESNI)
+  if (ctx->aesni)
+  {
+    AESNI_CBC_MAC(ctx->RoundKey, mac, input, nblocks);
+    return;
+  }
+#endif
+  while (nblocks--)
+  {
+    for (i = 0; i < KEYLEN; ++i)
+    {
+      mac[i] ^= input[i];
+    }
+    Cipher((state_t*)mac, ctx->RoundKey);
+    input += KEYLEN;
+  }
+}
+
+void AES_CTR32_xcrypt(const struct AES_ctx* ctx, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t nblocks)
+{
+  uint8_t ks[KEYLEN];
+  uint8_t i;
+
+#if defined(AES_USE_AESNI)
+  if (ctx->aesni)
+  {
+    AESNI_CTR32(ctx->RoundKey, ctr, input, output, nblocks);
+    return;
+  }
+#endif
+  while (nblocks--)
+  {
+    BlockCopy(ks, ctr);
+    Cipher((state_t*)ks, ctx->RoundKey);
+    for (i = 0; i < KEYLEN; ++i)
+    {
+      output[i] = input[i] ^ ks[i];
+    }
+    // Increment the low 32 bits of the counter block, big endian
+    for (i = KEYLEN; i > KEYLEN - 4; --i)
+    {
+      if (++ctr[i - 1])
+      {
+        break;
+      }
+    }
+    input += KEYLEN;
+    output += KEYLEN;
+  }
+}
+
+void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf)
+{
+  InvCipher((state_t*)buf, ctx->RoundKey);
+}
+
 #if defined(ECB) && ECB
 
 
 void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t* output)
 {
+  struct AES_ctx ctx;
+
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
-  state = (state_t*)output;
-
-  Key = key;
-  KeyExpansion();
-
-  // The next function call encrypts the PlainText with the Key using AES algorithm.
-  Cipher();
+  AES_init_ctx(&ctx, key);
+  AES_ECB_encrypt(&ctx, output);
 }
 
 void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output)
 {
+  struct AES_ctx ctx;
+
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
-  state = (state_t*)output;
-
-  // The KeyExpansion routine must be called before encryption.
-  Key = key;
-  KeyExpansion();
-
-  InvCipher();
+  AES_init_ctx(&ctx, key);
+  AES_ECB_decrypt(&ctx, output);
 }
 
 
@@ -482,7 +655,7 @@ void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output)
 #if defined(CBC) && CBC
 
 
-static void XorWithIv(uint8_t* buf)
+static void XorWithIv(uint8_t* buf, const uint8_t* Iv)
 {
   uint8_t i;
   for(i = 0; i < KEYLEN; ++i)
@@ -491,87 +664,47 @@ static void XorWithIv(uint8_t* buf)
   }
 }
 
-void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv)
+{
+  memcpy(ctx->Iv, iv, KEYLEN);
+}
+
+void AES_CBC_encrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
 {
   uintptr_t i;
   uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
 
-  BlockCopy(output, input);
-  state = (state_t*)output;
-
-  // Skip the key expansion if key is passed as 0
-  if(0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
-
-  if(iv != 0)
-  {
-    Iv = (uint8_t*)iv;
-  }
-
-  for(i = 0; i < length; i += KEYLEN)
+  for(i = 0; i + KEYLEN <= length; i += KEYLEN)
   {
-    XorWithIv(input);
-    BlockCopy(output, input);
-    state = (state_t*)output;
-    Cipher();
-    Iv = output;
-    input += KEYLEN;
-    output += KEYLEN;
+    XorWithIv(buf, ctx->Iv);
+    AES_ECB_encrypt(ctx, buf);
+    BlockCopy(ctx->Iv, buf);
+    buf += KEYLEN;
   }
 
   if(remainders)
   {
-    BlockCopy(output, input);
-    memset(output + remainders, 0, KEYLEN - remainders); /* add 0-padding */
-    state = (state_t*)output;
-    Cipher();
+    memset(buf + remainders, 0, KEYLEN - remainders); /* add 0-padding */
+    XorWithIv(buf, ctx->Iv);
+    AES_ECB_encrypt(ctx, buf);
+    BlockCopy(ctx->Iv, buf);
   }
 }
 
-void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length)
 {
   uintptr_t i;
-  uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
-  
-  BlockCopy(output, input);
-  state = (state_t*)output;
-
-  // Skip the key expansion if key is passed as 0
-  if(0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
+  uint8_t next_iv[KEYLEN];
 
-  // If iv is passed as 0, we continue to encrypt without re-setting the Iv
-  if(iv != 0)
+  for(i = 0; i + KEYLEN <= length; i += KEYLEN)
   {
-    Iv = (uint8_t*)iv;
-  }
-
-  for(i = 0; i < length; i += KEYLEN)
-  {
-    BlockCopy(output, input);
-    state = (state_t*)output;
-    InvCipher();
-    XorWithIv(output);
-    Iv = input;
-    input += KEYLEN;
-    output += KEYLEN;
-  }
-
-  if(remainders)
-  {
-    BlockCopy(output, input);
-    memset(output+remainders, 0, KEYLEN - remainders); /* add 0-padding */
-    state = (state_t*)output;
-    InvCipher();
+    BlockCopy(next_iv, buf);
+    AES_ECB_decrypt(ctx, buf);
+    XorWithIv(buf, ctx->Iv);
+    BlockCopy(ctx->Iv, next_iv);
+    buf += KEYLEN;
   }
 }
 
 
 #endif // #if defined(CBC) && CBC
-
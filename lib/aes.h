@@ -5,6 +5,7 @@
 #ifndef _AES_H_
 #define _AES_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 
@@ -24,6 +25,35 @@
 
 
 
+// A key that has been expanded once and can be used for any number of blocks.
+// aesni is set by AES_init_ctx() when the CPU has the AES instructions.
+// All cipher state lives in the context, contexts are not shared between
+// threads but different contexts can be used concurrently.
+struct AES_ctx
+{
+  uint8_t RoundKey[176];
+  int aesni;
+  uint8_t Iv[16];
+};
+
+void AES_init_ctx(struct AES_ctx* ctx, const uint8_t* key);
+
+// Encrypts a single 16 byte block in place.
+void AES_ECB_encrypt(const struct AES_ctx* ctx, uint8_t* buf);
+
+// Runs nblocks 16 byte blocks of input through CBC-MAC, i.e.
+// mac = E(mac ^ block) for each block, keeping the running value in mac.
+void AES_CBC_MAC(const struct AES_ctx* ctx, uint8_t* mac, const uint8_t* input, size_t nblocks);
+
+// Counter mode over nblocks 16 byte blocks. The low 32 bits of ctr are a big
+// endian counter that is incremented for every block, as in CCM and GCM.
+// input and output may be the same buffer.
+void AES_CTR32_xcrypt(const struct AES_ctx* ctx, uint8_t* ctr, const uint8_t* input, uint8_t* output, size_t nblocks);
+
+// Decrypts a single 16 byte block in place.
+void AES_ECB_decrypt(const struct AES_ctx* ctx, uint8_t* buf);
+
+
 #if defined(ECB) && ECB
 
 void AES128_ECB_encrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
@@ -34,8 +64,12 @@ void AES128_ECB_decrypt(uint8_t* input, const uint8_t* key, uint8_t *output);
 
 #if defined(CBC) && CBC
 
-void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
-void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
+// CBC mode, in place. The Iv is kept in the context and carried over from
+// one call to the next. A trailing partial block is zero padded when
+// encrypting, so buf must have room for it.
+void AES_ctx_set_iv(struct AES_ctx* ctx, const uint8_t* iv);
+void AES_CBC_encrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
+void AES_CBC_decrypt_buffer(struct AES_ctx* ctx, uint8_t* buf, uint32_t length);
 
 #endif // #if defined(CBC) && CBC
 
@@ -0,0 +1,181 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * AES-128-CCM as used by SMB 3.x encryption.
+ *
+ * The CBC-MAC over the plaintext and the counter mode keystream advance
+ * in lock step, so whole blocks are handed to AES_CBC_MAC() and
+ * AES_CTR32_xcrypt() directly from the caller's buffers and only the
+ * partial blocks at the edges of a piece go through the byte loop.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "aes128ccm.h"
+
+void
+aes128ccm_init(struct aes128ccm_ctx *ccm, const struct AES_ctx *aes,
+               const uint8_t *nonce, size_t nonce_len,
+               const uint8_t *aad, size_t aad_len, size_t len)
+{
+        uint8_t block[16];
+        size_t l = 15 - nonce_len;
+        size_t i, n;
+
+        ccm->aes = aes;
+        ccm->pos = 0;
+
+        /* B0: flags, nonce and the payload length */
+        memset(block, 0, 16);
+        block[0] = (aad_len ? 0x40 : 0) |
+                (((AES128CCM_TAG_SIZE - 2) / 2) << 3) | (l - 1);
+        memcpy(&block[1], nonce, nonce_len);
+        for (i = 0; i < l && i < sizeof(size_t); i++) {
+                block[15 - i] = (len >> (8 * i)) & 0xff;
+        }
+        memset(ccm->mac, 0, 16);
+        AES_CBC_MAC(aes, ccm->mac, block, 1);
+
+        /* Associated data, prefixed by its length. SMB only ever uses
+         * 32 bytes so we do not need the longer length encodings.
+         */
+        if (aad_len) {
+                memset(block, 0, 16);
+                block[0] = (aad_len >> 8) & 0xff;
+                block[1] = aad_len & 0xff;
+                n = aad_len < 14 ? aad_len : 14;
+                memcpy(&block[2], aad, n);
+                AES_CBC_MAC(aes, ccm->mac, block, 1);
+                aad += n;
+                aad_len -= n;
+
+                n = aad_len / 16;
+                AES_CBC_MAC(aes, ccm->mac, aad, n);
+                aad += n * 16;
+                aad_len -= n * 16;
+                if (aad_len) {
+                        memset(block, 0, 16);
+                        memcpy(block, aad, aad_len);
+                        AES_CBC_MAC(aes, ccm->mac, block, 1);
+                }
+        }
+
+        /* A0 encrypts the tag, the payload starts at A1 */
+        memset(ccm->ctr, 0, 16);
+        ccm->ctr[0] = l - 1;
+        memcpy(&ccm->ctr[1], nonce, nonce_len);
+        memset(ccm->s0, 0, 16);
+        AES_CTR32_xcrypt(aes, ccm->ctr, ccm->s0, ccm->s0, 1);
+}
+
+/* Bytes up to the next block boundary, or the end of the piece */
+static size_t
+aes128ccm_partial(struct aes128ccm_ctx *ccm, const uint8_t *in,
+                  uint8_t *out, size_t len, int encrypt)
+{
+        size_t n = 0;
+        uint8_t p;
+
+        while (n < len) {
+                if (ccm->pos == 0) {
+                        memset(ccm->ks, 0, 16);
+                        AES_CTR32_xcrypt(ccm->aes, ccm->ctr, ccm->ks,
+                                         ccm->ks, 1);
+                }
+                p = encrypt ? in[n] : in[n] ^ ccm->ks[ccm->pos];
+                out[n] = in[n] ^ ccm->ks[ccm->pos];
+                ccm->buf[ccm->pos++] = p;
+                n++;
+                if (ccm->pos == 16) {
+                        AES_CBC_MAC(ccm->aes, ccm->mac, ccm->buf, 1);
+                        ccm->pos = 0;
+                        break;
+                }
+        }
+        return n;
+}
+
+static void
+aes128ccm_crypt(struct aes128ccm_ctx *ccm, const uint8_t *in,
+                uint8_t *out, size_t len, int encrypt)
+{
+        size_t n;
+
+        if (ccm->pos) {
+                n = aes128ccm_partial(ccm, in, out, len, encrypt);
+                in += n;
+                out += n;
+                len -= n;
+        }
+
+        n = len / 16;
+        if (n) {
+                /* The MAC is over the plaintext which, when working in
+                 * place, is only available before encrypting and after
+                 * decrypting.
+                 */
+                if (encrypt) {
+                        AES_CBC_MAC(ccm->aes, ccm->mac, in, n);
+                        AES_CTR32_xcrypt(ccm->aes, ccm->ctr, in, out, n);
+                } else {
+                        AES_CTR32_xcrypt(ccm->aes, ccm->ctr, in, out, n);
+                        AES_CBC_MAC(ccm->aes, ccm->mac, out, n);
+                }
+                in += n * 16;
+                out += n * 16;
+                len -= n * 16;
+        }
+
+        if (len) {
+                aes128ccm_partial(ccm, in, out, len, encrypt);
+        }
+}
+
+void
+aes128ccm_encrypt(struct aes128ccm_ctx *ccm, const uint8_t *in,
+                  uint8_t *out, size_t len)
+{
+        aes128ccm_crypt(ccm, in, out, len, 1);
+}
+
+void
+aes128ccm_decrypt(struct aes128ccm_ctx *ccm, const uint8_t *in,
+                  uint8_t *out, size_t len)
+{
+        aes128ccm_crypt(ccm, in, out, len, 0);
+}
+
+void
+aes128ccm_final(struct aes128ccm_ctx *ccm, uint8_t tag[AES128CCM_TAG_SIZE])
+{
+        int i;
+
+        if (ccm->pos) {
+                memset(&ccm->buf[ccm->pos], 0, 16 - ccm->pos);
+                AES_CBC_MAC(ccm->aes, ccm->mac, ccm->buf, 1);
+                ccm->pos = 0;
+        }
+        for (i = 0; i < AES128CCM_TAG_SIZE; i++) {
+                tag[i] = ccm->mac[i] ^ ccm->s0[i];
+        }
+}
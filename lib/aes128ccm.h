@@ -0,0 +1,62 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _AES128CCM_H_
+#define _AES128CCM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AES128CCM_TAG_SIZE 16
+
+/*
+ * Incremental AES-128-CCM with a 16 byte tag, [RFC3610].
+ * The total length of the payload must be known up front. The payload can
+ * then be fed in any number of pieces of any size and in place.
+ */
+struct aes128ccm_ctx {
+        const struct AES_ctx *aes;
+        uint8_t mac[16];
+        uint8_t ctr[16];
+        uint8_t s0[16];
+        uint8_t ks[16];
+        uint8_t buf[16];
+        size_t pos;
+};
+
+void aes128ccm_init(struct aes128ccm_ctx *ccm, const struct AES_ctx *aes,
+                    const uint8_t *nonce, size_t nonce_len,
+                    const uint8_t *aad, size_t aad_len, size_t len);
+void aes128ccm_encrypt(struct aes128ccm_ctx *ccm, const uint8_t *in,
+                       uint8_t *out, size_t len);
+void aes128ccm_decrypt(struct aes128ccm_ctx *ccm, const uint8_t *in,
+                       uint8_t *out, size_t len);
+void aes128ccm_final(struct aes128ccm_ctx *ccm,
+                     uint8_t tag[AES128CCM_TAG_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _AES128CCM_H_ */
@@ -0,0 +1,366 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * AES-128-GCM as used by SMB 3.1.1 encryption.
+ *
+ * The keystream comes from AES_CTR32_xcrypt() and GHASH uses PCLMULQDQ
+ * when the CPU has it. Otherwise GHASH falls back to the bit at a time
+ * multiplication from SP 800-38D.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "aes128gcm.h"
+
+#if defined(HAVE_CPUID_H) && defined(HAVE_WMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define GCM_USE_CLMUL 1
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
+
+static uint64_t
+gcm_get_be64(const uint8_t *p)
+{
+        return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) |
+                ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+                ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) |
+                ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+static void
+gcm_put_be64(uint8_t *p, uint64_t v)
+{
+        int i;
+
+        for (i = 7; i >= 0; i--) {
+                p[i] = v & 0xff;
+                v >>= 8;
+        }
+}
+
+/* x = (x ^ block) * h for each block, one bit at a time */
+static void
+gcm_ghash_portable(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                   size_t nblocks)
+{
+        uint64_t hh = gcm_get_be64(&gcm->h[0]);
+        uint64_t hl = gcm_get_be64(&gcm->h[8]);
+        uint64_t xh = gcm_get_be64(&gcm->x[0]);
+        uint64_t xl = gcm_get_be64(&gcm->x[8]);
+        uint64_t zh, zl, vh, vl, bits, lsb;
+        int i;
+
+        while (nblocks--) {
+                xh ^= gcm_get_be64(&in[0]);
+                xl ^= gcm_get_be64(&in[8]);
+                zh = zl = 0;
+                vh = hh;
+                vl = hl;
+                for (i = 0; i < 128; i++) {
+                        bits = i < 64 ? xh : xl;
+                        if ((bits >> (63 - (i & 63))) & 1) {
+                                zh ^= vh;
+                                zl ^= vl;
+                        }
+                        lsb = vl & 1;
+                        vl = (vl >> 1) | (vh << 63);
+                        vh >>= 1;
+                        if (lsb) {
+                                vh ^= 0xe100000000000000ULL;
+                        }
+                }
+                xh = zh;
+                xl = zl;
+                in += 16;
+        }
+
+        gcm_put_be64(&gcm->x[0], xh);
+        gcm_put_be64(&gcm->x[8], xl);
+}
+
+#ifdef GCM_USE_CLMUL
+static int
+gcm_clmul_supported(void)
+{
+        unsigned int eax, ebx, ecx, edx;
+
+        if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+                return 0;
+        }
+        return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3) && (edx & bit_SSE2);
+}
+
+/* Carry-less multiply and reduce, from the Intel white paper
+ * "Intel Carry-Less Multiplication Instruction and its Usage for Computing
+ * the GCM Mode". Both operands are byte reflected.
+ */
+__attribute__((target("pclmul,ssse3,sse2")))
+static __m128i
+gcm_gfmul(__m128i a, __m128i b)
+{
+        __m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+        t3 = _mm_clmulepi64_si128(a, b, 0x00);
+        t4 = _mm_clmulepi64_si128(a, b, 0x10);
+        t5 = _mm_clmulepi64_si128(a, b, 0x01);
+        t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+        t4 = _mm_xor_si128(t4, t5);
+        t5 = _mm_slli_si128(t4, 8);
+        t4 = _mm_srli_si128(t4, 8);
+        t3 = _mm_xor_si128(t3, t5);
+        t6 = _mm_xor_si128(t6, t4);
+
+        /* Shift the 256 bit product left by one */
+        t7 = _mm_srli_epi32(t3, 31);
+        t8 = _mm_srli_epi32(t6, 31);
+        t3 = _mm_slli_epi32(t3, 1);
+        t6 = _mm_slli_epi32(t6, 1);
+        t9 = _mm_srli_si128(t7, 12);
+        t8 = _mm_slli_si128(t8, 4);
+        t7 = _mm_slli_si128(t7, 4);
+        t3 = _mm_or_si128(t3, t7);
+        t6 = _mm_or_si128(t6, t8);
+        t6 = _mm_or_si128(t6, t9);
+
+        /* Reduce modulo x^128 + x^7 + x^2 + x + 1 */
+        t7 = _mm_slli_epi32(t3, 31);
+        t8 = _mm_slli_epi32(t3, 30);
+        t9 = _mm_slli_epi32(t3, 25);
+        t7 = _mm_xor_si128(t7, t8);
+        t7 = _mm_xor_si128(t7, t9);
+        t8 = _mm_srli_si128(t7, 4);
+        t7 = _mm_slli_si128(t7, 12);
+        t3 = _mm_xor_si128(t3, t7);
+
+        t2 = _mm_srli_epi32(t3, 1);
+        t4 = _mm_srli_epi32(t3, 2);
+        t5 = _mm_srli_epi32(t3, 7);
+        t2 = _mm_xor_si128(t2, t4);
+        t2 = _mm_xor_si128(t2, t5);
+        t2 = _mm_xor_si128(t2, t8);
+        t3 = _mm_xor_si128(t3, t2);
+        t6 = _mm_xor_si128(t6, t3);
+
+        return t6;
+}
+
+__attribute__((target("pclmul,ssse3,sse2")))
+static void
+gcm_ghash_clmul(struct aes128gcm_ctx *gcm, const uint8_t *in, size_t nblocks)
+{
+        const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                           8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i h, x;
+
+        h = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)gcm->h), bswap);
+        x = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)gcm->x), bswap);
+        while (nblocks--) {
+                x = _mm_xor_si128(x, _mm_shuffle_epi8(
+                        _mm_loadu_si128((const __m128i *)in), bswap));
+                x = gcm_gfmul(x, h);
+                in += 16;
+        }
+        _mm_storeu_si128((__m128i *)gcm->x, _mm_shuffle_epi8(x, bswap));
+}
+#endif /* GCM_USE_CLMUL */
+
+static void
+gcm_ghash(struct aes128gcm_ctx *gcm, const uint8_t *in, size_t nblocks)
+{
+#ifdef GCM_USE_CLMUL
+        if (gcm->clmul) {
+                gcm_ghash_clmul(gcm, in, nblocks);
+                return;
+        }
+#endif
+        gcm_ghash_portable(gcm, in, nblocks);
+}
+
+void
+aes128gcm_init(struct aes128gcm_ctx *gcm, const struct AES_ctx *aes,
+               const uint8_t nonce[AES128GCM_NONCE_SIZE],
+               const uint8_t *aad, size_t aad_len)
+{
+        gcm->aes = aes;
+        gcm->pos = 0;
+        gcm->aad_len = 0;
+        gcm->len = 0;
+#ifdef GCM_USE_CLMUL
+        gcm->clmul = gcm_clmul_supported();
+#else
+        gcm->clmul = 0;
+#endif
+
+        memset(gcm->h, 0, 16);
+        AES_ECB_encrypt(aes, gcm->h);
+        memset(gcm->x, 0, 16);
+
+        /* J0 encrypts the tag, the payload starts at inc32(J0) */
+        memcpy(gcm->ctr, nonce, AES128GCM_NONCE_SIZE);
+        gcm->ctr[12] = gcm->ctr[13] = gcm->ctr[14] = 0;
+        gcm->ctr[15] = 1;
+        memset(gcm->ek0, 0, 16);
+        AES_CTR32_xcrypt(aes, gcm->ctr, gcm->ek0, gcm->ek0, 1);
+
+        aes128gcm_aad(gcm, aad, aad_len);
+}
+
+void
+aes128gcm_aad(struct aes128gcm_ctx *gcm, const uint8_t *aad, size_t len)
+{
+        size_t n;
+
+        gcm->aad_len += len;
+
+        if (gcm->pos) {
+                n = 16 - gcm->pos;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(&gcm->buf[gcm->pos], aad, n);
+                gcm->pos += n;
+                aad += n;
+                len -= n;
+                if (gcm->pos < 16) {
+                        return;
+                }
+                gcm_ghash(gcm, gcm->buf, 1);
+                gcm->pos = 0;
+        }
+
+        n = len / 16;
+        gcm_ghash(gcm, aad, n);
+        aad += n * 16;
+        len -= n * 16;
+
+        if (len) {
+                memcpy(gcm->buf, aad, len);
+                gcm->pos = len;
+        }
+}
+
+/* Bytes up to the next block boundary, or the end of the piece */
+static size_t
+aes128gcm_partial(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                  uint8_t *out, size_t len, int encrypt)
+{
+        size_t n = 0;
+        uint8_t c;
+
+        while (n < len) {
+                if (gcm->pos == 0) {
+                        memset(gcm->ks, 0, 16);
+                        AES_CTR32_xcrypt(gcm->aes, gcm->ctr, gcm->ks,
+                                         gcm->ks, 1);
+                }
+                c = encrypt ? in[n] ^ gcm->ks[gcm->pos] : in[n];
+                out[n] = in[n] ^ gcm->ks[gcm->pos];
+                gcm->buf[gcm->pos++] = c;
+                n++;
+                if (gcm->pos == 16) {
+                        gcm_ghash(gcm, gcm->buf, 1);
+                        gcm->pos = 0;
+                        break;
+                }
+        }
+        return n;
+}
+
+static void
+aes128gcm_crypt(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                uint8_t *out, size_t len, int encrypt)
+{
+        size_t n;
+
+        /* Pad the associated data to a block before the payload starts */
+        if (gcm->len == 0 && gcm->pos) {
+                memset(&gcm->buf[gcm->pos], 0, 16 - gcm->pos);
+                gcm_ghash(gcm, gcm->buf, 1);
+                gcm->pos = 0;
+        }
+
+        gcm->len += len;
+
+        if (gcm->pos) {
+                n = aes128gcm_partial(gcm, in, out, len, encrypt);
+                in += n;
+                out += n;
+                len -= n;
+        }
+
+        n = len / 16;
+        if (n) {
+                /* GHASH is over the ciphertext */
+                if (encrypt) {
+                        AES_CTR32_xcrypt(gcm->aes, gcm->ctr, in, out, n);
+                        gcm_ghash(gcm, out, n);
+                } else {
+                        gcm_ghash(gcm, in, n);
+                        AES_CTR32_xcrypt(gcm->aes, gcm->ctr, in, out, n);
+                }
+                in += n * 16;
+                out += n * 16;
+                len -= n * 16;
+        }
+
+        if (len) {
+                aes128gcm_partial(gcm, in, out, len, encrypt);
+        }
+}
+
+void
+aes128gcm_encrypt(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                  uint8_t *out, size_t len)
+{
+        aes128gcm_crypt(gcm, in, out, len, 1);
+}
+
+void
+aes128gcm_decrypt(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                  uint8_t *out, size_t len)
+{
+        aes128gcm_crypt(gcm, in, out, len, 0);
+}
+
+void
+aes128gcm_final(struct aes128gcm_ctx *gcm, uint8_t tag[AES128GCM_TAG_SIZE])
+{
+        uint8_t block[16];
+        int i;
+
+        if (gcm->pos) {
+                memset(&gcm->buf[gcm->pos], 0, 16 - gcm->pos);
+                gcm_ghash(gcm, gcm->buf, 1);
+                gcm->pos = 0;
+        }
+        gcm_put_be64(&block[0], gcm->aad_len * 8);
+        gcm_put_be64(&block[8], gcm->len * 8);
+        gcm_ghash(gcm, block, 1);
+
+        for (i = 0; i < AES128GCM_TAG_SIZE; i++) {
+                tag[i] = gcm->x[i] ^ gcm->ek0[i];
+        }
+}
@@ -0,0 +1,70 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _AES128GCM_H_
+#define _AES128GCM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aes.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define AES128GCM_NONCE_SIZE 12
+#define AES128GCM_TAG_SIZE 16
+
+/*
+ * Incremental AES-128-GCM with a 12 byte nonce and a 16 byte tag,
+ * [NIST SP 800-38D]. The payload can be fed in any number of pieces of
+ * any size and in place.
+ */
+struct aes128gcm_ctx {
+        const struct AES_ctx *aes;
+        uint8_t h[16];
+        uint8_t x[16];
+        uint8_t ctr[16];
+        uint8_t ek0[16];
+        uint8_t ks[16];
+        uint8_t buf[16];
+        size_t pos;
+        uint64_t aad_len;
+        uint64_t len;
+        int clmul;
+};
+
+void aes128gcm_init(struct aes128gcm_ctx *gcm, const struct AES_ctx *aes,
+                    const uint8_t nonce[AES128GCM_NONCE_SIZE],
+                    const uint8_t *aad, size_t aad_len);
+/* More associated data, before any payload */
+void aes128gcm_aad(struct aes128gcm_ctx *gcm, const uint8_t *aad,
+                   size_t len);
+void aes128gcm_encrypt(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                       uint8_t *out, size_t len);
+void aes128gcm_decrypt(struct aes128gcm_ctx *gcm, const uint8_t *in,
+                       uint8_t *out, size_t len);
+void aes128gcm_final(struct aes128gcm_ctx *gcm,
+                     uint8_t tag[AES128GCM_TAG_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _AES128GCM_H_ */
@@ -0,0 +1,265 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Completion queues, see smb2_init_cq().
+ *
+ * smb2_cq_cb() is called from smb2_service() and only pushes the entry
+ * onto the completed list of its queue. Completions can come from the
+ * service threads of several contexts at once, so the list is a lock-free
+ * LIFO like the one used for submissions in thread.c: producers push with
+ * compare-and-swap and the thread harvesting takes the whole list with a
+ * single exchange. Entries it could not hand out yet are kept, oldest
+ * first, on a ready list that only the harvesting thread touches.
+ *
+ * Without the GCC atomic builtins a queue must not be shared between
+ * threads.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#if defined(HAVE_SYS_EVENTFD_H) || (defined(HAVE_UNISTD_H) && !defined(_WIN32))
+#define SMB2_CQ_FD
+#endif
+
+#ifdef __GNUC__
+#define SMB2_CQ_ATOMIC
+#endif
+
+struct smb2_cq {
+        /* Completed entries, newest first */
+        struct smb2_cqe *completed;
+        /* Harvested from completed but not handed out yet, oldest first */
+        struct smb2_cqe *ready;
+        /* Set when the fd may be readable */
+        int signalled;
+        /* The same eventfd twice, the two ends of a pipe, or -1 */
+        int rfd;
+        int wfd;
+};
+
+struct smb2_cq *
+smb2_init_cq(void)
+{
+        struct smb2_cq *cq;
+
+        cq = calloc(1, sizeof(struct smb2_cq));
+        if (cq == NULL) {
+                return NULL;
+        }
+        cq->rfd = cq->wfd = -1;
+
+#if defined(HAVE_SYS_EVENTFD_H)
+        cq->rfd = cq->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (cq->rfd < 0) {
+                free(cq);
+                return NULL;
+        }
+#elif defined(SMB2_CQ_FD)
+        {
+                int fds[2];
+
+                if (pipe(fds) < 0) {
+                        free(cq);
+                        return NULL;
+                }
+                fcntl(fds[0], F_SETFL, O_NONBLOCK);
+                fcntl(fds[1], F_SETFL, O_NONBLOCK);
+                cq->rfd = fds[0];
+                cq->wfd = fds[1];
+        }
+#endif
+
+        return cq;
+}
+
+void
+smb2_destroy_cq(struct smb2_cq *cq)
+{
+        if (cq == NULL) {
+                return;
+        }
+#ifdef SMB2_CQ_FD
+        if (cq->wfd != cq->rfd) {
+                close(cq->wfd);
+        }
+        close(cq->rfd);
+#endif
+        free(cq);
+}
+
+t_socket
+smb2_cq_get_fd(struct smb2_cq *cq)
+{
+        return cq->rfd;
+}
+
+void
+smb2_cqe_prep(struct smb2_cq *cq, struct smb2_cqe *cqe, void *user_data)
+{
+        memset(cqe, 0, sizeof(struct smb2_cqe));
+        cqe->cq = cq;
+        cqe->user_data = user_data;
+}
+
+static void
+smb2_cq_signal(struct smb2_cq *cq)
+{
+#ifdef SMB2_CQ_FD
+        uint64_t one = 1;
+
+        /* Write before publishing signalled so that a harvest that
+         * sees it always finds the fd readable and drains it.
+         */
+        if (write(cq->wfd, &one, sizeof(one)) < 0) {
+                /* A full pipe is readable already */
+        }
+#ifdef SMB2_CQ_ATOMIC
+        __atomic_store_n(&cq->signalled, 1, __ATOMIC_RELEASE);
+#else
+        cq->signalled = 1;
+#endif
+#endif
+}
+
+void
+smb2_cq_cb(struct smb2_context *smb2 _U_, int status,
+           void *command_data, void *private_data)
+{
+        struct smb2_cqe *cqe = private_data;
+        struct smb2_cq *cq = cqe->cq;
+        struct smb2_cqe *head;
+
+        cqe->status = status;
+        cqe->command_data = command_data;
+
+#ifdef SMB2_CQ_ATOMIC
+        head = __atomic_load_n(&cq->completed, __ATOMIC_RELAXED);
+        do {
+                cqe->next = head;
+        } while (!__atomic_compare_exchange_n(&cq->completed, &head, cqe, 1,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+#else
+        head = cq->completed;
+        cqe->next = head;
+        cq->completed = cqe;
+#endif
+
+        /* Only the first entry in an empty queue needs to wake the
+         * harvesting thread up, it takes all of them at once.
+         */
+        if (head == NULL) {
+                smb2_cq_signal(cq);
+        }
+}
+
+int
+smb2_cq_harvest(struct smb2_cq *cq, struct smb2_cqe **cqes, int max)
+{
+        struct smb2_cqe *cqe, *next, *list = NULL;
+        int count = 0;
+
+        if (cq->ready == NULL) {
+#ifdef SMB2_CQ_FD
+                int signalled;
+
+                /* Clear the wakeup before taking the list over. An entry
+                 * completed onto the empty list after that signals again.
+                 */
+#ifdef SMB2_CQ_ATOMIC
+                signalled = __atomic_exchange_n(&cq->signalled, 0,
+                                                __ATOMIC_ACQUIRE);
+#else
+                signalled = cq->signalled;
+                cq->signalled = 0;
+#endif
+                if (signalled) {
+                        uint8_t buf[64];
+
+                        /* One read resets an eventfd, a pipe is read
+                         * until empty.
+                         */
+                        while (read(cq->rfd, buf, sizeof(buf)) ==
+                               sizeof(buf)) {
+                        }
+                }
+#endif
+#ifdef SMB2_CQ_ATOMIC
+                if (__atomic_load_n(&cq->completed, __ATOMIC_RELAXED) ==
+                    NULL) {
+                        return 0;
+                }
+                cqe = __atomic_exchange_n(&cq->completed, NULL,
+                                          __ATOMIC_ACQUIRE);
+#else
+                cqe = cq->completed;
+                cq->completed = NULL;
+#endif
+
+                /* Oldest first */
+                while (cqe) {
+                        next = cqe->next;
+                        cqe->next = list;
+                        list = cqe;
+                        cqe = next;
+                }
+                cq->ready = list;
+        }
+
+        while (cq->ready && count < max) {
+                cqe = cq->ready;
+                cq->ready = cqe->next;
+                cqe->next = NULL;
+                cqes[count++] = cqe;
+        }
+
+        /* Keep the fd readable while there is more to harvest */
+        if (cq->ready) {
+                smb2_cq_signal(cq);
+        }
+
+        return count;
+}
@@ -74,6 +74,9 @@ hmacReset (HMACContext * ctx, enum SHAversion whichSha,
   /* inner padding - key XORd with ipad */
   unsigned char k_ipad[USHA_Max_Message_Block_Size];
 
+  /* outer padding - key XORd with opad */
+  unsigned char k_opad[USHA_Max_Message_Block_Size];
+
   /* temporary buffer when keylen > blocksize */
   unsigned char tempkey[USHAMaxHashSize];
 
@@ -116,15 +119,24 @@ hmacReset (HMACContext * ctx, enum SHAversion whichSha,
   for (i = 0; i < key_len; i++)
     {
       k_ipad[i] = key[i] ^ 0x36;
-      ctx->k_opad[i] = key[i] ^ 0x5c;
+      k_opad[i] = key[i] ^ 0x5c;
     }
   /* remaining pad bytes are '\0' XOR'd with ipad and opad values */
   for (; i < blocksize; i++)
     {
       k_ipad[i] = 0x36;
-      ctx->k_opad[i] = 0x5c;
+      k_opad[i] = 0x5c;
     }
 
+  /*
+   * Absorb the outer pad now so that hmacResult() does not have
+   * to, and a context copied after hmacReset() can be reused for
+   * any number of messages under the same key.
+   */
+  if (USHAReset (&ctx->outerContext, whichSha) ||
+      USHAInput (&ctx->outerContext, k_opad, blocksize))
+    return shaBadParam;
+
   /* perform inner hash */
   /* init context for 1st pass */
   return USHAReset (&ctx->shaContext, whichSha) ||
@@ -218,12 +230,13 @@ hmacResult (HMACContext * ctx, uint8_t * digest)
 
   /* finish up 1st pass */
   /* (Use digest here as a temporary buffer.) */
-  return USHAResult (&ctx->shaContext, digest) ||
-    /* perform outer SHA */
-    /* init context for 2nd pass */
-    USHAReset (&ctx->shaContext, ctx->whichSha) ||
-    /* start with outer pad */
-    USHAInput (&ctx->shaContext, ctx->k_opad, ctx->blockSize) ||
+  if (USHAResult (&ctx->shaContext, digest))
+    return shaStateError;
+
+  /* perform outer SHA */
+  /* start from the precomputed outer pad state */
+  ctx->shaContext = ctx->outerContext;
+  return
     /* then results of 1st hash */
     USHAInput (&ctx->shaContext, digest, ctx->hashSize) ||
     /* finish up 2nd pass */
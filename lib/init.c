@@ -45,9 +45,11 @@
 #include <stdio.h>
 #include <sys/socket.h>
 
+#include "slist.h"
 #include "smb2.h"
 #include "libsmb2.h"
 #include "libsmb2-private.h"
+#include "smb3-seal.h"
 
 #define MAX_URL_SIZE 256
 
@@ -100,6 +102,8 @@ smb2_parse_args(struct smb2_context *smb2, const char *args)
                                 smb2->version = SMB2_VERSION_0300;
                         } else if(!strcmp(value, "3.02")) {
                                 smb2->version = SMB2_VERSION_0302;
+                        } else if(!strcmp(value, "3.1.1")) {
+                                smb2->version = SMB2_VERSION_0311;
                         } else {
                                 smb2_set_error(smb2, "Unknown vers= argument: "
                                                "%s", value);
@@ -210,6 +214,7 @@ struct smb2_context *smb2_init_context(void)
 
         smb2_set_user(smb2, getlogin());
         smb2->fd = -1;
+        smb2->io_uring_attach_fd = -1;
         smb2->sec = SMB2_SEC_UNDEFINED;
         smb2->version = SMB2_VERSION_ANY;
 
@@ -232,41 +237,74 @@ void smb2_destroy_context(struct smb2_context *smb2)
                 return;
         }
 
+        smb2_zerocopy_flush(smb2);
+        smb2_io_uring_stop(smb2);
         if (smb2->fd != -1) {
                 close(smb2->fd);
                 smb2->fd = -1;
         }
+        /* Nothing can be sent anymore. Callbacks of the requests cancelled
+         * below must not queue new ones, such as the CLOSE of a directory.
+         */
+        smb2->is_connected = 0;
 
         if (smb2->fhs) {
                 smb2_free_all_fhs(smb2);
         }
 
-        if (smb2->dirs) {
-                smb2_free_all_dirs(smb2);
+        /* Cancel what other threads submitted along with the rest */
+        smb2_drain_submitted(smb2);
+        while (smb2->outqueue.head) {
+                struct smb2_pdu *pdu = smb2->outqueue.head;
+                struct smb2_pdu *next;
+
+                SMB2_DLIST_REMOVE(&smb2->outqueue, pdu);
+                /* Along with the requests compounded with it, such as the
+                 * QUERY_DIRECTORY of an opendir.
+                 */
+                for (next = pdu; next; next = next->next_compound) {
+                        next->cb(smb2, SMB2_STATUS_CANCELLED, NULL,
+                                 next->cb_data);
+                }
+                smb2_free_pdu(smb2, pdu);
         }
+        while (smb2->waitqueue.head) {
+                struct smb2_pdu *pdu = smb2->waitqueue.head;
 
-        while (smb2->outqueue) {
-                struct smb2_pdu *pdu = smb2->outqueue;
-
-                smb2->outqueue = pdu->next;
+                smb2_remove_from_waitqueue(smb2, pdu);
                 pdu->cb(smb2, SMB2_STATUS_CANCELLED, NULL, pdu->cb_data);
                 smb2_free_pdu(smb2, pdu);
         }
-        while (smb2->waitqueue) {
-                struct smb2_pdu *pdu = smb2->waitqueue;
 
-                smb2->waitqueue = pdu->next;
-                pdu->cb(smb2, SMB2_STATUS_CANCELLED, NULL, pdu->cb_data);
-                smb2_free_pdu(smb2, pdu);
+        /* After the cancelled queries, which still reference their dirs */
+        if (smb2->dirs) {
+                smb2_free_all_dirs(smb2);
         }
-        smb2_free_iovector(smb2, &smb2->in);
+        smb2_destroy_iovector(smb2, &smb2->in);
+        free(smb2->recv_buf);
+        smb2->recv_buf = NULL;
+        free(smb2->readahead);
+        smb2->readahead = NULL;
         if (smb2->pdu) {
                 smb2_free_pdu(smb2, smb2->pdu);
                 smb2->pdu = NULL;
         }
+        smb2_free_pdu_pool(smb2);
+        smb2_free_thread(smb2);
 
         free(smb2->session_key);
         smb2->session_key = NULL;
+        free(smb2->signing_ctx);
+        smb2->signing_ctx = NULL;
+        free(smb2->signing_hmac);
+        smb2->signing_hmac = NULL;
+        smb3_free_seal_keys(smb2);
+        free(smb2->enc);
+        smb2->enc = NULL;
+        free(smb2->cmp);
+        smb2->cmp = NULL;
+        free(smb2->dec);
+        smb2->dec = NULL;
 
         free(discard_const(smb2->user));
         free(discard_const(smb2->server));
@@ -292,16 +330,70 @@ void smb2_free_iovector(struct smb2_context *smb2, struct smb2_io_vectors *v)
         v->num_done = 0;
 }
 
+/* Release the vector array itself. Only needed once the vectors will not
+ * be used again, smb2_free_iovector() keeps the array around for reuse.
+ */
+void smb2_destroy_iovector(struct smb2_context *smb2,
+                           struct smb2_io_vectors *v)
+{
+        smb2_free_iovector(smb2, v);
+        if (v->iov != v->inline_iov) {
+                free(v->iov);
+        }
+        v->iov = NULL;
+        v->max_iov = 0;
+}
+
+static int smb2_grow_iovector(struct smb2_context *smb2,
+                              struct smb2_io_vectors *v)
+{
+        struct smb2_iovec *iov;
+        int max_iov;
+
+        if (v->iov == NULL) {
+                v->iov = v->inline_iov;
+                v->max_iov = SMB2_INLINE_VECTORS;
+                return 0;
+        }
+
+        if (v->max_iov >= SMB2_MAX_VECTORS) {
+                smb2_set_error(smb2, "Too many io vectors");
+                return -1;
+        }
+
+        max_iov = MIN(v->max_iov * 2, SMB2_MAX_VECTORS);
+        iov = malloc(max_iov * sizeof(struct smb2_iovec));
+        if (iov == NULL) {
+                smb2_set_error(smb2, "Failed to allocate io vectors");
+                return -1;
+        }
+        memcpy(iov, v->iov, v->niov * sizeof(struct smb2_iovec));
+        if (v->iov != v->inline_iov) {
+                free(v->iov);
+        }
+        v->iov = iov;
+        v->max_iov = max_iov;
+
+        return 0;
+}
+
 struct smb2_iovec *smb2_add_iovector(struct smb2_context *smb2,
                                      struct smb2_io_vectors *v,
                                      uint8_t *buf, int len,
                                      void (*free)(void *))
 {
-        struct smb2_iovec *iov = &v->iov[v->niov];
+        struct smb2_iovec *iov;
+
+        if (v->niov >= v->max_iov) {
+                if (smb2_grow_iovector(smb2, v) < 0) {
+                        return NULL;
+                }
+        }
 
-        v->iov[v->niov].buf = buf;
-        v->iov[v->niov].len = len;
-        v->iov[v->niov].free = free;
+        iov = &v->iov[v->niov];
+        iov->buf = buf;
+        iov->len = len;
+        iov->free = free;
         v->total_size += len;
         v->niov++;
 
@@ -320,13 +412,13 @@ void smb2_set_error(struct smb2_context *smb2, const char *error_string, ...)
 	}
 	va_end(ap);
 	if (smb2 != NULL) {
-		strncpy(smb2->error_string, errstr, MAX_ERROR_SIZE);
+		strncpy(smb2_error_buffer(smb2), errstr, MAX_ERROR_SIZE);
 	}
 }
 
 const char *smb2_get_error(struct smb2_context *smb2)
 {
-	return smb2 ? smb2->error_string : "";
+	return smb2 ? smb2_error_buffer(smb2) : "";
 }
         
 const char *smb2_get_client_guid(struct smb2_context *smb2)
@@ -339,6 +431,22 @@ void smb2_set_security_mode(struct smb2_context *smb2, uint16_t security_mode)
         smb2->security_mode = security_mode;
 }
 
+void smb2_set_seal(struct smb2_context *smb2, int val)
+{
+        smb2->seal = val ? 1 : 0;
+}
+
+void smb2_set_compression_threshold(struct smb2_context *smb2,
+                                    size_t threshold)
+{
+        smb2->compression_threshold = threshold;
+}
+
+void smb2_set_dir_query_size(struct smb2_context *smb2, uint32_t size)
+{
+        smb2->dir_query_size = size;
+}
+
 static void smb2_set_password_from_file(struct smb2_context *smb2)
 {
         char *name = NULL;
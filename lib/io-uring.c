@@ -0,0 +1,560 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * io_uring transport for the socket.
+ *
+ * Instead of readv()/writev() on the socket the application polls the
+ * ring file descriptor. A single multishot receive stays armed on the
+ * socket and the kernel picks its buffers from a ring of provided buffers
+ * that is registered once, so every chunk of data that arrives becomes one
+ * completion without any further syscalls. Writes are submitted as WRITEV
+ * operations, one compound chain at a time to preserve ordering.
+ *
+ * We talk to the kernel directly so we do not need liburing.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT)
+
+/* Number and size of the buffers we provide for the multishot receive */
+#define SMB2_IO_URING_BUFS      16
+#define SMB2_IO_URING_BUF_SIZE  SMB2_READAHEAD_SIZE
+#define SMB2_IO_URING_BGID      0
+
+enum smb2_io_uring_op {
+        SMB2_IO_URING_OP_RECV = 1,
+        SMB2_IO_URING_OP_WRITE,
+};
+
+struct smb2_io_uring {
+        int fd;
+
+        /* Submission queue */
+        void *sq_ring;
+        size_t sq_ring_size;
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+        unsigned sq_entries;
+
+        /* Completion queue */
+        void *cq_ring;
+        size_t cq_ring_size;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        struct io_uring_cqe *cqes;
+
+        /* Provided buffers for the multishot receive */
+        struct io_uring_buf_ring *buf_ring;
+        size_t buf_ring_size;
+        uint8_t *bufs;
+        uint16_t buf_tail;
+        int recv_armed;
+
+        /* The chain that is currently being written. The vectors must
+         * stay valid until the write completes.
+         */
+        int write_busy;
+        struct iovec iov[SMB2_MAX_VECTORS + 1];
+};
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+        return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit)
+{
+        int ret;
+
+        do {
+                ret = syscall(__NR_io_uring_enter, fd, to_submit, 0, 0,
+                              NULL, 0);
+        } while (ret < 0 && errno == EINTR);
+
+        return ret;
+}
+
+static int
+io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+        return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+smb2_io_uring_free(struct smb2_io_uring *ring)
+{
+        if (ring->fd != -1) {
+                close(ring->fd);
+        }
+        if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+                munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED &&
+            ring->cq_ring != ring->sq_ring) {
+                munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sqes != NULL && (void *)ring->sqes != MAP_FAILED) {
+                munmap(ring->sqes, ring->sqes_size);
+        }
+        if (ring->buf_ring != NULL && (void *)ring->buf_ring != MAP_FAILED) {
+                munmap(ring->buf_ring, ring->buf_ring_size);
+        }
+        free(ring->bufs);
+        free(ring);
+}
+
+static void
+smb2_io_uring_provide_buf(struct smb2_io_uring *ring, uint16_t bid)
+{
+        struct io_uring_buf *buf;
+
+        buf = &ring->buf_ring->bufs[ring->buf_tail &
+                                    (SMB2_IO_URING_BUFS - 1)];
+        buf->addr = (uint64_t)(uintptr_t)
+                &ring->bufs[(size_t)bid * SMB2_IO_URING_BUF_SIZE];
+        buf->len = SMB2_IO_URING_BUF_SIZE;
+        buf->bid = bid;
+        ring->buf_tail++;
+        __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail,
+                         __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *
+smb2_io_uring_get_sqe(struct smb2_io_uring *ring)
+{
+        struct io_uring_sqe *sqe;
+        unsigned tail, head;
+
+        tail = *ring->sq_tail;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries) {
+                return NULL;
+        }
+
+        sqe = &ring->sqes[tail & *ring->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+
+        return sqe;
+}
+
+static int
+smb2_io_uring_submit(struct smb2_context *smb2, struct smb2_io_uring *ring)
+{
+        __atomic_store_n(ring->sq_tail, *ring->sq_tail + 1,
+                         __ATOMIC_RELEASE);
+
+        if (io_uring_enter(ring->fd, 1) < 0) {
+                smb2_set_error(smb2, "io_uring_enter failed. "
+                               "Errno:%s(%d).", strerror(errno), errno);
+                return -1;
+        }
+
+        return 0;
+}
+
+static int
+smb2_io_uring_arm_recv(struct smb2_context *smb2, struct smb2_io_uring *ring)
+{
+        struct io_uring_sqe *sqe;
+
+        sqe = smb2_io_uring_get_sqe(ring);
+        if (sqe == NULL) {
+                smb2_set_error(smb2, "io_uring submission queue is full");
+                return -1;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = smb2->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = SMB2_IO_URING_BGID;
+        sqe->user_data = SMB2_IO_URING_OP_RECV;
+
+        if (smb2_io_uring_submit(smb2, ring) < 0) {
+                return -1;
+        }
+        ring->recv_armed = 1;
+
+        return 0;
+}
+
+int
+smb2_io_uring_start(struct smb2_context *smb2)
+{
+        struct smb2_io_uring *ring;
+        struct io_uring_params p;
+        struct io_uring_buf_reg reg;
+        int i;
+
+        ring = malloc(sizeof(*ring));
+        if (ring == NULL) {
+                smb2_set_error(smb2, "Failed to allocate io_uring");
+                return -1;
+        }
+        memset(ring, 0, sizeof(*ring));
+
+        memset(&p, 0, sizeof(p));
+        if (smb2->io_uring_attach_fd >= 0) {
+                p.flags |= IORING_SETUP_ATTACH_WQ;
+                p.wq_fd = smb2->io_uring_attach_fd;
+        }
+        ring->fd = io_uring_setup(smb2->io_uring_entries, &p);
+        if (ring->fd < 0) {
+                smb2_set_error(smb2, "io_uring_setup failed. "
+                               "Errno:%s(%d).", strerror(errno), errno);
+                ring->fd = -1;
+                goto failed;
+        }
+
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p.cq_off.cqes +
+                p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                if (ring->cq_ring_size > ring->sq_ring_size) {
+                        ring->sq_ring_size = ring->cq_ring_size;
+                }
+                ring->cq_ring_size = ring->sq_ring_size;
+        }
+
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd,
+                             IORING_OFF_SQ_RING);
+        if (ring->sq_ring == MAP_FAILED) {
+                smb2_set_error(smb2, "Failed to map io_uring SQ ring");
+                goto failed;
+        }
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+                ring->cq_ring = ring->sq_ring;
+        } else {
+                ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+                                     PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd,
+                                     IORING_OFF_CQ_RING);
+                if (ring->cq_ring == MAP_FAILED) {
+                        smb2_set_error(smb2, "Failed to map io_uring "
+                                       "CQ ring");
+                        goto failed;
+                }
+        }
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+        if ((void *)ring->sqes == MAP_FAILED) {
+                smb2_set_error(smb2, "Failed to map io_uring SQEs");
+                goto failed;
+        }
+
+        ring->sq_head = (unsigned *)((char *)ring->sq_ring + p.sq_off.head);
+        ring->sq_tail = (unsigned *)((char *)ring->sq_ring + p.sq_off.tail);
+        ring->sq_mask = (unsigned *)((char *)ring->sq_ring +
+                                     p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)((char *)ring->sq_ring + p.sq_off.array);
+        ring->sq_entries = p.sq_entries;
+        ring->cq_head = (unsigned *)((char *)ring->cq_ring + p.cq_off.head);
+        ring->cq_tail = (unsigned *)((char *)ring->cq_ring + p.cq_off.tail);
+        ring->cq_mask = (unsigned *)((char *)ring->cq_ring +
+                                     p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring +
+                                             p.cq_off.cqes);
+
+        /* Register the buffers for the multishot receive */
+        ring->buf_ring_size = SMB2_IO_URING_BUFS * sizeof(struct io_uring_buf);
+        ring->buf_ring = mmap(NULL, ring->buf_ring_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if ((void *)ring->buf_ring == MAP_FAILED) {
+                smb2_set_error(smb2, "Failed to map io_uring buffer ring");
+                goto failed;
+        }
+        ring->bufs = malloc((size_t)SMB2_IO_URING_BUFS *
+                            SMB2_IO_URING_BUF_SIZE);
+        if (ring->bufs == NULL) {
+                smb2_set_error(smb2, "Failed to allocate io_uring buffers");
+                goto failed;
+        }
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+        reg.ring_entries = SMB2_IO_URING_BUFS;
+        reg.bgid = SMB2_IO_URING_BGID;
+        if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING,
+                              &reg, 1) < 0) {
+                smb2_set_error(smb2, "Failed to register io_uring buffers. "
+                               "Errno:%s(%d).", strerror(errno), errno);
+                goto failed;
+        }
+        for (i = 0; i < SMB2_IO_URING_BUFS; i++) {
+                smb2_io_uring_provide_buf(ring, i);
+        }
+
+        if (smb2_io_uring_arm_recv(smb2, ring) < 0) {
+                goto failed;
+        }
+
+        /* The received data is handed to smb2_read_from_socket() straight
+         * from the provided buffers so we no longer need our own.
+         */
+        free(smb2->readahead);
+        smb2->readahead = NULL;
+        smb2->readahead_start = smb2->readahead_end = 0;
+
+        smb2->io_uring = ring;
+        return 0;
+
+ failed:
+        smb2_io_uring_free(ring);
+        return -1;
+}
+
+void
+smb2_io_uring_stop(struct smb2_context *smb2)
+{
+        if (smb2->io_uring == NULL) {
+                return;
+        }
+
+        /* Closing the ring cancels the receive and any pending write */
+        smb2_io_uring_free(smb2->io_uring);
+        smb2->io_uring = NULL;
+
+        smb2->readahead = NULL;
+        smb2->readahead_start = smb2->readahead_end = 0;
+}
+
+int
+smb2_io_uring_get_fd(struct smb2_context *smb2)
+{
+        return smb2->io_uring->fd;
+}
+
+int
+smb2_io_uring_write_busy(struct smb2_context *smb2)
+{
+        return smb2->io_uring->write_busy;
+}
+
+int
+smb2_io_uring_writev(struct smb2_context *smb2, struct iovec *iov, int niov)
+{
+        struct smb2_io_uring *ring = smb2->io_uring;
+        struct io_uring_sqe *sqe;
+
+        sqe = smb2_io_uring_get_sqe(ring);
+        if (sqe == NULL) {
+                smb2_set_error(smb2, "io_uring submission queue is full");
+                return -1;
+        }
+
+        memcpy(ring->iov, iov, niov * sizeof(struct iovec));
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = smb2->fd;
+        sqe->addr = (uint64_t)(uintptr_t)ring->iov;
+        sqe->len = niov;
+        sqe->user_data = SMB2_IO_URING_OP_WRITE;
+
+        if (smb2_io_uring_submit(smb2, ring) < 0) {
+                return -1;
+        }
+        ring->write_busy = 1;
+
+        return 0;
+}
+
+int
+smb2_io_uring_process(struct smb2_context *smb2,
+                      int (*recv_cb)(struct smb2_context *smb2,
+                                     uint8_t *buf, size_t len),
+                      void (*write_cb)(struct smb2_context *smb2,
+                                       size_t count))
+{
+        struct smb2_io_uring *ring = smb2->io_uring;
+        struct io_uring_cqe cqe;
+        unsigned head;
+        uint16_t bid;
+        int ret;
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+                cqe = ring->cqes[head & *ring->cq_mask];
+                head++;
+                __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+                switch (cqe.user_data) {
+                case SMB2_IO_URING_OP_RECV:
+                        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+                                ring->recv_armed = 0;
+                        }
+                        if (cqe.res == -ENOBUFS) {
+                                break;
+                        }
+                        if (cqe.res < 0) {
+                                smb2_set_error(smb2, "Read from socket "
+                                               "failed, errno:%d. Closing "
+                                               "socket.", -cqe.res);
+                                return -1;
+                        }
+                        if (cqe.res == 0) {
+                                smb2_set_error(smb2, "Remote side closed "
+                                               "the socket.");
+                                return -1;
+                        }
+                        bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+                        ret = recv_cb(smb2,
+                                      &ring->bufs[(size_t)bid *
+                                                  SMB2_IO_URING_BUF_SIZE],
+                                      cqe.res);
+                        if (ret < 0) {
+                                return -1;
+                        }
+                        /* The callback may have torn the connection down */
+                        if (smb2->io_uring != ring) {
+                                return 0;
+                        }
+                        smb2_io_uring_provide_buf(ring, bid);
+                        break;
+                case SMB2_IO_URING_OP_WRITE:
+                        ring->write_busy = 0;
+                        if (cqe.res < 0) {
+                                if (cqe.res == -EAGAIN) {
+                                        break;
+                                }
+                                smb2_set_error(smb2, "Error when writing to "
+                                               "socket :%d", -cqe.res);
+                                return -1;
+                        }
+                        write_cb(smb2, cqe.res);
+                        break;
+                }
+        }
+
+        if (!ring->recv_armed) {
+                return smb2_io_uring_arm_recv(smb2, ring);
+        }
+
+        return 0;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+int
+smb2_io_uring_start(struct smb2_context *smb2)
+{
+        smb2_set_error(smb2, "libsmb2 was built without io_uring support");
+        return -1;
+}
+
+void
+smb2_io_uring_stop(struct smb2_context *smb2 _U_)
+{
+}
+
+int
+smb2_io_uring_get_fd(struct smb2_context *smb2 _U_)
+{
+        return -1;
+}
+
+int
+smb2_io_uring_write_busy(struct smb2_context *smb2 _U_)
+{
+        return 0;
+}
+
+int
+smb2_io_uring_writev(struct smb2_context *smb2, struct iovec *iov _U_,
+                     int niov _U_)
+{
+        smb2_set_error(smb2, "libsmb2 was built without io_uring support");
+        return -1;
+}
+
+int
+smb2_io_uring_process(struct smb2_context *smb2,
+                      int (*recv_cb)(struct smb2_context *smb2,
+                                     uint8_t *buf, size_t len) _U_,
+                      void (*write_cb)(struct smb2_context *smb2,
+                                       size_t count) _U_)
+{
+        smb2_set_error(smb2, "libsmb2 was built without io_uring support");
+        return -1;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
+
+int
+smb2_set_io_uring(struct smb2_context *smb2, int entries, int attach_fd)
+{
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT)
+        if (smb2->fd != -1) {
+                smb2_set_error(smb2, "io_uring must be enabled before "
+                               "connecting");
+                return -1;
+        }
+        smb2->io_uring_entries = entries;
+        smb2->io_uring_attach_fd = attach_fd;
+        return 0;
+#else
+        smb2_set_error(smb2, "libsmb2 was built without io_uring support");
+        return -1;
+#endif
+}
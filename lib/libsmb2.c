@@ -70,6 +70,8 @@
 #include "libsmb2.h"
 #include "libsmb2-raw.h"
 #include "libsmb2-private.h"
+#include "smb2-signing.h"
+#include "smb3-seal.h"
 #include "portable-endian.h"
 
 #ifndef HAVE_LIBKRB5
@@ -78,19 +80,23 @@
 #include "krb5-wrapper.h"
 #endif
 
+#ifdef _MSC_VER
+#define random rand
+#endif
+
 /* strings used to derive SMB signing and encryption keys */
 static const char SMB2AESCMAC[] = "SMB2AESCMAC";
 static const char SmbSign[] = "SmbSign";
-/* The following strings will be used for deriving other keys
-static const char SMB2APP[] = "SMB2APP";
-static const char SmbRpc[] = "SmbRpc";
 static const char SMB2AESCCM[] = "SMB2AESCCM";
 static const char ServerOut[] = "ServerOut";
 static const char ServerIn[] = "ServerIn ";
 static const char SMBSigningKey[] = "SMBSigningKey";
-static const char SMBAppKey[] = "SMBAppKey";
 static const char SMBS2CCipherKey[] = "SMBS2CCipherKey";
 static const char SMBC2SCipherKey[] = "SMBC2SCipherKey";
+/* The following strings will be used for deriving other keys
+static const char SMB2APP[] = "SMB2APP";
+static const char SmbRpc[] = "SmbRpc";
+static const char SMBAppKey[] = "SMBAppKey";
 */
 
 #ifndef O_SYNC
@@ -121,9 +127,20 @@ struct connect_data {
         void *auth_data;
 };
 
-struct smb2_dirent_internal {
-        struct smb2_dirent_internal *next;
-        struct smb2dirent dirent;
+/* The names of the entries of one QUERY_DIRECTORY reply, packed into a
+ * single allocation.
+ */
+struct smb2_dirent_names {
+        struct smb2_dirent_names *next;
+        char *buf;
+};
+
+/* Directory entries in one array, so smb2_seekdir() is O(1) */
+struct smb2_dirents {
+        struct smb2dirent *ent;
+        int count;
+        int size;
+        struct smb2_dirent_names *names;
 };
 
 struct smb2dir {
@@ -132,11 +149,68 @@ struct smb2dir {
         void *cb_data;
         smb2_file_id file_id;
 
-        struct smb2_dirent_internal *entries;
-        struct smb2_dirent_internal *current_entry;
+        struct smb2_dirents entries;
         int index;
+
+        /* Streaming directories, see smb2_opendir_stream_async().
+         * entries only holds the current batch, the entries from
+         * batch_start on, while the next batch is fetched into prefetched.
+         */
+        int stream;
+        int batch_start;
+        /* Largest reply to ask for, 0 for smb2_set_dir_query_size() */
+        uint32_t query_size;
+        struct smb2_dirents prefetched;
+        /* Requests in flight that reference dir */
+        int inflight;
+        /* The handle is open on the server */
+        int open;
+        /* The server has no more entries */
+        int eof;
+        /* -errno of the first failure */
+        int error;
+        /* smb2_closedir() was called while requests were in flight */
+        int closed;
+        smb2_command_cb next_cb;
+        void *next_cb_data;
+};
+
+/* A buffer of coalesced application writes, see smb2_set_write_behind() */
+struct smb2_wb_write {
+        struct smb2_wb_write *next;
+        struct smb2fh *fh;
+        uint8_t *buf;
+        uint32_t len;
+        uint64_t offset;
+};
+
+/* An application write whose callback is held back until there is room in
+ * the pipeline again.
+ */
+struct smb2_wb_waiter {
+        struct smb2_wb_waiter *next;
+        smb2_command_cb cb;
+        void *cb_data;
+        int status;
+};
+
+/* A read, or a write issued after it, that waits for the writes before it
+ * to complete.
+ */
+struct smb2_wb_op {
+        struct smb2_wb_op *next;
+        int type;
+        uint8_t *buf;
+        uint32_t count;
+        uint64_t offset;
+        smb2_command_cb cb;
+        void *cb_data;
 };
 
+#define SMB2_WB_OP_WRITE         0
+#define SMB2_WB_OP_READ          1
+#define SMB2_WB_OP_READ_PARALLEL 2
+
 struct smb2fh {
         struct smb2fh *next;
         smb2_command_cb cb;
@@ -144,11 +218,35 @@ struct smb2fh {
 
         smb2_file_id file_id;
         int64_t offset;
+
+        /* Write-behind. Enabled if wb_max_inflight is non-zero.
+         * wb_buf collects adjacent writes starting at wb_offset until it
+         * is full or the pipeline has room, then it moves to wb_pending
+         * and from there it is sent once fewer than wb_max_inflight
+         * WRITEs are in flight.
+         */
+        int wb_max_inflight;
+        int wb_inflight;
+        int wb_error;
+        uint32_t wb_size;
+        uint8_t *wb_buf;
+        uint32_t wb_len;
+        uint64_t wb_offset;
+        struct smb2_wb_write *wb_pending;
+        struct smb2_wb_waiter *wb_waiters;
+        /* Reads wait here until all data written before them has been
+         * acknowledged, and so does everything issued after them.
+         */
+        struct smb2_wb_op *wb_ops;
+        /* Called once everything has been written, for fsync and close */
+        void (*wb_drained)(struct smb2_context *smb2, struct smb2fh *fh,
+                           int status);
 };
 
 static void
 smb2_close_context(struct smb2_context *smb2)
 {
+        smb2_io_uring_stop(smb2);
         if (smb2->fd != -1) {
                 close(smb2->fd);
                 smb2->fd = -1;
@@ -158,6 +256,11 @@ smb2_close_context(struct smb2_context *smb2)
         smb2->session_id = 0;
         smb2->tree_id = 0;
         memset(smb2->signing_key, 0, SMB2_KEY_SIZE);
+        free(smb2->signing_ctx);
+        smb2->signing_ctx = NULL;
+        free(smb2->signing_hmac);
+        smb2->signing_hmac = NULL;
+        smb3_free_seal_keys(smb2);
         if (smb2->session_key) {
                 free(smb2->session_key);
                 smb2->session_key = NULL;
@@ -171,16 +274,26 @@ send_session_setup_request(struct smb2_context *smb2,
                            unsigned char *buf, int len);
 
 static void
-free_smb2dir(struct smb2_context *smb2, struct smb2dir *dir)
+free_dirents(struct smb2_dirents *d)
 {
-        SMB2_LIST_REMOVE(&smb2->dirs, dir);
-        while (dir->entries) {
-                struct smb2_dirent_internal *e = dir->entries->next;
+        while (d->names) {
+                struct smb2_dirent_names *n = d->names->next;
 
-                free(discard_const(dir->entries->dirent.name));
-                free(dir->entries);
-                dir->entries = e;
+                free(d->names);
+                d->names = n;
         }
+        free(d->ent);
+        memset(d, 0, sizeof(struct smb2_dirents));
+}
+
+static void
+free_smb2dir(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        smb2_lock(smb2);
+        SMB2_LIST_REMOVE(&smb2->dirs, dir);
+        smb2_unlock(smb2);
+        free_dirents(&dir->entries);
+        free_dirents(&dir->prefetched);
         free(dir);
 }
 
@@ -195,13 +308,13 @@ void
 smb2_seekdir(struct smb2_context *smb2, struct smb2dir *dir,
                   long loc)
 {
-        dir->current_entry = dir->entries;
-        dir->index = 0;
-
-        while (dir->current_entry && loc--) {
-                dir->current_entry = dir->current_entry->next;
-                dir->index++;
+        if (loc < dir->batch_start) {
+                loc = dir->batch_start;
         }
+        if (loc > dir->batch_start + dir->entries.count) {
+                loc = dir->batch_start + dir->entries.count;
+        }
+        dir->index = loc;
 }
 
 long
@@ -214,106 +327,317 @@ void
 smb2_rewinddir(struct smb2_context *smb2,
                     struct smb2dir *dir)
 {
-        dir->current_entry = dir->entries;
-        dir->index = 0;
+        dir->index = dir->batch_start;
 }
 
 struct smb2dirent *
 smb2_readdir(struct smb2_context *smb2,
              struct smb2dir *dir)
 {
-        struct smb2dirent *ent;
+        int i = dir->index - dir->batch_start;
 
-        if (dir->current_entry == NULL) {
+        if (i >= dir->entries.count) {
                 return NULL;
         }
-
-        ent = &dir->current_entry->dirent;
-        dir->current_entry = dir->current_entry->next;
         dir->index++;
 
-        return ent;
+        return &dir->entries.ent[i];
+}
+
+static void
+od_close_cb(struct smb2_context *smb2, int status,
+            void *command_data, void *private_data)
+{
+}
+
+/* Close the handle of a directory. Nobody waits for the reply. Once the
+ * connection is gone, or the context is being destroyed, the handle is
+ * gone too and nothing is sent.
+ */
+static void
+smb2_dir_close_handle(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        struct smb2_close_request req;
+        struct smb2_pdu *pdu;
+
+        if (!dir->open || !smb2->is_connected) {
+                return;
+        }
+        dir->open = 0;
+
+        memset(&req, 0, sizeof(struct smb2_close_request));
+        memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
+
+        pdu = smb2_cmd_close_async(smb2, &req, od_close_cb, NULL);
+        if (pdu == NULL) {
+                return;
+        }
+        smb2_queue_pdu(smb2, pdu);
+}
+
+/* Close the handle and free dir, or have the last reply to a request
+ * that is still in flight do it.
+ */
+static void
+smb2_dir_release(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        smb2_lock(smb2);
+        if (dir->inflight) {
+                dir->closed = 1;
+                smb2_unlock(smb2);
+                return;
+        }
+        smb2_unlock(smb2);
+
+        smb2_dir_close_handle(smb2, dir);
+        free_smb2dir(smb2, dir);
 }
 
 void
 smb2_closedir(struct smb2_context *smb2, struct smb2dir *dir)
 {
-        free_smb2dir(smb2, dir);
+        smb2_dir_release(smb2, dir);
 }
 
+/* Append the entries of a QUERY_DIRECTORY reply to d. Returns the
+ * number of entries or -1.
+ */
 static int
-decode_dirents(struct smb2_context *smb2, struct smb2dir *dir,
+decode_dirents(struct smb2_context *smb2, struct smb2_dirents *d,
                struct smb2_iovec *vec)
 {
-        struct smb2_dirent_internal *ent;
         struct smb2_fileidfulldirectoryinformation fs;
-        uint32_t offset = 0;
+        struct smb2_dirent_names *names;
+        struct smb2_iovec tmp_vec;
+        struct smb2dirent *ent;
+        uint32_t offset = 0, next;
+        size_t names_size = 0;
+        char *name;
+        int count = 0, size, i;
 
+        /* Count the entries and how much room their names need */
         do {
-                struct smb2_iovec tmp_vec;
-
                 /* Make sure we do not go beyond end of vector */
                 if (offset >= vec->len) {
                         smb2_set_error(smb2, "Malformed query reply.");
                         return -1;
                 }
-                
-                ent = malloc(sizeof(struct smb2_dirent_internal));
+                tmp_vec.buf = &vec->buf[offset];
+                tmp_vec.len = vec->len - offset;
+
+                size = smb2_fileidfulldirectoryinformation_name_size(smb2,
+                                                                 &tmp_vec);
+                if (size < 0) {
+                        return -1;
+                }
+                names_size += size;
+                count++;
+
+                smb2_get_uint32(&tmp_vec, 0, &next);
+                offset += next;
+        } while (next);
+
+        if (d->count + count > d->size) {
+                size = d->size ? d->size : count;
+                while (size < d->count + count) {
+                        size *= 2;
+                }
+                ent = realloc(d->ent, size * sizeof(struct smb2dirent));
                 if (ent == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate "
-                                       "dirent_internal");
+                        smb2_set_error(smb2, "Failed to allocate dirents");
                         return -1;
                 }
-                memset(ent, 0, sizeof(struct smb2_dirent_internal));
-                SMB2_LIST_ADD(&dir->entries, ent);
+                d->ent = ent;
+                d->size = size;
+        }
 
+        names = malloc(sizeof(struct smb2_dirent_names) + names_size);
+        if (names == NULL) {
+                smb2_set_error(smb2, "Failed to allocate dirent names");
+                return -1;
+        }
+        names->buf = (char *)(names + 1);
+        SMB2_LIST_ADD(&d->names, names);
 
+        name = names->buf;
+        offset = 0;
+        for (i = 0; i < count; i++) {
                 tmp_vec.buf = &vec->buf[offset];
                 tmp_vec.len = vec->len - offset;
 
                 smb2_decode_fileidfulldirectoryinformation(smb2, &fs,
-                                                           &tmp_vec);
-                /* steal the name */
-                ent->dirent.name = fs.name;
-                ent->dirent.st.smb2_type = SMB2_TYPE_FILE;
+                                                           &tmp_vec, name);
+                name += strlen(name) + 1;
+
+                ent = &d->ent[d->count + i];
+                ent->name = fs.name;
+                ent->st.smb2_type = SMB2_TYPE_FILE;
                 if (fs.file_attributes & SMB2_FILE_ATTRIBUTE_DIRECTORY) {
-                        ent->dirent.st.smb2_type = SMB2_TYPE_DIRECTORY;
-                }
-                ent->dirent.st.smb2_nlink = 0;
-                ent->dirent.st.smb2_ino = fs.file_id;
-                ent->dirent.st.smb2_size = fs.end_of_file;
-                ent->dirent.st.smb2_atime = fs.last_access_time.tv_sec;
-                ent->dirent.st.smb2_atime_nsec = fs.last_access_time.tv_usec * 1000;
-                ent->dirent.st.smb2_mtime = fs.last_write_time.tv_sec;
-                ent->dirent.st.smb2_mtime_nsec = fs.last_write_time.tv_usec * 1000;
-                ent->dirent.st.smb2_ctime = fs.change_time.tv_sec;
-                ent->dirent.st.smb2_ctime_nsec = fs.change_time.tv_usec * 1000;
-                ent->dirent.st.smb2_btime = fs.creation_time.tv_sec;
-                ent->dirent.st.smb2_btime_nsec = fs.creation_time.tv_usec * 1000;
+                        ent->st.smb2_type = SMB2_TYPE_DIRECTORY;
+                }
+                ent->st.smb2_nlink = 0;
+                ent->st.smb2_ino = fs.file_id;
+                ent->st.smb2_size = fs.end_of_file;
+                ent->st.smb2_atime = fs.last_access_time.tv_sec;
+                ent->st.smb2_atime_nsec = fs.last_access_time.tv_usec * 1000;
+                ent->st.smb2_mtime = fs.last_write_time.tv_sec;
+                ent->st.smb2_mtime_nsec = fs.last_write_time.tv_usec * 1000;
+                ent->st.smb2_ctime = fs.change_time.tv_sec;
+                ent->st.smb2_ctime_nsec = fs.change_time.tv_usec * 1000;
+                ent->st.smb2_btime = fs.creation_time.tv_sec;
+                ent->st.smb2_btime_nsec = fs.creation_time.tv_usec * 1000;
 
                 offset += fs.next_entry_offset;
-        } while (fs.next_entry_offset);
-        
+        }
+        d->count += count;
+
+        return count;
+}
+
+static void
+query_cb(struct smb2_context *smb2, int status,
+         void *command_data, void *private_data);
+
+/* The largest reply a QUERY_DIRECTORY can ask for when queries of this
+ * size are sent together, in a compound after a CREATE if there is more
+ * than one. The request is charged one credit per 64 KiB.
+ */
+static uint32_t
+smb2_dir_query_size(struct smb2_context *smb2, struct smb2dir *dir,
+                    int queries)
+{
+        uint32_t size = smb2->max_transact_size;
+        uint32_t limit = dir->query_size;
+        uint32_t credits;
+
+        if (limit == 0) {
+                limit = smb2->dir_query_size;
+        }
+        if (limit && limit < size) {
+                size = limit;
+        }
+        if (!smb2->supports_multi_credit && size > 0xffff) {
+                size = 0xffff;
+        }
+
+        /* Do not ask for more than the credits we hold can pay for.
+         * If nothing else is in flight no reply would grant us the rest
+         * and the query would never be sent. The window grows with
+         * demand so later queries can ask for more.
+         */
+        credits = smb2->credits;
+        if (queries > 1) {
+                credits = credits > queries ? (credits - 1) / queries : 1;
+        }
+        if (credits == 0) {
+                credits = 1;
+        }
+        if (smb2->supports_multi_credit && size > credits * 65536) {
+                size = credits * 65536;
+        }
+        if (size == 0) {
+                size = 0xffff;
+        }
+
+        return size;
+}
+
+static struct smb2_pdu *
+smb2_dir_query_pdu(struct smb2_context *smb2, struct smb2dir *dir,
+                   const uint8_t *file_id, uint32_t size)
+{
+        struct smb2_query_directory_request req;
+        struct smb2_pdu *pdu;
+
+        memset(&req, 0, sizeof(struct smb2_query_directory_request));
+        req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
+        req.flags = 0;
+        memcpy(req.file_id, file_id, SMB2_FD_SIZE);
+        req.output_buffer_length = size;
+        req.name = "*";
+
+        pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
+        if (pdu == NULL) {
+                smb2_set_error(smb2, "Failed to create query command.");
+                return NULL;
+        }
+
+        return pdu;
+}
+
+/* Ask for the next batch of entries */
+static int
+smb2_dir_query(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        struct smb2_pdu *pdu;
+
+        pdu = smb2_dir_query_pdu(smb2, dir, dir->file_id,
+                                 smb2_dir_query_size(smb2, dir, 1));
+        if (pdu == NULL) {
+                return -1;
+        }
+        smb2_lock(smb2);
+        dir->inflight++;
+        smb2_unlock(smb2);
+        smb2_queue_pdu(smb2, pdu);
+
         return 0;
 }
 
+/* Make the prefetched batch the current one and start fetching the next.
+ * Returns the number of entries in the new batch, 0 at the end of the
+ * directory or -errno.
+ */
+static int
+smb2_dir_next_batch(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        int count;
+
+        if (dir->error) {
+                return dir->error;
+        }
+
+        /* An empty prefetch means the current batch was the last one */
+        dir->batch_start += dir->entries.count;
+        dir->index = dir->batch_start;
+        free_dirents(&dir->entries);
+        dir->entries = dir->prefetched;
+        memset(&dir->prefetched, 0, sizeof(struct smb2_dirents));
+        count = dir->entries.count;
+        if (count == 0) {
+                return 0;
+        }
+
+        if (!dir->eof && !dir->inflight && smb2_dir_query(smb2, dir) < 0) {
+                dir->error = -ENOMEM;
+        }
+
+        return count;
+}
+
+/* The directory has been read, or failed, and nothing is in flight */
 static void
-od_close_cb(struct smb2_context *smb2, int status,
-         void *command_data, void *private_data)
+smb2_dir_opened(struct smb2_context *smb2, struct smb2dir *dir)
 {
-        struct smb2dir *dir = private_data;
+        smb2_command_cb cb = dir->cb;
 
-        if (status != SMB2_STATUS_SUCCESS) {
-                dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
-                free_smb2dir(smb2, dir);
+        dir->cb = NULL;
+        if (dir->error) {
+                cb(smb2, dir->error, NULL, dir->cb_data);
+                smb2_dir_release(smb2, dir);
                 return;
         }
+        if (dir->eof) {
+                smb2_dir_close_handle(smb2, dir);
+        }
 
-        dir->current_entry = dir->entries;
-        dir->index = 0;
-
+        if (dir->stream) {
+                smb2_dir_next_batch(smb2, dir);
+        } else {
+                dir->index = 0;
+        }
         /* dir will be freed in smb2_closedir() */
-        dir->cb(smb2, 0, dir, dir->cb_data);
+        cb(smb2, 0, dir, dir->cb_data);
 }
 
 static void
@@ -322,65 +646,92 @@ query_cb(struct smb2_context *smb2, int status,
 {
         struct smb2dir *dir = private_data;
         struct smb2_query_directory_reply *rep = command_data;
-
+        struct smb2_dirents entries;
+        smb2_command_cb cb = NULL;
+        void *cb_data = NULL;
+        int err = 0, last, count;
+
+        /* Entries of a streaming directory are decoded on the side, the
+         * application may be reading the current batch.
+         */
+        memset(&entries, 0, sizeof(struct smb2_dirents));
         if (status == SMB2_STATUS_SUCCESS) {
                 struct smb2_iovec vec;
-                struct smb2_query_directory_request req;
-                struct smb2_pdu *pdu;
 
                 vec.buf = rep->output_buffer;
                 vec.len = rep->output_buffer_length;
 
-                if (decode_dirents(smb2, dir, &vec) < 0) {
-                        dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
-                        free_smb2dir(smb2, dir);
-                        return;
+                if (decode_dirents(smb2, dir->stream ?
+                                   &entries : &dir->entries, &vec) < 0) {
+                        err = -ENOMEM;
                 }
+        } else if (status != SMB2_STATUS_NO_MORE_FILES && !dir->error) {
+                smb2_set_error(smb2, "Query directory failed with "
+                               "(0x%08x) %s. %s", status,
+                               nterror_to_str(status),
+                               smb2_get_error(smb2));
+                err = -nterror_to_errno(status);
+        }
 
-                /* We need to get more data */
-                memset(&req, 0, sizeof(struct smb2_query_directory_request));
-                req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
-                req.flags = 0;
-                memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
-                req.output_buffer_length = 0xffff;
-                req.name = "*";
-
-                pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
-                if (pdu == NULL) {
-                        dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
+        smb2_lock(smb2);
+        dir->inflight--;
+        last = dir->inflight == 0;
+        if (dir->closed) {
+                smb2_unlock(smb2);
+                free_dirents(&entries);
+                if (last) {
+                        smb2_dir_close_handle(smb2, dir);
                         free_smb2dir(smb2, dir);
-                        return;
                 }
-                smb2_queue_pdu(smb2, pdu);
-
                 return;
         }
-
         if (status == SMB2_STATUS_NO_MORE_FILES) {
-                struct smb2_close_request req;
-                struct smb2_pdu *pdu;
-
-                /* We have all the data */
-                memset(&req, 0, sizeof(struct smb2_close_request));
-                req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
-                memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
+                dir->eof = 1;
+        }
+        if (err && !dir->error) {
+                dir->error = err;
+        }
+        if (dir->stream && entries.count) {
+                dir->prefetched = entries;
+                memset(&entries, 0, sizeof(struct smb2_dirents));
+        }
+        if (dir->cb == NULL) {
+                cb = dir->next_cb;
+                cb_data = dir->next_cb_data;
+                dir->next_cb = NULL;
+        }
+        smb2_unlock(smb2);
+        free_dirents(&entries);
 
-                pdu = smb2_cmd_close_async(smb2, &req, od_close_cb, dir);
-                if (pdu == NULL) {
-                        dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
-                        free_smb2dir(smb2, dir);
+        if (dir->cb) {
+                /* A streaming directory is open once the first batch has
+                 * arrived, otherwise it has to be read to the end.
+                 */
+                if (dir->stream && (dir->prefetched.count || dir->error)) {
+                        smb2_dir_opened(smb2, dir);
                         return;
                 }
-                smb2_queue_pdu(smb2, pdu);
-
+                if (!last) {
+                        return;
+                }
+                if (dir->eof || dir->error) {
+                        smb2_dir_opened(smb2, dir);
+                        return;
+                }
+                if (smb2_dir_query(smb2, dir) < 0) {
+                        dir->error = -ENOMEM;
+                        smb2_dir_opened(smb2, dir);
+                }
                 return;
         }
 
-        smb2_set_error(smb2, "Query directory failed with (0x%08x) %s. %s",
-                       status, nterror_to_str(status),
-                       smb2_get_error(smb2));
-        dir->cb(smb2, -nterror_to_errno(status), NULL, dir->cb_data);
-        free_smb2dir(smb2, dir);
+        if (last && (dir->eof || dir->error)) {
+                smb2_dir_close_handle(smb2, dir);
+        }
+        if (cb) {
+                count = smb2_dir_next_batch(smb2, dir);
+                cb(smb2, count, count < 0 ? NULL : dir, cb_data);
+        }
 }
 
 static void
@@ -389,43 +740,36 @@ opendir_cb(struct smb2_context *smb2, int status,
 {
         struct smb2dir *dir = private_data;
         struct smb2_create_reply *rep = command_data;
-        struct smb2_query_directory_request req;
-        struct smb2_pdu *pdu;
 
         if (status != SMB2_STATUS_SUCCESS) {
                 smb2_set_error(smb2, "Opendir failed with (0x%08x) %s.",
                                status, nterror_to_str(status));
-                dir->cb(smb2, -nterror_to_errno(status), NULL, dir->cb_data);
-                free_smb2dir(smb2, dir);
-                return;
+                dir->error = -nterror_to_errno(status);
+        } else {
+                memcpy(dir->file_id, rep->file_id, SMB2_FD_SIZE);
+                dir->open = 1;
         }
 
-        memcpy(dir->file_id, rep->file_id, SMB2_FD_SIZE);
-        
-        memset(&req, 0, sizeof(struct smb2_query_directory_request));
-        req.file_information_class = SMB2_FILE_ID_FULL_DIRECTORY_INFORMATION;
-        req.flags = 0;
-        memcpy(req.file_id, dir->file_id, SMB2_FD_SIZE);
-        req.output_buffer_length = 0xffff;
-        req.name = "*";
-
-        pdu = smb2_cmd_query_directory_async(smb2, &req, query_cb, dir);
-        if (pdu == NULL) {
-                smb2_set_error(smb2, "Failed to create query command.");
-                dir->cb(smb2, -ENOMEM, NULL, dir->cb_data);
-                free_smb2dir(smb2, dir);
-                return;
-        }
-        smb2_queue_pdu(smb2, pdu);
+        smb2_lock(smb2);
+        dir->inflight--;
+        smb2_unlock(smb2);
 }
 
-int
-smb2_opendir_async(struct smb2_context *smb2, const char *path,
-                   smb2_command_cb cb, void *cb_data)
+/* CREATE the directory and read the first two batches in the same
+ * compound. A directory that fits in the first reply is listed in a
+ * single round trip, the second QUERY_DIRECTORY returns
+ * STATUS_NO_MORE_FILES then. The handle is closed afterwards without
+ * waiting for it.
+ */
+static int
+smb2_opendir_common(struct smb2_context *smb2, const char *path, int stream,
+                    uint32_t query_size, smb2_command_cb cb, void *cb_data)
 {
         struct smb2_create_request req;
         struct smb2dir *dir;
-        struct smb2_pdu *pdu;
+        struct smb2_pdu *pdu, *next_pdu;
+        uint32_t size;
+        int i;
 
         if (path == NULL) {
                 path = "";
@@ -437,9 +781,13 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
                 return -1;
         }
         memset(dir, 0, sizeof(struct smb2dir));
+        smb2_lock(smb2);
         SMB2_LIST_ADD(&smb2->dirs, dir);
+        smb2_unlock(smb2);
         dir->cb = cb;
         dir->cb_data = cb_data;
+        dir->stream = stream;
+        dir->query_size = query_size;
 
         memset(&req, 0, sizeof(struct smb2_create_request));
         req.requested_oplock_level = SMB2_OPLOCK_LEVEL_NONE;
@@ -457,8 +805,76 @@ smb2_opendir_async(struct smb2_context *smb2, const char *path,
                 smb2_set_error(smb2, "Failed to create opendir command.");
                 return -1;
         }
+
+        size = smb2_dir_query_size(smb2, dir, 2);
+        for (i = 0; i < 2; i++) {
+                next_pdu = smb2_dir_query_pdu(smb2, dir, compound_file_id,
+                                              size);
+                if (next_pdu == NULL) {
+                        smb2_free_pdu(smb2, pdu);
+                        free_smb2dir(smb2, dir);
+                        return -1;
+                }
+                smb2_add_compound_pdu(smb2, pdu, next_pdu);
+        }
+        dir->inflight = 3;
+
         smb2_queue_pdu(smb2, pdu);
-        
+
+        return 0;
+}
+
+int
+smb2_opendir_async(struct smb2_context *smb2, const char *path,
+                   smb2_command_cb cb, void *cb_data)
+{
+        return smb2_opendir_common(smb2, path, 0, 0, cb, cb_data);
+}
+
+int
+smb2_opendir_stream_async(struct smb2_context *smb2, const char *path,
+                          smb2_command_cb cb, void *cb_data)
+{
+        return smb2_opendir_common(smb2, path, 1, 0, cb, cb_data);
+}
+
+int
+smb2_opendir_sized_async(struct smb2_context *smb2, const char *path,
+                         uint32_t query_size, smb2_command_cb cb,
+                         void *cb_data)
+{
+        return smb2_opendir_common(smb2, path, 1, query_size, cb, cb_data);
+}
+
+int
+smb2_readdir_next_async(struct smb2_context *smb2, struct smb2dir *dir,
+                        smb2_command_cb cb, void *cb_data)
+{
+        int count;
+
+        if (!dir->stream) {
+                smb2_set_error(smb2, "Not a streaming directory");
+                return -EINVAL;
+        }
+
+        smb2_lock(smb2);
+        if (dir->next_cb) {
+                smb2_unlock(smb2);
+                smb2_set_error(smb2, "Already waiting for the next batch");
+                return -EBUSY;
+        }
+        if (dir->inflight) {
+                /* query_cb() moves on when the batch arrives */
+                dir->next_cb = cb;
+                dir->next_cb_data = cb_data;
+                smb2_unlock(smb2);
+                return 0;
+        }
+        smb2_unlock(smb2);
+
+        count = smb2_dir_next_batch(smb2, dir);
+        cb(smb2, count, count < 0 ? NULL : dir, cb_data);
+
         return 0;
 }
 
@@ -487,6 +903,7 @@ tree_connect_cb(struct smb2_context *smb2, int status,
                 void *command_data, void *private_data)
 {
         struct connect_data *c_data = private_data;
+        struct smb2_tree_connect_reply *rep = command_data;
 
         if (status != SMB2_STATUS_SUCCESS) {
                 smb2_close_context(smb2);
@@ -498,6 +915,17 @@ tree_connect_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
+        if (rep->share_flags & SMB2_SHAREFLAG_ENCRYPT_DATA) {
+                if (!smb2->have_seal_keys) {
+                        smb2_set_error(smb2, "Share requires encryption but "
+                                       "no encryption keys are available");
+                        c_data->cb(smb2, -EACCES, NULL, c_data->cb_data);
+                        free_c_data(smb2, c_data);
+                        return;
+                }
+                smb2->seal = 1;
+        }
+
         c_data->cb(smb2, 0, NULL, c_data->cb_data);
         free_c_data(smb2, c_data);
 }
@@ -539,6 +967,8 @@ session_setup_cb(struct smb2_context *smb2, int status,
         struct smb2_session_setup_reply *rep = command_data;
         struct smb2_tree_connect_request req;
         struct smb2_pdu *pdu;
+        int have_valid_session_key = 0;
+        int verify;
         int ret;
 
         if (status == SMB2_STATUS_MORE_PROCESSING_REQUIRED) {
@@ -579,9 +1009,14 @@ session_setup_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        if (smb2->signing_required) {
+        if (rep->session_flags & SMB2_SESSION_FLAG_IS_ENCRYPT_DATA) {
+                smb2->seal = 1;
+        }
+
+        if (smb2->signing_required || smb2->supports_encryption) {
                 uint8_t zero_key[SMB2_KEY_SIZE] = {0};
-                int have_valid_session_key = 1;
+
+                have_valid_session_key = 1;
 #ifdef HAVE_LIBKRB5
                 if (krb5_session_get_session_key(smb2, c_data->auth_data) < 0) {
                         have_valid_session_key = 0;
@@ -597,20 +1032,76 @@ session_setup_cb(struct smb2_context *smb2, int status,
                 if (smb2->session_key == NULL || memcmp(smb2->session_key, zero_key, SMB2_KEY_SIZE) == 0) {
                         have_valid_session_key = 0;
                 }
-                if (have_valid_session_key == 0)
+                if (have_valid_session_key == 0 &&
+                    (smb2->signing_required || smb2->seal))
                 {
                         smb2_close_context(smb2);
-                        smb2_set_error(smb2, "Signing required by server. Session "
+                        smb2_set_error(smb2, "%s required. Session "
                                        "Key is not available %s",
+                                       smb2->signing_required ?
+                                       "Signing" : "Encryption",
                                        smb2_get_error(smb2));
                         c_data->cb(smb2, -1, NULL, c_data->cb_data);
                         free_c_data(smb2, c_data);
                         return;
                 }
+        }
 
+        if (smb2->supports_encryption && have_valid_session_key) {
+                smb3_free_seal_keys(smb2);
+                if (smb2->dialect == SMB2_VERSION_0311) {
+                        smb2_derive_key(smb2->session_key,
+                                        smb2->session_key_size,
+                                        SMBC2SCipherKey,
+                                        sizeof(SMBC2SCipherKey),
+                                        (char *)smb2->preauth_hash,
+                                        SMB2_PREAUTH_HASH_SIZE,
+                                        smb2->serverin_key);
+                        smb2_derive_key(smb2->session_key,
+                                        smb2->session_key_size,
+                                        SMBS2CCipherKey,
+                                        sizeof(SMBS2CCipherKey),
+                                        (char *)smb2->preauth_hash,
+                                        SMB2_PREAUTH_HASH_SIZE,
+                                        smb2->serverout_key);
+                } else {
+                        smb2_derive_key(smb2->session_key,
+                                        smb2->session_key_size,
+                                        SMB2AESCCM,
+                                        sizeof(SMB2AESCCM),
+                                        ServerIn,
+                                        sizeof(ServerIn),
+                                        smb2->serverin_key);
+                        smb2_derive_key(smb2->session_key,
+                                        smb2->session_key_size,
+                                        SMB2AESCCM,
+                                        sizeof(SMB2AESCCM),
+                                        ServerOut,
+                                        sizeof(ServerOut),
+                                        smb2->serverout_key);
+                }
+                smb2->have_seal_keys = 1;
+        }
+
+        /* The final reply must be signed if we sign. On 3.1.1 the
+         * server always signs it, except for guest and anonymous
+         * sessions, which protects the preauth hash of the
+         * negotiation.
+         */
+        verify = smb2->signing_required ||
+                (smb2->dialect == SMB2_VERSION_0311 &&
+                 have_valid_session_key &&
+                 !(rep->session_flags & (SMB2_SESSION_FLAG_IS_GUEST |
+                                         SMB2_SESSION_FLAG_IS_NULL)));
+
+        if (verify) {
                 /* Derive the signing key from session key
                  * This is based on negotiated protocol
                  */
+                free(smb2->signing_ctx);
+                smb2->signing_ctx = NULL;
+                free(smb2->signing_hmac);
+                smb2->signing_hmac = NULL;
                 if (smb2->dialect == SMB2_VERSION_0202 ||
                     smb2->dialect == SMB2_VERSION_0210) {
                         /* For SMB2 session key is the signing key */
@@ -625,11 +1116,34 @@ session_setup_cb(struct smb2_context *smb2, int status,
                                         SmbSign,
                                         sizeof(SmbSign),
                                         smb2->signing_key);
-                } else if (smb2->dialect > SMB2_VERSION_0302) {
+                } else {
+                        smb2_derive_key(smb2->session_key,
+                                        smb2->session_key_size,
+                                        SMBSigningKey,
+                                        sizeof(SMBSigningKey),
+                                        (char *)smb2->preauth_hash,
+                                        SMB2_PREAUTH_HASH_SIZE,
+                                        smb2->signing_key);
+                }
+        }
+
+        /* The session is set up, stop hashing */
+        smb2->preauth = 0;
+
+        /* Now that we have the keys we can check the signature of this
+         * final reply.
+         */
+        if (verify) {
+                if (smb2->hdr.flags & SMB2_FLAGS_SIGNED) {
+                        ret = smb2_pdu_check_signature(smb2, smb2->pdu);
+                } else {
+                        smb2_set_error(smb2, "Final session setup reply "
+                                       "is not signed");
+                        ret = -1;
+                }
+                if (ret < 0) {
                         smb2_close_context(smb2);
-                        smb2_set_error(smb2, "Signing Required by server. "
-                                             "Not yet implemented for SMB3.1");
-                        c_data->cb(smb2, -EINVAL, NULL, c_data->cb_data);
+                        c_data->cb(smb2, -EACCES, NULL, c_data->cb_data);
                         free_c_data(smb2, c_data);
                         return;
                 }
@@ -699,7 +1213,7 @@ negotiate_cb(struct smb2_context *smb2, int status,
 {
         struct connect_data *c_data = private_data;
         struct smb2_negotiate_reply *rep = command_data;
-        int ret;
+        int i, ret;
 
         if (status != SMB2_STATUS_SUCCESS) {
                 smb2_close_context(smb2);
@@ -728,6 +1242,63 @@ negotiate_cb(struct smb2_context *smb2, int status,
                 smb2->signing_required = 1;
         }
 
+        smb2->supports_encryption = 0;
+        smb2->compression_algorithms = 0;
+        smb2->compression_chained = 0;
+        smb2->signing_algorithm = smb2->dialect >= SMB2_VERSION_0300 ?
+                SMB2_SIGNING_AES_CMAC : SMB2_SIGNING_HMAC_SHA256;
+        if (smb2->dialect == SMB2_VERSION_0311) {
+                /* SMB 3.1.1 picks the algorithms in negotiate contexts */
+                if (rep->preauth_hash_algorithm !=
+                    SMB2_PREAUTH_INTEGRITY_SHA512) {
+                        smb2_close_context(smb2);
+                        smb2_set_error(smb2, "Server did not select SHA-512 "
+                                       "preauth integrity");
+                        c_data->cb(smb2, -EINVAL, NULL, c_data->cb_data);
+                        free_c_data(smb2, c_data);
+                        return;
+                }
+                if (rep->signing_algorithm == SMB2_SIGNING_AES_GMAC) {
+                        smb2->signing_algorithm = SMB2_SIGNING_AES_GMAC;
+                }
+                if (rep->cipher == SMB2_ENCRYPTION_AES128_CCM ||
+                    rep->cipher == SMB2_ENCRYPTION_AES128_GCM) {
+                        smb2->supports_encryption = 1;
+                        smb2->cipher = rep->cipher;
+                }
+                for (i = 0; i < rep->compression_algorithm_count; i++) {
+                        switch (rep->compression_algorithms[i]) {
+                        case SMB2_COMPRESSION_LZ77:
+                        case SMB2_COMPRESSION_LZ77_HUFFMAN:
+                        case SMB2_COMPRESSION_PATTERN_V1:
+                                smb2->compression_algorithms |=
+                                        1 << rep->compression_algorithms[i];
+                                break;
+                        }
+                }
+                if (rep->compression_flags &
+                    SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED) {
+                        smb2->compression_chained = 1;
+                }
+        } else {
+                smb2->preauth = 0;
+
+                /* SMB 3.0 and 3.0.2 encrypt with AES-128-CCM */
+                if (smb2->dialect >= SMB2_VERSION_0300 &&
+                    rep->capabilities & SMB2_GLOBAL_CAP_ENCRYPTION) {
+                        smb2->supports_encryption = 1;
+                        smb2->cipher = SMB2_ENCRYPTION_AES128_CCM;
+                }
+        }
+        if (smb2->seal && !smb2->supports_encryption) {
+                smb2_close_context(smb2);
+                smb2_set_error(smb2, "Encryption requested but not "
+                               "supported by the server");
+                c_data->cb(smb2, -EINVAL, NULL, c_data->cb_data);
+                free_c_data(smb2, c_data);
+                return;
+        }
+
 #ifndef HAVE_LIBKRB5
         c_data->auth_data = ntlmssp_init_context(smb2->user,
                                                  smb2->password,
@@ -763,6 +1334,7 @@ connect_cb(struct smb2_context *smb2, int status,
         struct connect_data *c_data = private_data;
         struct smb2_negotiate_request req;
         struct smb2_pdu *pdu;
+        int i;
 
         if (status != 0) {
                 smb2_set_error(smb2, "Socket connect failed with %d",
@@ -773,15 +1345,17 @@ connect_cb(struct smb2_context *smb2, int status,
         }
 
         memset(&req, 0, sizeof(struct smb2_negotiate_request));
-        req.capabilities = SMB2_GLOBAL_CAP_LARGE_MTU;
+        req.capabilities = SMB2_GLOBAL_CAP_LARGE_MTU |
+                SMB2_GLOBAL_CAP_ENCRYPTION;
         req.security_mode = smb2->security_mode;
         switch (smb2->version) {
         case SMB2_VERSION_ANY:
-                req.dialect_count = 4;
+                req.dialect_count = 5;
                 req.dialects[0] = SMB2_VERSION_0202;
                 req.dialects[1] = SMB2_VERSION_0210;
                 req.dialects[2] = SMB2_VERSION_0300;
                 req.dialects[3] = SMB2_VERSION_0302;
+                req.dialects[4] = SMB2_VERSION_0311;
                 break;
         case SMB2_VERSION_ANY2:
                 req.dialect_count = 2;
@@ -789,14 +1363,16 @@ connect_cb(struct smb2_context *smb2, int status,
                 req.dialects[1] = SMB2_VERSION_0210;
                 break;
         case SMB2_VERSION_ANY3:
-                req.dialect_count = 2;
+                req.dialect_count = 3;
                 req.dialects[0] = SMB2_VERSION_0300;
                 req.dialects[1] = SMB2_VERSION_0302;
+                req.dialects[2] = SMB2_VERSION_0311;
                 break;
         case SMB2_VERSION_0202:
         case SMB2_VERSION_0210:
         case SMB2_VERSION_0300:
         case SMB2_VERSION_0302:
+        case SMB2_VERSION_0311:
                 req.dialect_count = 1;
                 req.dialects[0] = smb2->version;
                 break;
@@ -804,6 +1380,34 @@ connect_cb(struct smb2_context *smb2, int status,
 
         memcpy(req.client_guid, smb2_get_client_guid(smb2), SMB2_GUID_SIZE);
 
+        /* Offering SMB 3.1.1. Hash everything from the NEGOTIATE request
+         * until the session is set up, in case the server picks it.
+         */
+        smb2->preauth = 0;
+        if (req.dialects[req.dialect_count - 1] == SMB2_VERSION_0311) {
+                for (i = 0; i < SMB2_PREAUTH_SALT_SIZE; i++) {
+                        req.preauth_salt[i] = random() & 0xff;
+                }
+                req.cipher_count = 2;
+                req.ciphers[0] = SMB2_ENCRYPTION_AES128_GCM;
+                req.ciphers[1] = SMB2_ENCRYPTION_AES128_CCM;
+                req.signing_algorithm_count = 2;
+                req.signing_algorithms[0] = SMB2_SIGNING_AES_GMAC;
+                req.signing_algorithms[1] = SMB2_SIGNING_AES_CMAC;
+                if (smb2->compression_threshold) {
+                        req.compression_algorithm_count = 3;
+                        req.compression_algorithms[0] = SMB2_COMPRESSION_LZ77;
+                        req.compression_algorithms[1] =
+                                SMB2_COMPRESSION_LZ77_HUFFMAN;
+                        req.compression_algorithms[2] =
+                                SMB2_COMPRESSION_PATTERN_V1;
+                        req.compression_flags =
+                                SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED;
+                }
+                smb2->preauth = 1;
+                memset(smb2->preauth_hash, 0, SMB2_PREAUTH_HASH_SIZE);
+        }
+
         pdu = smb2_cmd_negotiate_async(smb2, &req, negotiate_cb, c_data);
         if (pdu == NULL) {
                 c_data->cb(smb2, -ENOMEM, NULL, c_data->cb_data);
@@ -888,7 +1492,34 @@ smb2_connect_share_async(struct smb2_context *smb2,
 static void
 free_smb2fh(struct smb2_context *smb2, struct smb2fh *fh)
 {
+        struct smb2_wb_write *w;
+        struct smb2_wb_waiter *waiter;
+        struct smb2_wb_op *op;
+
+        while ((w = fh->wb_pending) != NULL) {
+                fh->wb_pending = w->next;
+                free(w->buf);
+                free(w);
+        }
+        while ((waiter = fh->wb_waiters) != NULL) {
+                fh->wb_waiters = waiter->next;
+                waiter->cb(smb2, -ECONNRESET, NULL, waiter->cb_data);
+                free(waiter);
+        }
+        while ((op = fh->wb_ops) != NULL) {
+                fh->wb_ops = op->next;
+                op->cb(smb2, -ECONNRESET, NULL, op->cb_data);
+                free(op);
+        }
+        if (fh->wb_drained) {
+                fh->wb_drained = NULL;
+                fh->cb(smb2, -ECONNRESET, NULL, fh->cb_data);
+        }
+        free(fh->wb_buf);
+
+        smb2_lock(smb2);
         SMB2_LIST_REMOVE(&smb2->fhs, fh);
+        smb2_unlock(smb2);
         free(fh);
 }
 
@@ -899,6 +1530,23 @@ void smb2_free_all_fhs(struct smb2_context *smb2)
         }
 }
 
+int smb2_any_write_behind(struct smb2_context *smb2)
+{
+        struct smb2fh *fh;
+        int ret = 0;
+
+        smb2_lock(smb2);
+        for (fh = smb2->fhs; fh; fh = fh->next) {
+                if (fh->wb_max_inflight) {
+                        ret = 1;
+                        break;
+                }
+        }
+        smb2_unlock(smb2);
+
+        return ret;
+}
+
 static void
 open_cb(struct smb2_context *smb2, int status,
         void *command_data, void *private_data)
@@ -936,7 +1584,9 @@ smb2_open_async(struct smb2_context *smb2, const char *path, int flags,
                 return -ENOMEM;
         }
         memset(fh, 0, sizeof(struct smb2fh));
+        smb2_lock(smb2);
         SMB2_LIST_ADD(&smb2->fhs, fh);
+        smb2_unlock(smb2);
 
         fh->cb = cb;
         fh->cb_data = cb_data;
@@ -1014,20 +1664,28 @@ close_cb(struct smb2_context *smb2, int status,
                 return;
         }
 
-        fh->cb(smb2, 0, NULL, fh->cb_data);
+        /* Report any error from write-behind that we have not reported
+         * yet.
+         */
+        fh->cb(smb2, fh->wb_error, NULL, fh->cb_data);
         free_smb2fh(smb2, fh);
 }
-        
-int
-smb2_close_async(struct smb2_context *smb2, struct smb2fh *fh,
-                 smb2_command_cb cb, void *cb_data)
+
+static int smb2_wb_flush(struct smb2_context *smb2, struct smb2fh *fh);
+static int smb2_wb_defer(struct smb2_context *smb2, struct smb2fh *fh,
+                         int type, uint8_t *buf, uint32_t count,
+                         uint64_t offset, smb2_command_cb cb,
+                         void *cb_data);
+static int smb2_wb_drain(struct smb2_context *smb2, struct smb2fh *fh,
+                         void (*drained)(struct smb2_context *smb2,
+                                         struct smb2fh *fh, int status));
+
+static int
+smb2_close_send(struct smb2_context *smb2, struct smb2fh *fh)
 {
         struct smb2_close_request req;
         struct smb2_pdu *pdu;
 
-        fh->cb = cb;
-        fh->cb_data = cb_data;
-
         memset(&req, 0, sizeof(struct smb2_close_request));
         req.flags = SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB;
         memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
@@ -1042,6 +1700,30 @@ smb2_close_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+static void
+close_drained(struct smb2_context *smb2, struct smb2fh *fh, int status)
+{
+        /* Close the handle regardless and report the error from close_cb */
+        fh->wb_error = status;
+        if (smb2_close_send(smb2, fh) < 0) {
+                fh->cb(smb2, -ENOMEM, NULL, fh->cb_data);
+        }
+}
+
+int
+smb2_close_async(struct smb2_context *smb2, struct smb2fh *fh,
+                 smb2_command_cb cb, void *cb_data)
+{
+        fh->cb = cb;
+        fh->cb_data = cb_data;
+
+        if (fh->wb_max_inflight) {
+                return smb2_wb_drain(smb2, fh, close_drained);
+        }
+
+        return smb2_close_send(smb2, fh);
+}
+
 static void
 fsync_cb(struct smb2_context *smb2, int status,
          void *command_data, void *private_data)
@@ -1058,16 +1740,12 @@ fsync_cb(struct smb2_context *smb2, int status,
         fh->cb(smb2, 0, NULL, fh->cb_data);
 }
 
-int
-smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
-                 smb2_command_cb cb, void *cb_data)
+static int
+smb2_fsync_send(struct smb2_context *smb2, struct smb2fh *fh)
 {
         struct smb2_flush_request req;
         struct smb2_pdu *pdu;
 
-        fh->cb = cb;
-        fh->cb_data = cb_data;
-
         memset(&req, 0, sizeof(struct smb2_flush_request));
         memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
 
@@ -1081,6 +1759,32 @@ smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }
 
+static void
+fsync_drained(struct smb2_context *smb2, struct smb2fh *fh, int status)
+{
+        if (status) {
+                fh->cb(smb2, status, NULL, fh->cb_data);
+                return;
+        }
+        if (smb2_fsync_send(smb2, fh) < 0) {
+                fh->cb(smb2, -ENOMEM, NULL, fh->cb_data);
+        }
+}
+
+int
+smb2_fsync_async(struct smb2_context *smb2, struct smb2fh *fh,
+                 smb2_command_cb cb, void *cb_data)
+{
+        fh->cb = cb;
+        fh->cb_data = cb_data;
+
+        if (fh->wb_max_inflight) {
+                return smb2_wb_drain(smb2, fh, fsync_drained);
+        }
+
+        return smb2_fsync_send(smb2, fh);
+}
+
 struct rw_data {
         smb2_command_cb cb;
         void *cb_data;
@@ -1112,15 +1816,16 @@ read_cb(struct smb2_context *smb2, int status,
         free(rd);
 }
 
-int
-smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
-                 uint8_t *buf, uint32_t count, uint64_t offset,
-                 smb2_command_cb cb, void *cb_data)
+static int
+smb2_pread_send(struct smb2_context *smb2, struct smb2fh *fh,
+                uint8_t *buf, uint32_t count, uint64_t offset,
+                smb2_command_cb cb, void *cb_data)
 {
         struct smb2_read_request req;
         struct rw_data *rd;
         struct smb2_pdu *pdu;
         int needed_credits = (count - 1) / 65536 + 1;
+        int window;
 
         if (count > smb2->max_read_size) {
                 count = smb2->max_read_size;
@@ -1129,9 +1834,17 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
                 if (needed_credits > MAX_CREDITS - 16) {
                         count =  (MAX_CREDITS - 16) * 65536;
                 }
+                /* Do not ask for more than the credits we hold, counting
+                 * those that come back with replies. The request waits in
+                 * the outqueue until enough of them are available.
+                 */
+                window = smb2->credits + smb2->credits_outstanding;
+                if (window < 1) {
+                        window = 1;
+                }
                 needed_credits = (count - 1) / 65536 + 1;
-                if (needed_credits > smb2->credits) {
-                        count = smb2->credits * 65536;
+                if (needed_credits > window) {
+                        count = window * 65536;
                 }
         } else {
                 if (count > 65536) {
@@ -1172,6 +1885,20 @@ smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
         return 0;
 }        
 
+int
+smb2_pread_async(struct smb2_context *smb2, struct smb2fh *fh,
+                 uint8_t *buf, uint32_t count, uint64_t offset,
+                 smb2_command_cb cb, void *cb_data)
+{
+        /* Wait for the writes before the read to complete */
+        if (fh->wb_max_inflight) {
+                return smb2_wb_defer(smb2, fh, SMB2_WB_OP_READ, buf, count,
+                                     offset, cb, cb_data);
+        }
+
+        return smb2_pread_send(smb2, fh, buf, count, offset, cb, cb_data);
+}
+
 int
 smb2_read_async(struct smb2_context *smb2, struct smb2fh *fh,
                 uint8_t *buf, uint32_t count,
@@ -1181,6 +1908,214 @@ smb2_read_async(struct smb2_context *smb2, struct smb2fh *fh,
                                 cb, cb_data);
 }
 
+/* Upper bound on the number of READs a parallel read keeps in flight */
+#define SMB2_PARALLEL_MAX_DEPTH 64
+
+struct parallel_read_data {
+        smb2_command_cb cb;
+        void *cb_data;
+
+        struct smb2fh *fh;
+        uint8_t *buf;
+        uint64_t offset;
+        uint32_t count;
+
+        /* Bytes handed out to READs so far */
+        uint32_t issued;
+        /* Number of READs in flight */
+        int inflight;
+        uint32_t chunk_size;
+
+        /* Where the file ended, relative to offset. count until then. */
+        uint32_t eof;
+        int status;
+};
+
+struct parallel_read_chunk {
+        struct parallel_read_data *prd;
+        uint32_t start;
+        uint32_t length;
+};
+
+static int smb2_pread_parallel_issue(struct smb2_context *smb2,
+                                     struct parallel_read_data *prd);
+
+static void
+pread_parallel_cb(struct smb2_context *smb2, int status,
+                  void *command_data, void *private_data)
+{
+        struct parallel_read_chunk *chunk = private_data;
+        struct parallel_read_data *prd = chunk->prd;
+        struct smb2_read_reply *rep = command_data;
+        uint32_t len = 0;
+
+        prd->inflight--;
+
+        if (status == SMB2_STATUS_SUCCESS) {
+                len = rep->data_length;
+        } else if (status != SMB2_STATUS_END_OF_FILE) {
+                smb2_set_error(smb2, "Read failed with (0x%08x) %s",
+                               status, nterror_to_str(status));
+                if (prd->status == 0) {
+                        prd->status = -nterror_to_errno(status);
+                }
+        }
+
+        /* A short read means we hit the end of the file */
+        if (len < chunk->length && chunk->start + len < prd->eof) {
+                prd->eof = chunk->start + len;
+        }
+        free(chunk);
+
+        if (prd->status == 0 && smb2_pread_parallel_issue(smb2, prd) < 0) {
+                prd->status = -ENOMEM;
+        }
+        if (prd->inflight) {
+                return;
+        }
+
+        prd->cb(smb2, prd->status ? prd->status : (int)prd->eof, NULL,
+                prd->cb_data);
+        free(prd);
+}
+
+/* Keep as many READs in flight as the credit window allows */
+static int
+smb2_pread_parallel_issue(struct smb2_context *smb2,
+                          struct parallel_read_data *prd)
+{
+        struct parallel_read_chunk *chunk;
+        struct smb2_read_request req;
+        struct smb2_pdu *pdu;
+        uint32_t len;
+        int credits, window;
+
+        while (prd->issued < prd->eof &&
+               prd->inflight < SMB2_PARALLEL_MAX_DEPTH) {
+                len = prd->eof - prd->issued;
+                if (len > prd->chunk_size) {
+                        len = prd->chunk_size;
+                }
+                credits = smb2->supports_multi_credit ?
+                        (len - 1) / 65536 + 1 : 1;
+
+                /* Stay within the credits that are not already spoken
+                 * for by PDUs waiting to be sent. Always keep one READ
+                 * going so that we make progress.
+                 */
+                if (smb2->dialect > SMB2_VERSION_0202 && prd->inflight) {
+                        window = smb2->credits - smb2->credits_queued;
+                        if (credits > window) {
+                                break;
+                        }
+                }
+
+                chunk = malloc(sizeof(struct parallel_read_chunk));
+                if (chunk == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "parallel_read_chunk");
+                        return -1;
+                }
+                chunk->prd = prd;
+                chunk->start = prd->issued;
+                chunk->length = len;
+
+                memset(&req, 0, sizeof(struct smb2_read_request));
+                req.flags = 0;
+                req.length = len;
+                req.offset = prd->offset + prd->issued;
+                req.buf = prd->buf + prd->issued;
+                memcpy(req.file_id, prd->fh->file_id, SMB2_FD_SIZE);
+                req.minimum_count = 0;
+                req.channel = SMB2_CHANNEL_NONE;
+                req.remaining_bytes = 0;
+
+                pdu = smb2_cmd_read_async(smb2, &req, pread_parallel_cb,
+                                          chunk);
+                if (pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to create read "
+                                       "command");
+                        free(chunk);
+                        return -1;
+                }
+                smb2_queue_pdu(smb2, pdu);
+
+                prd->issued += len;
+                prd->inflight++;
+        }
+
+        return 0;
+}
+
+static int
+smb2_pread_parallel_send(struct smb2_context *smb2, struct smb2fh *fh,
+                         uint8_t *buf, uint32_t count, uint64_t offset,
+                         smb2_command_cb cb, void *cb_data)
+{
+        struct parallel_read_data *prd;
+
+        prd = malloc(sizeof(struct parallel_read_data));
+        if (prd == NULL) {
+                smb2_set_error(smb2, "Failed to allocate parallel_read_data");
+                return -ENOMEM;
+        }
+        memset(prd, 0, sizeof(struct parallel_read_data));
+
+        prd->cb = cb;
+        prd->cb_data = cb_data;
+        prd->fh = fh;
+        prd->buf = buf;
+        prd->offset = offset;
+        prd->count = count;
+        prd->eof = count;
+
+        /* smb2_cmd_read_async() limits single credit READs to 60kb */
+        prd->chunk_size = smb2->max_read_size;
+        if (!smb2->supports_multi_credit && prd->chunk_size > 60 * 1024) {
+                prd->chunk_size = 60 * 1024;
+        }
+        if (prd->chunk_size == 0) {
+                prd->chunk_size = 60 * 1024;
+        }
+
+        if (count == 0) {
+                free(prd);
+                cb(smb2, 0, NULL, cb_data);
+                return 0;
+        }
+
+        if (smb2_pread_parallel_issue(smb2, prd) < 0 || prd->inflight == 0) {
+                /* Nothing was queued so nobody will invoke the callback */
+                if (prd->inflight == 0) {
+                        free(prd);
+                        return -ENOMEM;
+                }
+                prd->status = -ENOMEM;
+        }
+
+        return 0;
+}
+
+int
+smb2_pread_parallel_async(struct smb2_context *smb2, struct smb2fh *fh,
+                          uint8_t *buf, uint32_t count, uint64_t offset,
+                          smb2_command_cb cb, void *cb_data)
+{
+        if (count > INT32_MAX) {
+                smb2_set_error(smb2, "Parallel read of %u bytes is too "
+                               "large", count);
+                return -EINVAL;
+        }
+
+        if (fh->wb_max_inflight) {
+                return smb2_wb_defer(smb2, fh, SMB2_WB_OP_READ_PARALLEL,
+                                     buf, count, offset, cb, cb_data);
+        }
+
+        return smb2_pread_parallel_send(smb2, fh, buf, count, offset,
+                                        cb, cb_data);
+}
+
 static void
 write_cb(struct smb2_context *smb2, int status,
       void *command_data, void *private_data)
@@ -1204,6 +2139,405 @@ write_cb(struct smb2_context *smb2, int status,
         free(rd);
 }
 
+static void wb_write_cb(struct smb2_context *smb2, int status,
+                        void *command_data, void *private_data);
+
+/* Send pending buffers while there is room in the pipeline */
+static int
+smb2_wb_send(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_write_request req;
+        struct smb2_wb_write *w;
+        struct smb2_pdu *pdu;
+
+        while ((w = fh->wb_pending) != NULL &&
+               fh->wb_inflight < fh->wb_max_inflight) {
+                memset(&req, 0, sizeof(struct smb2_write_request));
+                req.length = w->len;
+                req.offset = w->offset;
+                req.buf = w->buf;
+                memcpy(req.file_id, fh->file_id, SMB2_FD_SIZE);
+                req.channel = SMB2_CHANNEL_NONE;
+                req.remaining_bytes = 0;
+                req.flags = 0;
+
+                pdu = smb2_cmd_write_async(smb2, &req, wb_write_cb, w);
+                if (pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to create write "
+                                       "command");
+                        return -ENOMEM;
+                }
+                smb2_queue_pdu(smb2, pdu);
+
+                fh->wb_pending = w->next;
+                fh->wb_inflight++;
+        }
+
+        return 0;
+}
+
+/* Move the data collected in wb_buf to the pending list and send it if
+ * there is room.
+ */
+static int
+smb2_wb_flush(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_wb_write *w;
+
+        if (fh->wb_len == 0) {
+                return smb2_wb_send(smb2, fh);
+        }
+
+        w = malloc(sizeof(struct smb2_wb_write));
+        if (w == NULL) {
+                smb2_set_error(smb2, "Failed to allocate wb_write");
+                return -ENOMEM;
+        }
+        w->next = NULL;
+        w->fh = fh;
+        w->buf = fh->wb_buf;
+        w->len = fh->wb_len;
+        w->offset = fh->wb_offset;
+        SMB2_LIST_ADD_END(&fh->wb_pending, w);
+
+        fh->wb_buf = NULL;
+        fh->wb_len = 0;
+
+        return smb2_wb_send(smb2, fh);
+}
+
+static int smb2_wb_pwrite_now(struct smb2_context *smb2, struct smb2fh *fh,
+                              uint8_t *buf, uint32_t count, uint64_t offset,
+                              smb2_command_cb cb, void *cb_data);
+
+/* Nothing is buffered, waiting to be sent or in flight */
+static int
+smb2_wb_idle(struct smb2fh *fh)
+{
+        return fh->wb_len == 0 && fh->wb_pending == NULL &&
+                fh->wb_inflight == 0;
+}
+
+/* Issue the deferred operations that are no longer behind any write.
+ * A read has to wait until the pipeline is empty, a write only for the
+ * reads before it.
+ */
+static void
+smb2_wb_run_ops(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_wb_op *op;
+        int ret;
+
+        while ((op = fh->wb_ops) != NULL) {
+                if (op->type != SMB2_WB_OP_WRITE && !smb2_wb_idle(fh)) {
+                        return;
+                }
+                fh->wb_ops = op->next;
+
+                switch (op->type) {
+                case SMB2_WB_OP_READ:
+                        ret = smb2_pread_send(smb2, fh, op->buf, op->count,
+                                              op->offset, op->cb,
+                                              op->cb_data);
+                        break;
+                case SMB2_WB_OP_READ_PARALLEL:
+                        ret = smb2_pread_parallel_send(smb2, fh, op->buf,
+                                                       op->count, op->offset,
+                                                       op->cb, op->cb_data);
+                        break;
+                default:
+                        ret = smb2_wb_pwrite_now(smb2, fh, op->buf,
+                                                 op->count, op->offset,
+                                                 op->cb, op->cb_data);
+                        break;
+                }
+                if (ret < 0) {
+                        op->cb(smb2, ret, NULL, op->cb_data);
+                }
+                free(op);
+        }
+}
+
+/* Queue a read, or a write issued after a deferred read, and issue it
+ * right away if nothing is in its way.
+ */
+static int
+smb2_wb_defer(struct smb2_context *smb2, struct smb2fh *fh,
+              int type, uint8_t *buf, uint32_t count, uint64_t offset,
+              smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_wb_op *op;
+
+        if (fh->wb_ops == NULL && smb2_wb_idle(fh)) {
+                if (type == SMB2_WB_OP_READ) {
+                        return smb2_pread_send(smb2, fh, buf, count, offset,
+                                               cb, cb_data);
+                }
+                if (type == SMB2_WB_OP_READ_PARALLEL) {
+                        return smb2_pread_parallel_send(smb2, fh, buf, count,
+                                                        offset, cb, cb_data);
+                }
+        }
+
+        /* Buffered data is part of what the read has to wait for */
+        if (smb2_wb_flush(smb2, fh) < 0) {
+                return -ENOMEM;
+        }
+
+        op = malloc(sizeof(struct smb2_wb_op));
+        if (op == NULL) {
+                smb2_set_error(smb2, "Failed to allocate wb_op");
+                return -ENOMEM;
+        }
+        op->next = NULL;
+        op->type = type;
+        op->buf = buf;
+        op->count = count;
+        op->offset = offset;
+        op->cb = cb;
+        op->cb_data = cb_data;
+        SMB2_LIST_ADD_END(&fh->wb_ops, op);
+
+        /* The flush may have been all that was in the way */
+        smb2_wb_run_ops(smb2, fh);
+
+        return 0;
+}
+
+/* Release held back writes and deferred operations and report to
+ * fsync/close once everything is written.
+ */
+static void
+smb2_wb_wakeup(struct smb2_context *smb2, struct smb2fh *fh)
+{
+        struct smb2_wb_waiter *waiter;
+        void (*drained)(struct smb2_context *smb2, struct smb2fh *fh,
+                        int status);
+        int status;
+
+        while (fh->wb_pending == NULL &&
+               (waiter = fh->wb_waiters) != NULL) {
+                fh->wb_waiters = waiter->next;
+                waiter->cb(smb2, waiter->status, NULL, waiter->cb_data);
+                free(waiter);
+        }
+
+        smb2_wb_run_ops(smb2, fh);
+
+        if (fh->wb_drained && fh->wb_ops == NULL && smb2_wb_idle(fh)) {
+                drained = fh->wb_drained;
+                status = fh->wb_error;
+                fh->wb_drained = NULL;
+                fh->wb_error = 0;
+                drained(smb2, fh, status);
+        }
+}
+
+static void
+wb_write_cb(struct smb2_context *smb2, int status,
+            void *command_data, void *private_data)
+{
+        struct smb2_wb_write *w = private_data;
+        struct smb2fh *fh = w->fh;
+        struct smb2_write_reply *rep = command_data;
+
+        /* The handle may already be gone when the context is destroyed */
+        if (status == SMB2_STATUS_CANCELLED) {
+                free(w->buf);
+                free(w);
+                return;
+        }
+
+        fh->wb_inflight--;
+        if (status != SMB2_STATUS_SUCCESS) {
+                smb2_set_error(smb2, "Write failed with (0x%08x) %s",
+                               status, nterror_to_str(status));
+                if (fh->wb_error == 0) {
+                        fh->wb_error = -nterror_to_errno(status);
+                }
+        } else if (rep->count != w->len) {
+                smb2_set_error(smb2, "Short write. Wrote %u of %u bytes",
+                               rep->count, w->len);
+                if (fh->wb_error == 0) {
+                        fh->wb_error = -EIO;
+                }
+        }
+        free(w->buf);
+        free(w);
+
+        /* Whatever is collected in wb_buf goes out now that there is room */
+        if (smb2_wb_flush(smb2, fh) < 0 && fh->wb_error == 0) {
+                fh->wb_error = -ENOMEM;
+        }
+        smb2_wb_wakeup(smb2, fh);
+}
+
+/* Send everything and call drained once it is all written */
+static int
+smb2_wb_drain(struct smb2_context *smb2, struct smb2fh *fh,
+              void (*drained)(struct smb2_context *smb2,
+                              struct smb2fh *fh, int status))
+{
+        int ret;
+
+        ret = smb2_wb_flush(smb2, fh);
+        if (ret < 0) {
+                return ret;
+        }
+
+        fh->wb_drained = drained;
+        smb2_wb_wakeup(smb2, fh);
+
+        return 0;
+}
+
+static int
+smb2_wb_pwrite_now(struct smb2_context *smb2, struct smb2fh *fh,
+                   uint8_t *buf, uint32_t count, uint64_t offset,
+                   smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_wb_waiter *waiter;
+        uint32_t done = 0, num;
+        int ret;
+
+        /* Report errors from earlier writes */
+        if (fh->wb_error) {
+                ret = fh->wb_error;
+                fh->wb_error = 0;
+                cb(smb2, ret, NULL, cb_data);
+                return 0;
+        }
+
+        if (fh->wb_len && offset != fh->wb_offset + fh->wb_len) {
+                ret = smb2_wb_flush(smb2, fh);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        while (done < count) {
+                if (fh->wb_buf == NULL) {
+                        fh->wb_buf = malloc(fh->wb_size);
+                        if (fh->wb_buf == NULL) {
+                                smb2_set_error(smb2, "Failed to allocate "
+                                               "write-behind buffer");
+                                return -ENOMEM;
+                        }
+                        fh->wb_offset = offset + done;
+                }
+                num = count - done;
+                if (num > fh->wb_size - fh->wb_len) {
+                        num = fh->wb_size - fh->wb_len;
+                }
+                memcpy(fh->wb_buf + fh->wb_len, buf + done, num);
+                fh->wb_len += num;
+                done += num;
+
+                if (fh->wb_len == fh->wb_size) {
+                        ret = smb2_wb_flush(smb2, fh);
+                        if (ret < 0) {
+                                return ret;
+                        }
+                }
+        }
+        fh->offset = offset + count;
+
+        /* Only keep collecting while the pipeline is busy */
+        if (fh->wb_inflight < fh->wb_max_inflight &&
+            fh->wb_pending == NULL) {
+                ret = smb2_wb_flush(smb2, fh);
+                if (ret < 0) {
+                        return ret;
+                }
+        }
+
+        /* Hold the callback back while we have more data than fits in
+         * the pipeline.
+         */
+        if (fh->wb_pending) {
+                waiter = malloc(sizeof(struct smb2_wb_waiter));
+                if (waiter == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "wb_waiter");
+                        return -ENOMEM;
+                }
+                waiter->next = NULL;
+                waiter->cb = cb;
+                waiter->cb_data = cb_data;
+                waiter->status = count;
+                SMB2_LIST_ADD_END(&fh->wb_waiters, waiter);
+                return 0;
+        }
+
+        cb(smb2, count, NULL, cb_data);
+        return 0;
+}
+
+static int
+smb2_wb_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
+               uint8_t *buf, uint32_t count, uint64_t offset,
+               smb2_command_cb cb, void *cb_data)
+{
+        /* Writes issued after a deferred read stay behind it */
+        if (fh->wb_ops) {
+                return smb2_wb_defer(smb2, fh, SMB2_WB_OP_WRITE, buf, count,
+                                     offset, cb, cb_data);
+        }
+
+        return smb2_wb_pwrite_now(smb2, fh, buf, count, offset, cb, cb_data);
+}
+
+int
+smb2_set_write_behind(struct smb2_context *smb2, struct smb2fh *fh,
+                      int max_inflight)
+{
+        if (max_inflight < 0) {
+                smb2_set_error(smb2, "Invalid write-behind depth %d",
+                               max_inflight);
+                return -EINVAL;
+        }
+        /* The write-behind state of a handle is only ever touched by the
+         * thread driving the context, and callbacks of writes can be
+         * invoked before smb2_pwrite_async() returns.
+         */
+        if (max_inflight && smb2->thread) {
+                smb2_set_error(smb2, "Write-behind can not be used in "
+                               "thread-safe mode");
+                return -EINVAL;
+        }
+
+        if (max_inflight == 0) {
+                /* Everything that was written has to be acknowledged
+                 * first, smb2_fsync() waits for that.
+                 */
+                if (fh->wb_ops || !smb2_wb_idle(fh)) {
+                        smb2_set_error(smb2, "Write-behind data has not "
+                                       "been written yet");
+                        return -EBUSY;
+                }
+                free(fh->wb_buf);
+                fh->wb_buf = NULL;
+                fh->wb_max_inflight = 0;
+                return 0;
+        }
+
+        /* smb2_cmd_write_async() limits single credit WRITEs to 60kb */
+        fh->wb_size = smb2->max_write_size;
+        if (!smb2->supports_multi_credit && fh->wb_size > 60 * 1024) {
+                fh->wb_size = 60 * 1024;
+        }
+        if (fh->wb_size == 0) {
+                fh->wb_size = 60 * 1024;
+        }
+        if (fh->wb_buf && fh->wb_len == 0) {
+                free(fh->wb_buf);
+                fh->wb_buf = NULL;
+        }
+        fh->wb_max_inflight = max_inflight;
+
+        return 0;
+}
+
 int
 smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
                   uint8_t *buf, uint32_t count, uint64_t offset,
@@ -1213,6 +2547,12 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
         struct rw_data *rd;
         struct smb2_pdu *pdu;
         int needed_credits = (count - 1) / 65536 + 1;
+        int window;
+
+        if (fh->wb_max_inflight) {
+                return smb2_wb_pwrite(smb2, fh, buf, count, offset,
+                                      cb, cb_data);
+        }
 
         if (count > smb2->max_write_size) {
                 count = smb2->max_write_size;
@@ -1221,9 +2561,17 @@ smb2_pwrite_async(struct smb2_context *smb2, struct smb2fh *fh,
                 if (needed_credits > MAX_CREDITS - 16) {
                         count =  (MAX_CREDITS - 16) * 65536;
                 }
+                /* Do not ask for more than the credits we hold, counting
+                 * those that come back with replies. The request waits in
+                 * the outqueue until enough of them are available.
+                 */
+                window = smb2->credits + smb2->credits_outstanding;
+                if (window < 1) {
+                        window = 1;
+                }
                 needed_credits = (count - 1) / 65536 + 1;
-                if (needed_credits > smb2->credits) {
-                        count = smb2->credits * 65536;
+                if (needed_credits > window) {
+                        count = window * 65536;
                 }
         } else {
                 if (count > 65536) {
@@ -2040,6 +3388,7 @@ disconnect_cb_2(struct smb2_context *smb2, int status,
 
         dc_data->cb(smb2, 0, NULL, dc_data->cb_data);
         free(dc_data);
+        smb2_io_uring_stop(smb2);
         close(smb2->fd);
         smb2->fd = -1;
 }
@@ -2159,7 +3508,9 @@ smb2_fh_from_file_id(struct smb2_context *smb2, smb2_file_id *fileid)
         }
         memset(fh, 0, sizeof(struct smb2fh));
         memcpy(fh->file_id, fileid, SMB2_FD_SIZE);
+        smb2_lock(smb2);
         SMB2_LIST_ADD(&smb2->fhs, fh);
+        smb2_unlock(smb2);
 
         return fh;
 }
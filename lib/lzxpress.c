@@ -0,0 +1,965 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Plain LZ77 and LZ77+Huffman from [MS-XCA].
+ *
+ * Both compressors share a greedy hash chain match finder. Candidate
+ * matches are compared 16 bytes at a time with SSE2 where available, or
+ * 8 bytes at a time on other little endian machines, which is where most
+ * of the time goes on data that compresses well.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include "lzxpress.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define LZX_USE_SSE2 1
+#include <emmintrin.h>
+#elif defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LZX_USE_SWAR 1
+#endif
+
+#define LZX_MIN_MATCH  3
+#define LZX_HASH_BITS  15
+#define LZX_HASH_SIZE  (1 << LZX_HASH_BITS)
+/* Candidates tried per position */
+#define LZX_MAX_CHAIN  16
+/* Positions inside a long match are only partly added to the chains */
+#define LZX_MAX_INSERT 64
+
+/* Plain LZ77 offsets are 13 bits, LZ77+Huffman offsets 16 bits */
+#define LZX_PLAIN_WINDOW   8192
+#define LZX_HUFFMAN_WINDOW 65536
+
+#define LZX_HUFFMAN_BLOCK    65536
+#define LZX_HUFFMAN_SYMBOLS  512
+#define LZX_HUFFMAN_EOF      256
+#define LZX_HUFFMAN_MAX_BITS 15
+#define LZX_HUFFMAN_TABLE    (LZX_HUFFMAN_SYMBOLS / 2)
+/* Longest match whose length fits the 16 bit escape */
+#define LZX_HUFFMAN_MAX_MATCH (65535 + LZX_MIN_MATCH)
+
+#define LZX_GET16(p) ((uint32_t)(p)[0] | ((uint32_t)(p)[1] << 8))
+#define LZX_GET32(p) (LZX_GET16(p) | (LZX_GET16((p) + 2) << 16))
+
+static void
+lzx_put16(uint8_t *p, uint32_t v)
+{
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+}
+
+static void
+lzx_put32(uint8_t *p, uint32_t v)
+{
+        lzx_put16(p, v);
+        lzx_put16(p + 2, v >> 16);
+}
+
+/* Length of the common prefix of a and b, not going past end */
+static size_t
+lzx_match_len(const uint8_t *a, const uint8_t *b, const uint8_t *end)
+{
+        const uint8_t *start = a;
+
+#if defined(LZX_USE_SSE2)
+        while (end - a >= 16) {
+                __m128i x = _mm_loadu_si128((const __m128i *)a);
+                __m128i y = _mm_loadu_si128((const __m128i *)b);
+                unsigned int diff;
+
+                diff = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xffff;
+                if (diff) {
+                        return a - start + __builtin_ctz(diff);
+                }
+                a += 16;
+                b += 16;
+        }
+#elif defined(LZX_USE_SWAR)
+        while (end - a >= 8) {
+                uint64_t x, y;
+
+                memcpy(&x, a, 8);
+                memcpy(&y, b, 8);
+                if (x != y) {
+                        return a - start + (__builtin_ctzll(x ^ y) >> 3);
+                }
+                a += 8;
+                b += 8;
+        }
+#endif
+        while (a < end && *a == *b) {
+                a++;
+                b++;
+        }
+        return a - start;
+}
+
+size_t
+lzxpress_run_length(const uint8_t *in, const uint8_t *end)
+{
+        if (in >= end) {
+                return 0;
+        }
+        /* Comparing the data with itself shifted by one finds the run */
+        return 1 + lzx_match_len(in + 1, in, end);
+}
+
+/*
+ * Hash chain match finder. head holds the last position for each hash of
+ * three bytes and prev, a ring over the window, the previous position
+ * with the same hash.
+ */
+struct lzx_matcher {
+        int32_t head[LZX_HASH_SIZE];
+        int32_t *prev;
+        size_t window;
+        size_t max_offset;
+};
+
+static struct lzx_matcher *
+lzx_matcher_new(size_t window, size_t max_offset)
+{
+        struct lzx_matcher *m;
+
+        m = malloc(sizeof(*m));
+        if (m == NULL) {
+                return NULL;
+        }
+        m->prev = malloc(window * sizeof(int32_t));
+        if (m->prev == NULL) {
+                free(m);
+                return NULL;
+        }
+        memset(m->head, 0xff, sizeof(m->head));
+        m->window = window;
+        m->max_offset = max_offset;
+
+        return m;
+}
+
+static void
+lzx_matcher_free(struct lzx_matcher *m)
+{
+        if (m == NULL) {
+                return;
+        }
+        free(m->prev);
+        free(m);
+}
+
+static uint32_t
+lzx_hash(const uint8_t *p)
+{
+        uint32_t v = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+
+        return (v * 2654435761u) >> (32 - LZX_HASH_BITS);
+}
+
+static void
+lzx_insert(struct lzx_matcher *m, const uint8_t *in, size_t pos)
+{
+        uint32_t h = lzx_hash(&in[pos]);
+
+        m->prev[pos & (m->window - 1)] = m->head[h];
+        m->head[h] = (int32_t)pos;
+}
+
+/* Add the positions covered by a match of len bytes at pos */
+static void
+lzx_skip(struct lzx_matcher *m, const uint8_t *in, size_t in_len,
+         size_t pos, size_t len)
+{
+        size_t i, end = pos + len;
+
+        if (in_len < LZX_MIN_MATCH) {
+                return;
+        }
+        if (end > in_len - LZX_MIN_MATCH + 1) {
+                end = in_len - LZX_MIN_MATCH + 1;
+        }
+        for (i = pos + 1; i < end; i++) {
+                if (i == pos + LZX_MAX_INSERT && end - i > LZX_MAX_INSERT) {
+                        i = end - LZX_MAX_INSERT;
+                }
+                lzx_insert(m, in, i);
+        }
+}
+
+/* Find the longest match for pos, of at most max_len bytes, and add pos
+ * to the chains. Returns 0 if there is no match of at least LZX_MIN_MATCH.
+ */
+static size_t
+lzx_find_match(struct lzx_matcher *m, const uint8_t *in, size_t pos,
+               size_t max_len, size_t *offset)
+{
+        int32_t cand;
+        size_t best = 0, len;
+        int chain = LZX_MAX_CHAIN;
+        uint32_t h;
+
+        if (max_len < LZX_MIN_MATCH) {
+                return 0;
+        }
+
+        h = lzx_hash(&in[pos]);
+        cand = m->head[h];
+        m->prev[pos & (m->window - 1)] = cand;
+        m->head[h] = (int32_t)pos;
+
+        while (cand >= 0 && pos - (size_t)cand <= m->max_offset && chain--) {
+                if (in[cand + best] == in[pos + best]) {
+                        len = lzx_match_len(&in[pos], &in[cand],
+                                            &in[pos + max_len]);
+                        if (len > best) {
+                                best = len;
+                                *offset = pos - cand;
+                                if (best == max_len) {
+                                        break;
+                                }
+                        }
+                }
+                cand = m->prev[cand & (m->window - 1)];
+        }
+
+        return best >= LZX_MIN_MATCH ? best : 0;
+}
+
+/* Copy a match. The source may overlap the destination, in which case it
+ * repeats with a period of offset bytes and is copied in doubling chunks.
+ */
+static void
+lzx_copy(uint8_t *dst, size_t offset, size_t len)
+{
+        const uint8_t *src = dst - offset;
+        size_t n;
+
+        while (len) {
+                n = dst - src;
+                if (n > len) {
+                        n = len;
+                }
+                memcpy(dst, src, n);
+                dst += n;
+                len -= n;
+        }
+}
+
+int
+lzxpress_compress(const uint8_t *in, size_t in_len,
+                  uint8_t *out, size_t out_len)
+{
+        struct lzx_matcher *m;
+        size_t ip = 0, op = 4, flag_pos = 0, half_byte = 0;
+        size_t len, l, offset = 0;
+        uint32_t flags = 0, token;
+        int flag_count = 0;
+
+        if (out_len < 4) {
+                return -1;
+        }
+        m = lzx_matcher_new(2 * LZX_PLAIN_WINDOW, LZX_PLAIN_WINDOW);
+        if (m == NULL) {
+                return -1;
+        }
+
+        while (ip < in_len) {
+                len = lzx_find_match(m, in, ip, in_len - ip, &offset);
+                if (len) {
+                        /* Token, nibble, byte, 16 and 32 bit lengths */
+                        if (out_len - op < 10) {
+                                goto overflow;
+                        }
+                        l = len - LZX_MIN_MATCH;
+                        token = (uint32_t)(offset - 1) << 3;
+                        if (l < 7) {
+                                lzx_put16(&out[op], token | l);
+                                op += 2;
+                        } else {
+                                lzx_put16(&out[op], token | 7);
+                                op += 2;
+                                l -= 7;
+                                /* Two lengths share a byte of nibbles */
+                                if (half_byte == 0) {
+                                        half_byte = op;
+                                        out[op++] = l < 15 ? l : 15;
+                                } else {
+                                        out[half_byte] |= (l < 15 ? l : 15) << 4;
+                                        half_byte = 0;
+                                }
+                                if (l >= 15) {
+                                        l -= 15;
+                                        if (l < 255) {
+                                                out[op++] = l;
+                                        } else {
+                                                out[op++] = 255;
+                                                l += 15 + 7;
+                                                if (l < 65536) {
+                                                        lzx_put16(&out[op], l);
+                                                        op += 2;
+                                                } else {
+                                                        lzx_put16(&out[op], 0);
+                                                        lzx_put32(&out[op + 2],
+                                                                  l);
+                                                        op += 6;
+                                                }
+                                        }
+                                }
+                        }
+                        lzx_skip(m, in, in_len, ip, len);
+                        ip += len;
+                        flags = (flags << 1) | 1;
+                } else {
+                        if (op == out_len) {
+                                goto overflow;
+                        }
+                        out[op++] = in[ip++];
+                        flags <<= 1;
+                }
+
+                if (++flag_count == 32) {
+                        lzx_put32(&out[flag_pos], flags);
+                        flags = 0;
+                        flag_count = 0;
+                        if (out_len - op < 4) {
+                                goto overflow;
+                        }
+                        flag_pos = op;
+                        op += 4;
+                }
+        }
+
+        /* The unused flags are set so the decoder finds a match token
+         * at the end of the input, which marks the end.
+         */
+        if (flag_count == 0) {
+                flags = 0xffffffff;
+        } else {
+                flags = (flags << (32 - flag_count)) |
+                        ((1u << (32 - flag_count)) - 1);
+        }
+        lzx_put32(&out[flag_pos], flags);
+
+        lzx_matcher_free(m);
+        return (int)op;
+
+ overflow:
+        lzx_matcher_free(m);
+        return -1;
+}
+
+int
+lzxpress_decompress(const uint8_t *in, size_t in_len,
+                    uint8_t *out, size_t out_len)
+{
+        size_t ip = 0, op = 0, half_byte = 0, len, offset;
+        uint32_t flags = 0, token;
+        int flag_count = 0;
+
+        for (;;) {
+                if (flag_count == 0) {
+                        if (in_len - ip < 4) {
+                                break;
+                        }
+                        flags = LZX_GET32(&in[ip]);
+                        ip += 4;
+                        flag_count = 32;
+                }
+                flag_count--;
+
+                if (!(flags & (1u << flag_count))) {
+                        if (ip == in_len) {
+                                break;
+                        }
+                        if (op == out_len) {
+                                return -1;
+                        }
+                        out[op++] = in[ip++];
+                        continue;
+                }
+
+                if (ip == in_len) {
+                        break;
+                }
+                if (in_len - ip < 2) {
+                        return -1;
+                }
+                token = LZX_GET16(&in[ip]);
+                ip += 2;
+                len = token & 7;
+                offset = (token >> 3) + 1;
+                if (len == 7) {
+                        if (half_byte == 0) {
+                                if (ip == in_len) {
+                                        return -1;
+                                }
+                                half_byte = ip;
+                                len = in[ip++] & 0x0f;
+                        } else {
+                                len = in[half_byte] >> 4;
+                                half_byte = 0;
+                        }
+                        if (len == 15) {
+                                if (ip == in_len) {
+                                        return -1;
+                                }
+                                len = in[ip++];
+                                if (len == 255) {
+                                        if (in_len - ip < 2) {
+                                                return -1;
+                                        }
+                                        len = LZX_GET16(&in[ip]);
+                                        ip += 2;
+                                        if (len == 0) {
+                                                if (in_len - ip < 4) {
+                                                        return -1;
+                                                }
+                                                len = LZX_GET32(&in[ip]);
+                                                ip += 4;
+                                        }
+                                        if (len < 15 + 7) {
+                                                return -1;
+                                        }
+                                        len -= 15 + 7;
+                                }
+                                len += 15;
+                        }
+                        len += 7;
+                }
+                len += LZX_MIN_MATCH;
+
+                if (offset > op || len > out_len - op) {
+                        return -1;
+                }
+                lzx_copy(&out[op], offset, len);
+                op += len;
+        }
+
+        return (int)op;
+}
+
+/*
+ * LZ77+Huffman
+ *
+ * The data is coded in blocks of 64k output bytes. Each block starts with
+ * the 4 bit code lengths of its 512 symbols followed by a bitstream read
+ * 16 bits at a time. Extra bytes of long match lengths are not part of
+ * the bitstream but sit in the byte stream at the point where the decoder,
+ * which is always 16 to 32 bits ahead, has to read them. The encoder
+ * therefore reserves the place of the next 16 bit words before writing
+ * such bytes and fills them in later.
+ */
+struct lzx_token {
+        uint16_t symbol;
+        /* 0 for literals and the end of data */
+        uint16_t offset;
+        /* Match length minus LZX_MIN_MATCH */
+        uint32_t length;
+};
+
+struct lzx_bitwriter {
+        uint8_t *out;
+        size_t out_len;
+        /* Where the next reserved word or extra byte goes */
+        size_t pos;
+        /* The reserved words, the one being filled first */
+        size_t slot[2];
+        int nslots;
+        uint32_t bits;
+        int nbits;
+        int overflow;
+};
+
+static void
+lzx_reserve(struct lzx_bitwriter *bw)
+{
+        if (bw->out_len - bw->pos < 2) {
+                bw->overflow = 1;
+                return;
+        }
+        bw->slot[bw->nslots++] = bw->pos;
+        bw->pos += 2;
+}
+
+static void
+lzx_put_bits(struct lzx_bitwriter *bw, uint32_t value, int n)
+{
+        bw->bits = (bw->bits << n) | value;
+        bw->nbits += n;
+        if (bw->nbits < 16) {
+                return;
+        }
+
+        bw->nbits -= 16;
+        if (bw->nslots == 0) {
+                lzx_reserve(bw);
+                if (bw->overflow) {
+                        return;
+                }
+        }
+        lzx_put16(&bw->out[bw->slot[0]], bw->bits >> bw->nbits);
+        bw->slot[0] = bw->slot[1];
+        bw->nslots--;
+        bw->bits &= (1u << bw->nbits) - 1;
+}
+
+/* Reserve the words the decoder reads before the next extra byte */
+static void
+lzx_sync(struct lzx_bitwriter *bw)
+{
+        int need = bw->nbits ? 2 : 1;
+
+        while (!bw->overflow && bw->nslots < need) {
+                lzx_reserve(bw);
+        }
+}
+
+static void
+lzx_put_byte(struct lzx_bitwriter *bw, uint8_t b)
+{
+        if (bw->pos == bw->out_len) {
+                bw->overflow = 1;
+                return;
+        }
+        bw->out[bw->pos++] = b;
+}
+
+/* Pad the bitstream to the words the decoder has read at its end */
+static void
+lzx_flush(struct lzx_bitwriter *bw)
+{
+        lzx_sync(bw);
+        if (bw->nbits) {
+                lzx_put_bits(bw, 0, 16 - bw->nbits);
+        }
+        while (!bw->overflow && bw->nslots) {
+                lzx_put16(&bw->out[bw->slot[0]], 0);
+                bw->slot[0] = bw->slot[1];
+                bw->nslots--;
+        }
+}
+
+static int
+lzx_sort_keys(const void *a, const void *b)
+{
+        uint32_t x = *(const uint32_t *)a;
+        uint32_t y = *(const uint32_t *)b;
+
+        return x < y ? -1 : x > y;
+}
+
+/* Huffman code lengths for freq, at most LZX_HUFFMAN_MAX_BITS long. At
+ * least two symbols must be used. If the tree gets too deep the
+ * frequencies are flattened and the tree rebuilt.
+ */
+static void
+lzx_huffman_lengths(const uint32_t *freq_in, uint8_t *lens)
+{
+        uint32_t freq[LZX_HUFFMAN_SYMBOLS];
+        uint32_t key[LZX_HUFFMAN_SYMBOLS];
+        uint32_t weight[2 * LZX_HUFFMAN_SYMBOLS];
+        uint16_t parent[2 * LZX_HUFFMAN_SYMBOLS];
+        uint8_t depth[2 * LZX_HUFFMAN_SYMBOLS];
+        int n, i, k, a, b, leaf, node, max;
+
+        memcpy(freq, freq_in, sizeof(freq));
+        for (;;) {
+                n = 0;
+                for (i = 0; i < LZX_HUFFMAN_SYMBOLS; i++) {
+                        if (freq[i]) {
+                                /* Block frequencies fit in 23 bits */
+                                key[n++] = (freq[i] << 9) | i;
+                        }
+                }
+                qsort(key, n, sizeof(key[0]), lzx_sort_keys);
+                for (i = 0; i < n; i++) {
+                        weight[i] = key[i] >> 9;
+                }
+
+                /* Leaves are sorted and internal nodes are created in
+                 * order of weight so the two smallest are always at the
+                 * front of one of the two lists.
+                 */
+                leaf = 0;
+                node = n;
+                for (k = n; k < 2 * n - 1; k++) {
+                        if (leaf < n &&
+                            (node == k || weight[leaf] <= weight[node])) {
+                                a = leaf++;
+                        } else {
+                                a = node++;
+                        }
+                        if (leaf < n &&
+                            (node == k || weight[leaf] <= weight[node])) {
+                                b = leaf++;
+                        } else {
+                                b = node++;
+                        }
+                        weight[k] = weight[a] + weight[b];
+                        parent[a] = parent[b] = k;
+                }
+
+                depth[2 * n - 2] = 0;
+                max = 0;
+                for (k = 2 * n - 3; k >= 0; k--) {
+                        depth[k] = depth[parent[k]] + 1;
+                        if (k < n && depth[k] > max) {
+                                max = depth[k];
+                        }
+                }
+                if (max <= LZX_HUFFMAN_MAX_BITS) {
+                        break;
+                }
+                for (i = 0; i < LZX_HUFFMAN_SYMBOLS; i++) {
+                        if (freq[i]) {
+                                freq[i] = (freq[i] >> 1) | 1;
+                        }
+                }
+        }
+
+        memset(lens, 0, LZX_HUFFMAN_SYMBOLS);
+        for (i = 0; i < n; i++) {
+                lens[key[i] & 0x1ff] = depth[i];
+        }
+}
+
+static int
+lzx_log2(uint32_t v)
+{
+        int n = 0;
+
+        while (v >>= 1) {
+                n++;
+        }
+        return n;
+}
+
+/* Write the table and bitstream of one block at *pos */
+static int
+lzx_huffman_block(const struct lzx_token *tokens, int ntokens,
+                  const uint32_t *freq_in, uint8_t *out, size_t out_len,
+                  size_t *pos)
+{
+        uint32_t freq[LZX_HUFFMAN_SYMBOLS];
+        uint8_t lens[LZX_HUFFMAN_SYMBOLS];
+        uint16_t codes[LZX_HUFFMAN_SYMBOLS];
+        struct lzx_bitwriter bw;
+        uint32_t code;
+        int i, bits, used = 0, obits;
+        size_t l;
+
+        memcpy(freq, freq_in, sizeof(freq));
+        for (i = 0; i < LZX_HUFFMAN_SYMBOLS; i++) {
+                if (freq[i]) {
+                        used++;
+                }
+        }
+        /* A code needs two symbols to be complete */
+        if (used < 2) {
+                freq[freq[0] ? 1 : 0] = 1;
+        }
+        lzx_huffman_lengths(freq, lens);
+
+        /* Canonical codes, shorter codes and then lower symbols first */
+        code = 0;
+        for (bits = 1; bits <= LZX_HUFFMAN_MAX_BITS; bits++) {
+                for (i = 0; i < LZX_HUFFMAN_SYMBOLS; i++) {
+                        if (lens[i] == bits) {
+                                codes[i] = code++;
+                        }
+                }
+                code <<= 1;
+        }
+
+        if (out_len - *pos < LZX_HUFFMAN_TABLE) {
+                return -1;
+        }
+        for (i = 0; i < LZX_HUFFMAN_TABLE; i++) {
+                out[*pos + i] = lens[2 * i] | (lens[2 * i + 1] << 4);
+        }
+
+        memset(&bw, 0, sizeof(bw));
+        bw.out = out;
+        bw.out_len = out_len;
+        bw.pos = *pos + LZX_HUFFMAN_TABLE;
+        /* The decoder starts by reading two words */
+        lzx_reserve(&bw);
+        lzx_reserve(&bw);
+
+        for (i = 0; i < ntokens && !bw.overflow; i++) {
+                const struct lzx_token *t = &tokens[i];
+
+                lzx_put_bits(&bw, codes[t->symbol], lens[t->symbol]);
+                if (t->symbol < 256 || t->offset == 0) {
+                        continue;
+                }
+
+                l = t->length;
+                if (l >= 15) {
+                        lzx_sync(&bw);
+                        if (l - 15 < 255) {
+                                lzx_put_byte(&bw, l - 15);
+                        } else {
+                                lzx_put_byte(&bw, 255);
+                                lzx_put_byte(&bw, l & 0xff);
+                                lzx_put_byte(&bw, l >> 8);
+                        }
+                }
+                obits = (t->symbol - 256) >> 4;
+                if (obits) {
+                        lzx_put_bits(&bw, t->offset - (1u << obits), obits);
+                }
+        }
+        lzx_flush(&bw);
+        if (bw.overflow) {
+                return -1;
+        }
+
+        *pos = bw.pos;
+        return 0;
+}
+
+int
+lzxpress_huffman_compress(const uint8_t *in, size_t in_len,
+                          uint8_t *out, size_t out_len)
+{
+        struct lzx_matcher *m;
+        struct lzx_token *tokens;
+        uint32_t freq[LZX_HUFFMAN_SYMBOLS];
+        size_t ip = 0, op = 0, block_end, len, max_len, offset = 0;
+        int ntokens, obits, done = 0;
+
+        m = lzx_matcher_new(LZX_HUFFMAN_WINDOW, LZX_HUFFMAN_WINDOW - 1);
+        /* Every token outputs at least a byte, plus the end of data */
+        tokens = malloc((LZX_HUFFMAN_BLOCK + 1) * sizeof(*tokens));
+        if (m == NULL || tokens == NULL) {
+                goto failed;
+        }
+
+        while (!done) {
+                block_end = ip + LZX_HUFFMAN_BLOCK;
+                ntokens = 0;
+                memset(freq, 0, sizeof(freq));
+
+                while (ip < in_len && ip < block_end) {
+                        struct lzx_token *t = &tokens[ntokens++];
+
+                        max_len = in_len - ip;
+                        if (max_len > LZX_HUFFMAN_MAX_MATCH) {
+                                max_len = LZX_HUFFMAN_MAX_MATCH;
+                        }
+                        len = lzx_find_match(m, in, ip, max_len, &offset);
+                        if (len) {
+                                obits = lzx_log2(offset);
+                                t->length = len - LZX_MIN_MATCH;
+                                t->offset = offset;
+                                t->symbol = 256 + (obits << 4) +
+                                        (t->length < 15 ? t->length : 15);
+                                lzx_skip(m, in, in_len, ip, len);
+                                ip += len;
+                        } else {
+                                t->symbol = in[ip++];
+                                t->offset = 0;
+                                t->length = 0;
+                        }
+                        freq[t->symbol]++;
+                }
+
+                /* The decoder only looks for the end of data inside a
+                 * block, so if the data ends on a block boundary it goes
+                 * in a block of its own.
+                 */
+                if (ip == in_len && ip < block_end) {
+                        tokens[ntokens].symbol = LZX_HUFFMAN_EOF;
+                        tokens[ntokens].offset = 0;
+                        tokens[ntokens].length = 0;
+                        ntokens++;
+                        freq[LZX_HUFFMAN_EOF]++;
+                        done = 1;
+                }
+
+                if (lzx_huffman_block(tokens, ntokens, freq, out, out_len,
+                                      &op) < 0) {
+                        goto failed;
+                }
+        }
+
+        free(tokens);
+        lzx_matcher_free(m);
+        return (int)op;
+
+ failed:
+        free(tokens);
+        lzx_matcher_free(m);
+        return -1;
+}
+
+/* Decoding table indexed by the next 15 bits of the stream */
+static int
+lzx_huffman_table(const uint8_t *in, uint8_t *lens, uint16_t *table)
+{
+        size_t entry = 0, count;
+        int bits, sym;
+
+        for (sym = 0; sym < LZX_HUFFMAN_SYMBOLS; sym++) {
+                lens[sym] = (in[sym >> 1] >> ((sym & 1) * 4)) & 0x0f;
+        }
+        for (bits = 1; bits <= LZX_HUFFMAN_MAX_BITS; bits++) {
+                for (sym = 0; sym < LZX_HUFFMAN_SYMBOLS; sym++) {
+                        if (lens[sym] != bits) {
+                                continue;
+                        }
+                        count = (size_t)1 << (LZX_HUFFMAN_MAX_BITS - bits);
+                        if (entry + count > (1 << LZX_HUFFMAN_MAX_BITS)) {
+                                return -1;
+                        }
+                        while (count--) {
+                                table[entry++] = sym;
+                        }
+                }
+        }
+
+        return entry == (1 << LZX_HUFFMAN_MAX_BITS) ? 0 : -1;
+}
+
+int
+lzxpress_huffman_decompress(const uint8_t *in, size_t in_len,
+                            uint8_t *out, size_t out_len)
+{
+        uint8_t lens[LZX_HUFFMAN_SYMBOLS];
+        uint16_t *table;
+        size_t ip = 0, op = 0, block_end, len, offset;
+        uint32_t next;
+        int extra, sym, obits;
+
+        table = malloc(sizeof(uint16_t) << LZX_HUFFMAN_MAX_BITS);
+        if (table == NULL) {
+                return -1;
+        }
+
+/* Top up next with the following 16 bits once fewer than 16 are left */
+#define LZX_REFILL()                                            \
+        if (extra < 0) {                                        \
+                if (in_len - ip < 2) {                          \
+                        goto failed;                            \
+                }                                               \
+                next |= LZX_GET16(&in[ip]) << -extra;           \
+                ip += 2;                                        \
+                extra += 16;                                    \
+        }
+
+        while (op < out_len || ip < in_len) {
+                if (in_len - ip < LZX_HUFFMAN_TABLE + 4) {
+                        goto failed;
+                }
+                if (lzx_huffman_table(&in[ip], lens, table) < 0) {
+                        goto failed;
+                }
+                ip += LZX_HUFFMAN_TABLE;
+                next = (LZX_GET16(&in[ip]) << 16) | LZX_GET16(&in[ip + 2]);
+                ip += 4;
+                extra = 16;
+
+                block_end = op + LZX_HUFFMAN_BLOCK;
+                while (op < block_end) {
+                        sym = table[next >> (32 - LZX_HUFFMAN_MAX_BITS)];
+                        next <<= lens[sym];
+                        extra -= lens[sym];
+                        LZX_REFILL();
+
+                        if (sym < 256) {
+                                if (op == out_len) {
+                                        goto failed;
+                                }
+                                out[op++] = sym;
+                                continue;
+                        }
+                        if (sym == LZX_HUFFMAN_EOF && op == out_len) {
+                                goto done;
+                        }
+
+                        sym -= 256;
+                        len = sym & 0x0f;
+                        obits = sym >> 4;
+                        if (len == 15) {
+                                if (ip == in_len) {
+                                        goto failed;
+                                }
+                                len = in[ip++];
+                                if (len == 255) {
+                                        if (in_len - ip < 2) {
+                                                goto failed;
+                                        }
+                                        len = LZX_GET16(&in[ip]);
+                                        ip += 2;
+                                        if (len == 0) {
+                                                if (in_len - ip < 4) {
+                                                        goto failed;
+                                                }
+                                                len = LZX_GET32(&in[ip]);
+                                                ip += 4;
+                                        }
+                                        if (len < 15) {
+                                                goto failed;
+                                        }
+                                        len -= 15;
+                                }
+                                len += 15;
+                        }
+                        len += LZX_MIN_MATCH;
+
+                        offset = ((size_t)1 << obits);
+                        if (obits) {
+                                offset += next >> (32 - obits);
+                                next <<= obits;
+                                extra -= obits;
+                                LZX_REFILL();
+                        }
+
+                        if (offset > op || len > out_len - op) {
+                                goto failed;
+                        }
+                        lzx_copy(&out[op], offset, len);
+                        op += len;
+                }
+        }
+#undef LZX_REFILL
+
+ done:
+        free(table);
+        return (int)op;
+
+ failed:
+        free(table);
+        return -1;
+}
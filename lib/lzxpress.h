@@ -0,0 +1,66 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _LZXPRESS_H_
+#define _LZXPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The Xpress compression formats of [MS-XCA] that SMB 3.1.1 negotiates
+ * as LZ77 and LZ77+Huffman.
+ *
+ * The compressors return the compressed size or -1 if the result does not
+ * fit in out_len bytes, in which case the data should be sent as is.
+ * The decompressors return the decompressed size, which the caller must
+ * check against the size it expected, or -1 if the input is malformed or
+ * would overflow out_len.
+ */
+
+/* Plain LZ77, [MS-XCA] 2.3 and 2.4 */
+int
+lzxpress_compress(const uint8_t *in, size_t in_len,
+                  uint8_t *out, size_t out_len);
+
+int
+lzxpress_decompress(const uint8_t *in, size_t in_len,
+                    uint8_t *out, size_t out_len);
+
+/* LZ77+Huffman, [MS-XCA] 2.1 and 2.2 */
+int
+lzxpress_huffman_compress(const uint8_t *in, size_t in_len,
+                          uint8_t *out, size_t out_len);
+
+int
+lzxpress_huffman_decompress(const uint8_t *in, size_t in_len,
+                            uint8_t *out, size_t out_len);
+
+/* Number of bytes from in onwards that repeat in[0], at most end - in */
+size_t
+lzxpress_run_length(const uint8_t *in, const uint8_t *end);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _LZXPRESS_H_ */
@@ -35,6 +35,10 @@
 #include <string.h>
 #endif
 
+#ifdef STDC_HEADERS
+#include <stddef.h>
+#endif
+
 #include "portable-endian.h"
 
 #include "slist.h"
@@ -70,13 +74,27 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
 	struct smb2_pdu *pdu;
         struct smb2_header *hdr;
         char magic[4] = {0xFE, 'S', 'M', 'B'};
-        
-        pdu = malloc(sizeof(struct smb2_pdu));
-        if (pdu == NULL) {
-                smb2_set_error(smb2, "Failed to allocate pdu");
-                return NULL;
+
+        smb2_lock(smb2);
+        pdu = smb2->pdu_pool;
+        if (pdu != NULL) {
+                smb2->pdu_pool = pdu->next;
+                smb2->pdu_pool_size--;
+        }
+        smb2_unlock(smb2);
+        if (pdu != NULL) {
+                /* The io vectors were already reset when the PDU was
+                 * released so only clear the members in front of them.
+                 */
+                memset(pdu, 0, offsetof(struct smb2_pdu, out));
+        } else {
+                pdu = malloc(sizeof(struct smb2_pdu));
+                if (pdu == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate pdu");
+                        return NULL;
+                }
+                memset(pdu, 0, sizeof(struct smb2_pdu));
         }
-        memset(pdu, 0, sizeof(struct smb2_pdu));
 
         hdr = &pdu->header;
         
@@ -107,7 +125,6 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
                  */
                 hdr->credit_charge = 1;
         }
-        hdr->credit_request_response = MAX_CREDITS - smb2->credits;
 
         switch (command) {
         case SMB2_NEGOTIATE:
@@ -131,7 +148,11 @@ smb2_allocate_pdu(struct smb2_context *smb2, enum smb2_command command,
         pdu->cb_data = cb_data;
         pdu->out.niov = 0;
 
-        smb2_add_iovector(smb2, &pdu->out, pdu->hdr, SMB2_HEADER_SIZE, NULL);
+        if (smb2_add_iovector(smb2, &pdu->out, pdu->hdr, SMB2_HEADER_SIZE,
+                              NULL) == NULL) {
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
+        }
         
         return pdu;
 }
@@ -172,9 +193,37 @@ smb2_free_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
         smb2_free_iovector(smb2, &pdu->in);
 
         free(pdu->payload);
+        free(pdu->crypt);
+
+        smb2_lock(smb2);
+        if (smb2->pdu_pool_size < SMB2_PDU_POOL_SIZE) {
+                pdu->next = smb2->pdu_pool;
+                smb2->pdu_pool = pdu;
+                smb2->pdu_pool_size++;
+                smb2_unlock(smb2);
+                return;
+        }
+        smb2_unlock(smb2);
+
+        smb2_destroy_iovector(smb2, &pdu->out);
+        smb2_destroy_iovector(smb2, &pdu->in);
         free(pdu);
 }
 
+void
+smb2_free_pdu_pool(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+
+        while ((pdu = smb2->pdu_pool) != NULL) {
+                smb2->pdu_pool = pdu->next;
+                smb2_destroy_iovector(smb2, &pdu->out);
+                smb2_destroy_iovector(smb2, &pdu->in);
+                free(pdu);
+        }
+        smb2->pdu_pool_size = 0;
+}
+
 int
 smb2_set_uint8(struct smb2_iovec *iov, int offset, uint8_t value)
 {
@@ -329,27 +378,135 @@ smb2_decode_header(struct smb2_context *smb2, struct smb2_iovec *iov,
 static void
 smb2_add_to_outqueue(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
-        SMB2_LIST_ADD_END(&smb2->outqueue, pdu);
+        SMB2_DLIST_ADD_END(&smb2->outqueue, pdu);
+}
+
+/* Number of credits to ask for in a request.
+ *
+ * We aim to hold a window of credits twice the size of what is currently
+ * in use, i.e. queued plus outstanding. The window grows right away and
+ * shrinks slowly so that short lulls do not throttle a busy connection.
+ * Requests ask for whatever is missing from the window once the queued
+ * requests have spent their credits and the replies to everything in
+ * flight have granted what was asked for.
+ */
+static uint16_t
+smb2_credit_request(struct smb2_context *smb2)
+{
+        int demand, held, request;
+
+        demand = 2 * (smb2->credits_queued + smb2->credits_outstanding);
+        if (demand < SMB2_MIN_CREDIT_TARGET) {
+                demand = SMB2_MIN_CREDIT_TARGET;
+        }
+        if (demand > MAX_CREDITS) {
+                demand = MAX_CREDITS;
+        }
+        if (demand > smb2->credit_target) {
+                smb2->credit_target = demand;
+        } else {
+                smb2->credit_target -= (smb2->credit_target - demand) / 8;
+        }
+
+        held = smb2->credits + smb2->credits_requested;
+        request = smb2->credit_target - (held - smb2->credits_queued);
+        if (request > MAX_CREDITS - held) {
+                request = MAX_CREDITS - held;
+        }
+        if (request < 1) {
+                request = 1;
+        }
+
+        return request;
 }
 
 void
 smb2_queue_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *p;
+        int seal;
+
+        /* Only the service thread touches the headers and the queues */
+        if (!smb2_is_service_thread(smb2)) {
+                smb2_submit_pdu(smb2, pdu);
+                return;
+        }
+
+        /* Once the session is encrypting everything but the commands
+         * that set it up goes out sealed, and sealed PDUs are not signed.
+         */
+        seal = smb2->seal && smb2->have_seal_keys &&
+                pdu->header.command != SMB2_NEGOTIATE &&
+                pdu->header.command != SMB2_SESSION_SETUP;
+
+        /* The headers are encoded by smb2_encode_chain() once the chain
+         * is picked to be sent.
+         */
+        for (p = pdu; p; p = p->next_compound) {
+                smb2->credits_queued += p->header.credit_charge;
+                p->seal = seal;
+        }
+
+        smb2_add_to_outqueue(smb2, pdu);
+}
+
+/* Update all the PDU headers in this chain. This assigns the message ids
+ * so it is only done when the chain is about to be sent. A chain sent
+ * ahead of one that waits for credits then takes the next ids, which are
+ * inside the window the server has granted.
+ */
+void
+smb2_encode_chain(struct smb2_context *smb2, struct smb2_pdu *pdu)
 {
         struct smb2_pdu *p;
 
-        /* Update all the PDU headers in this chain */
         for (p = pdu; p; p = p->next_compound) {
+                p->header.credit_request_response =
+                        smb2_credit_request(smb2);
+                smb2->credits_requested += p->header.credit_request_response;
                 smb2_encode_header(smb2, &p->out.iov[0], &p->header);
-                if (smb2->signing_required) {
+                if (smb2->signing_required && !p->seal) {
                         if (smb2_pdu_add_signature(smb2, p) < 0) {
                                 smb2_set_error(smb2, "Failure to add "
                                                "signature. %s",
                                                smb2_get_error(smb2));
                         }
                 }
+                if (smb2->preauth &&
+                    (p->header.command == SMB2_NEGOTIATE ||
+                     p->header.command == SMB2_SESSION_SETUP)) {
+                        smb3_update_preauth_hash(smb2, &p->out, 0);
+                }
         }
+}
 
-        smb2_add_to_outqueue(smb2, pdu);
+void
+smb2_add_to_waitqueue(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **bucket;
+
+        SMB2_DLIST_ADD_END(&smb2->waitqueue, pdu);
+
+        bucket = &smb2->waithash[SMB2_WAITHASH(pdu->header.message_id)];
+        pdu->next_hash = *bucket;
+        *bucket = pdu;
+}
+
+void
+smb2_remove_from_waitqueue(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu **bucket;
+
+        SMB2_DLIST_REMOVE(&smb2->waitqueue, pdu);
+
+        bucket = &smb2->waithash[SMB2_WAITHASH(pdu->header.message_id)];
+        while (*bucket && *bucket != pdu) {
+                bucket = &(*bucket)->next_hash;
+        }
+        if (*bucket) {
+                *bucket = pdu->next_hash;
+        }
+        pdu->next_hash = NULL;
 }
 
 struct smb2_pdu *
@@ -357,7 +514,8 @@ smb2_find_pdu(struct smb2_context *smb2,
               uint64_t message_id) {
         struct smb2_pdu *pdu;
         
-        for (pdu = smb2->waitqueue; pdu; pdu = pdu->next) {
+        for (pdu = smb2->waithash[SMB2_WAITHASH(message_id)]; pdu;
+             pdu = pdu->next_hash) {
                 if (pdu->header.message_id == message_id) {
                         break;
                 }
@@ -177,8 +177,8 @@ typedef struct HMACContext
   int hashSize;			/* hash size of SHA being used */
   int blockSize;		/* block size of SHA being used */
   USHAContext shaContext;	/* SHA context */
-  unsigned char k_opad[USHA_Max_Message_Block_Size];
-  /* outer padding - key XORd with opad */
+  USHAContext outerContext;	/* SHA context after the outer pad,
+				 * key XORd with opad */
 } HMACContext;
 
 /*
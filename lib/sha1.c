@@ -47,11 +47,9 @@
 /*
  * add "length" to the length
  */
-static uint32_t addTemp;
 #define SHA1AddLength(context, length)                     \
-    (addTemp = (context)->Length_Low,                      \
-     (context)->Corrupted =                                \
-        (((context)->Length_Low += (length)) < addTemp) && \
+    ((context)->Corrupted =                                \
+        (((context)->Length_Low += (length)) < (length)) && \
         (++(context)->Length_High == 0) ? 1 : 0)
 
 /* Local Function Prototypes */
@@ -36,8 +36,22 @@
  *   final few bits of the input.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stddef.h>
+#include <string.h>
+
 #include "sha.h"
 #include "sha-private.h"
+
+#if defined(HAVE_CPUID_H) && defined(HAVE_IMMINTRIN_H) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define SHA_USE_SHANI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 /* Define the SHA shift, rotate left and rotate right macro */
 #define SHA256_SHR(bits,word)      ((word) >> (bits))
 #define SHA256_ROTL(bits,word)                         \
@@ -58,16 +72,17 @@
 /*
  * add "length" to the length
  */
-static uint32_t addTemp;
 #define SHA224_256AddLength(context, length)               \
-  (addTemp = (context)->Length_Low, (context)->Corrupted = \
-    (((context)->Length_Low += (length)) < addTemp) &&     \
+  ((context)->Corrupted =                                  \
+    (((context)->Length_Low += (length)) < (length)) &&    \
     (++(context)->Length_High == 0) ? 1 : 0)
 
 /* Local Function Prototypes */
 static void SHA224_256Finalize (SHA256Context * context, uint8_t Pad_Byte);
 static void SHA224_256PadMessage (SHA256Context * context, uint8_t Pad_Byte);
 static void SHA224_256ProcessMessageBlock (SHA256Context * context);
+static void SHA224_256ProcessBlocks (uint32_t * H, const uint8_t * blocks,
+				     size_t nblocks);
 static int SHA224_256Reset (SHA256Context * context, uint32_t * H0);
 static int SHA224_256ResultN (SHA256Context * context,
 			      uint8_t Message_Digest[], int HashSize);
@@ -239,16 +254,42 @@ SHA256Input (SHA256Context * context, const uint8_t * message_array,
   if (context->Corrupted)
     return context->Corrupted;
 
-  while (length-- && !context->Corrupted)
+  while (length && !context->Corrupted)
     {
-      context->Message_Block[context->Message_Block_Index++] =
-	(*message_array & 0xFF);
-
-      if (!SHA224_256AddLength (context, 8) &&
-	  (context->Message_Block_Index == SHA256_Message_Block_Size))
-	SHA224_256ProcessMessageBlock (context);
-
-      message_array++;
+      unsigned int n;
+
+      /*
+       * Whole blocks are compressed straight from the caller's
+       * buffer, only partial blocks go through Message_Block.
+       */
+      if (context->Message_Block_Index == 0 &&
+	  length >= SHA256_Message_Block_Size)
+	{
+	  size_t nblocks = length / SHA256_Message_Block_Size;
+	  size_t i;
+
+	  for (i = 0; i < nblocks; i++)
+	    if (SHA224_256AddLength (context, SHA256_Message_Block_Size * 8))
+	      return context->Corrupted;
+	  SHA224_256ProcessBlocks (context->Intermediate_Hash,
+				   message_array, nblocks);
+	  n = (unsigned int) (nblocks * SHA256_Message_Block_Size);
+	}
+      else
+	{
+	  n = SHA256_Message_Block_Size - context->Message_Block_Index;
+	  if (n > length)
+	    n = length;
+	  memcpy (&context->Message_Block[context->Message_Block_Index],
+		  message_array, n);
+	  context->Message_Block_Index += n;
+	  if (!SHA224_256AddLength (context, n * 8) &&
+	      (context->Message_Block_Index == SHA256_Message_Block_Size))
+	    SHA224_256ProcessMessageBlock (context);
+	}
+
+      message_array += n;
+      length -= n;
     }
 
   return shaSuccess;
@@ -429,19 +470,29 @@ SHA224_256PadMessage (SHA256Context * context, uint8_t Pad_Byte)
   SHA224_256ProcessMessageBlock (context);
 }
 
+/* Constants defined in FIPS-180-2, section 4.2.2 */
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+  0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+  0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+  0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+  0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+  0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+  0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+  0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+  0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+  0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+  0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+  0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
 /*
- * SHA224_256ProcessMessageBlock
+ * SHA224_256Compress
  *
  * Description:
- *   This function will process the next 512 bits of the message
- *   stored in the Message_Block array.
- *
- * Parameters:
- *   context: [in/out]
- *     The SHA context to update
- *
- * Returns:
- *   Nothing.
+ *   Portable compression function. Processes nblocks 512-bit
+ *   blocks into the intermediate hash H0.
  *
  * Comments:
  *   Many of the variable names in this code, especially the
@@ -449,74 +500,194 @@ SHA224_256PadMessage (SHA256Context * context, uint8_t Pad_Byte)
  *   names used in the publication.
  */
 static void
-SHA224_256ProcessMessageBlock (SHA256Context * context)
+SHA224_256Compress (uint32_t * H0, const uint8_t * block, size_t nblocks)
 {
-  /* Constants defined in FIPS-180-2, section 4.2.2 */
-  static const uint32_t K[64] = {
-    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
-    0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
-    0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
-    0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
-    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
-    0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
-    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
-    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
-    0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
-    0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
-    0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
-    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-  };
   int t, t4;			/* Loop counter */
   uint32_t temp1, temp2;	/* Temporary word value */
   uint32_t W[64];		/* Word sequence */
   uint32_t A, B, C, D, E, F, G, H;	/* Word buffers */
 
-  /*
-   * Initialize the first 16 words in the array W
-   */
-  for (t = t4 = 0; t < 16; t++, t4 += 4)
-    W[t] = (((uint32_t) context->Message_Block[t4]) << 24) |
-      (((uint32_t) context->Message_Block[t4 + 1]) << 16) |
-      (((uint32_t) context->Message_Block[t4 + 2]) << 8) |
-      (((uint32_t) context->Message_Block[t4 + 3]));
-
-  for (t = 16; t < 64; t++)
-    W[t] = SHA256_sigma1 (W[t - 2]) + W[t - 7] +
-      SHA256_sigma0 (W[t - 15]) + W[t - 16];
-
-  A = context->Intermediate_Hash[0];
-  B = context->Intermediate_Hash[1];
-  C = context->Intermediate_Hash[2];
-  D = context->Intermediate_Hash[3];
-  E = context->Intermediate_Hash[4];
-  F = context->Intermediate_Hash[5];
-  G = context->Intermediate_Hash[6];
-  H = context->Intermediate_Hash[7];
-
-  for (t = 0; t < 64; t++)
+  while (nblocks--)
+    {
+      /*
+       * Initialize the first 16 words in the array W
+       */
+      for (t = t4 = 0; t < 16; t++, t4 += 4)
+	W[t] = (((uint32_t) block[t4]) << 24) |
+	  (((uint32_t) block[t4 + 1]) << 16) |
+	  (((uint32_t) block[t4 + 2]) << 8) | (((uint32_t) block[t4 + 3]));
+
+      for (t = 16; t < 64; t++)
+	W[t] = SHA256_sigma1 (W[t - 2]) + W[t - 7] +
+	  SHA256_sigma0 (W[t - 15]) + W[t - 16];
+
+      A = H0[0];
+      B = H0[1];
+      C = H0[2];
+      D = H0[3];
+      E = H0[4];
+      F = H0[5];
+      G = H0[6];
+      H = H0[7];
+
+      for (t = 0; t < 64; t++)
+	{
+	  temp1 = H + SHA256_SIGMA1 (E) + SHA_Ch (E, F, G) + SHA256_K[t] +
+	    W[t];
+	  temp2 = SHA256_SIGMA0 (A) + SHA_Maj (A, B, C);
+	  H = G;
+	  G = F;
+	  F = E;
+	  E = D + temp1;
+	  D = C;
+	  C = B;
+	  B = A;
+	  A = temp1 + temp2;
+	}
+
+      H0[0] += A;
+      H0[1] += B;
+      H0[2] += C;
+      H0[3] += D;
+      H0[4] += E;
+      H0[5] += F;
+      H0[6] += G;
+      H0[7] += H;
+
+      block += SHA256_Message_Block_Size;
+    }
+}
+
+
+#if defined(SHA_USE_SHANI)
+/*
+ * SHA-NI version of the compression function. The state is kept as
+ * the ABEF/CDGH register pairs that SHA256RNDS2 works on and the
+ * message schedule is computed four words at a time with
+ * SHA256MSG1/SHA256MSG2.
+ */
+static int
+SHANI_supported (void)
+{
+  unsigned int eax, ebx, ecx, edx;
+
+  if (__get_cpuid_max (0, NULL) < 7)
+    return 0;
+  if (!__get_cpuid (1, &eax, &ebx, &ecx, &edx))
+    return 0;
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return 0;
+  __cpuid_count (7, 0, eax, ebx, ecx, edx);
+  return (ebx & (1 << 29)) != 0;	/* SHA */
+}
+
+__attribute__ ((target ("sha,sse4.1")))
+static void
+SHANI_Compress (uint32_t * H0, const uint8_t * block, size_t nblocks)
+{
+  const __m128i MASK = _mm_set_epi64x (0x0c0d0e0f08090a0bULL,
+				       0x0405060700010203ULL);
+  __m128i STATE0, STATE1, ABEF, CDGH, MSG, TMP;
+  __m128i W[4];
+  int i;
+
+  TMP = _mm_loadu_si128 ((const __m128i *) &H0[0]);
+  STATE1 = _mm_loadu_si128 ((const __m128i *) &H0[4]);
+  TMP = _mm_shuffle_epi32 (TMP, 0xB1);	/* CDAB */
+  STATE1 = _mm_shuffle_epi32 (STATE1, 0x1B);	/* EFGH */
+  STATE0 = _mm_alignr_epi8 (TMP, STATE1, 8);	/* ABEF */
+  STATE1 = _mm_blend_epi16 (STATE1, TMP, 0xF0);	/* CDGH */
+
+  while (nblocks--)
     {
-      temp1 = H + SHA256_SIGMA1 (E) + SHA_Ch (E, F, G) + K[t] + W[t];
-      temp2 = SHA256_SIGMA0 (A) + SHA_Maj (A, B, C);
-      H = G;
-      G = F;
-      F = E;
-      E = D + temp1;
-      D = C;
-      C = B;
-      B = A;
-      A = temp1 + temp2;
+      ABEF = STATE0;
+      CDGH = STATE1;
+
+      /* Four rounds per iteration, two per SHA256RNDS2 */
+      for (i = 0; i < 16; i++)
+	{
+	  if (i < 4)
+	    W[i] = _mm_shuffle_epi8 (_mm_loadu_si128
+				     ((const __m128i *) (block + 16 * i)),
+				     MASK);
+	  MSG = _mm_add_epi32 (W[i & 3],
+			       _mm_loadu_si128 ((const __m128i *)
+						&SHA256_K[4 * i]));
+	  STATE1 = _mm_sha256rnds2_epu32 (STATE1, STATE0, MSG);
+	  if (i >= 3 && i < 15)
+	    {
+	      TMP = _mm_alignr_epi8 (W[i & 3], W[(i - 1) & 3], 4);
+	      W[(i + 1) & 3] = _mm_add_epi32 (W[(i + 1) & 3], TMP);
+	      W[(i + 1) & 3] = _mm_sha256msg2_epu32 (W[(i + 1) & 3],
+						     W[i & 3]);
+	    }
+	  MSG = _mm_shuffle_epi32 (MSG, 0x0E);
+	  STATE0 = _mm_sha256rnds2_epu32 (STATE0, STATE1, MSG);
+	  if (i >= 1 && i < 13)
+	    W[(i - 1) & 3] = _mm_sha256msg1_epu32 (W[(i - 1) & 3],
+						   W[i & 3]);
+	}
+
+      STATE0 = _mm_add_epi32 (STATE0, ABEF);
+      STATE1 = _mm_add_epi32 (STATE1, CDGH);
+      block += SHA256_Message_Block_Size;
     }
 
-  context->Intermediate_Hash[0] += A;
-  context->Intermediate_Hash[1] += B;
-  context->Intermediate_Hash[2] += C;
-  context->Intermediate_Hash[3] += D;
-  context->Intermediate_Hash[4] += E;
-  context->Intermediate_Hash[5] += F;
-  context->Intermediate_Hash[6] += G;
-  context->Intermediate_Hash[7] += H;
+  /* Back from ABEF/CDGH to A..H */
+  TMP = _mm_shuffle_epi32 (STATE0, 0x1B);
+  STATE1 = _mm_shuffle_epi32 (STATE1, 0xB1);
+  STATE0 = _mm_blend_epi16 (TMP, STATE1, 0xF0);
+  STATE1 = _mm_alignr_epi8 (STATE1, TMP, 8);
+  _mm_storeu_si128 ((__m128i *) &H0[0], STATE0);
+  _mm_storeu_si128 ((__m128i *) &H0[4], STATE1);
+}
+#endif /* SHA_USE_SHANI */
 
+/*
+ * SHA224_256ProcessBlocks
+ *
+ * Description:
+ *   Compress nblocks 512-bit blocks into H, using SHA-NI when
+ *   the CPU has it.
+ */
+static void
+SHA224_256ProcessBlocks (uint32_t * H, const uint8_t * blocks,
+			 size_t nblocks)
+{
+#if defined(SHA_USE_SHANI)
+  /* -1 until probed, racing probes all store the same value */
+  static volatile int shani = -1;
+
+  if (shani < 0)
+    shani = SHANI_supported ();
+  if (shani)
+    {
+      SHANI_Compress (H, blocks, nblocks);
+      return;
+    }
+#endif
+  SHA224_256Compress (H, blocks, nblocks);
+}
+
+/*
+ * SHA224_256ProcessMessageBlock
+ *
+ * Description:
+ *   This function will process the next 512 bits of the message
+ *   stored in the Message_Block array.
+ *
+ * Parameters:
+ *   context: [in/out]
+ *     The SHA context to update
+ *
+ * Returns:
+ *   Nothing.
+ */
+static void
+SHA224_256ProcessMessageBlock (SHA256Context * context)
+{
+  SHA224_256ProcessBlocks (context->Intermediate_Hash,
+			   context->Message_Block, 1);
   context->Message_Block_Index = 0;
 }
 
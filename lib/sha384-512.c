@@ -286,10 +286,9 @@ static uint32_t SHA512_H0[SHA512HashSize / 4] = {
 /*
  * add "length" to the length
  */
-static uint64_t addTemp;
 #define SHA384_512AddLength(context, length)                   \
-   (addTemp = context->Length_Low, context->Corrupted =        \
-    ((context->Length_Low += length) < addTemp) &&             \
+   (context->Corrupted =                                       \
+    ((context->Length_Low += length) < (uint64_t)(length)) &&  \
     (++context->Length_High == 0) ? 1 : 0)
 
 /* Local Function Prototypes */
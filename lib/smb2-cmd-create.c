@@ -65,6 +65,10 @@ smb2_encode_create_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         /* Name */
         if (req->name && req->name[0]) {
@@ -104,6 +108,11 @@ smb2_encode_create_request(struct smb2_context *smb2,
                                         buf,
                                         2 * name->len,
                                         free);
+                if (iov == NULL) {
+                        free(buf);
+                        free(name);
+                        return -1;
+                }
                 /* Convert '/' to '\' */
                 for (i = 0; i < name->len; i++) {
                         smb2_get_uint16(iov, i * 2, &ch);
@@ -128,6 +137,9 @@ smb2_encode_create_request(struct smb2_context *smb2,
 
                 iov = smb2_add_iovector(smb2, &pdu->out,
                                         &zero, 1, NULL);
+                if (iov == NULL) {
+                        return -1;
+                }
         }
         
         return 0;
@@ -61,6 +61,10 @@ smb2_encode_echo_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         smb2_set_uint16(iov, 0, SMB2_ECHO_REQUEST_SIZE);
 
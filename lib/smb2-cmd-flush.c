@@ -63,6 +63,10 @@ smb2_encode_flush_request(struct smb2_context *smb2,
         memset(buf, 0, len);
 
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         smb2_set_uint16(iov, 0, SMB2_FLUSH_REQUEST_SIZE);
         memcpy(iov->buf + 8, req->file_id, SMB2_FD_SIZE);
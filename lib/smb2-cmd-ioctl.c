@@ -137,6 +137,10 @@ smb2_encode_ioctl_request(struct smb2_context *smb2,
         memset(buf, 0, len);
 
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         smb2_set_uint16(iov, 0, SMB2_IOCTL_REQUEST_SIZE);
         smb2_set_uint32(iov, 4, req->ctl_code);
@@ -151,6 +155,9 @@ smb2_encode_ioctl_request(struct smb2_context *smb2,
         if (req->input_count) {
                 iov = smb2_add_iovector(smb2, &pdu->out, req->input,
                                         req->input_count, NULL);
+                if (iov == NULL) {
+                        return -1;
+                }
         }
 
         return 0;
@@ -45,17 +45,61 @@
 #include "libsmb2.h"
 #include "libsmb2-private.h"
 
+/* Size of a negotiate context with data_len bytes of data, including
+ * the padding up to the next context.
+ */
+#define NEGOTIATE_CONTEXT_SIZE(data_len) (8 + PAD_TO_64BIT(data_len))
+
+static int
+smb2_encode_negotiate_context(struct smb2_iovec *iov, int offset,
+                              uint16_t type, uint16_t data_len)
+{
+        smb2_set_uint16(iov, offset, type);
+        smb2_set_uint16(iov, offset + 2, data_len);
+
+        return offset + 8;
+}
+
 static int
 smb2_encode_negotiate_request(struct smb2_context *smb2,
                               struct smb2_pdu *pdu,
                               struct smb2_negotiate_request *req)
 {
         uint8_t *buf;
-        int i, len;
+        int i, len, offset, context_offset = 0, context_count = 0;
         struct smb2_iovec *iov;
-        
+
         len = SMB2_NEGOTIATE_REQUEST_SIZE +
                 req->dialect_count * sizeof(uint16_t);
+        for (i = 0; i < req->dialect_count; i++) {
+                if (req->dialects[i] == SMB2_VERSION_0311) {
+                        break;
+                }
+        }
+        if (i < req->dialect_count) {
+                /* The contexts start 8 byte aligned from the header */
+                len = PAD_TO_64BIT(len);
+                context_offset = len;
+                len += NEGOTIATE_CONTEXT_SIZE(6 + SMB2_PREAUTH_SALT_SIZE);
+                context_count++;
+                if (req->cipher_count) {
+                        len += NEGOTIATE_CONTEXT_SIZE(
+                                2 + req->cipher_count * sizeof(uint16_t));
+                        context_count++;
+                }
+                if (req->signing_algorithm_count) {
+                        len += NEGOTIATE_CONTEXT_SIZE(
+                                2 + req->signing_algorithm_count *
+                                sizeof(uint16_t));
+                        context_count++;
+                }
+                if (req->compression_algorithm_count) {
+                        len += NEGOTIATE_CONTEXT_SIZE(
+                                8 + req->compression_algorithm_count *
+                                sizeof(uint16_t));
+                        context_count++;
+                }
+        }
         len = PAD_TO_32BIT(len);
         buf = malloc(len);
         if (buf == NULL) {
@@ -65,17 +109,83 @@ smb2_encode_negotiate_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
         
         smb2_set_uint16(iov, 0, SMB2_NEGOTIATE_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->dialect_count);
         smb2_set_uint16(iov, 4, req->security_mode);
         smb2_set_uint32(iov, 8, req->capabilities);
         memcpy(iov->buf + 12, req->client_guid, SMB2_GUID_SIZE);
-        smb2_set_uint64(iov, 28, req->client_start_time);
+        if (context_count) {
+                smb2_set_uint32(iov, 28, SMB2_HEADER_SIZE + context_offset);
+                smb2_set_uint16(iov, 32, context_count);
+        } else {
+                smb2_set_uint64(iov, 28, req->client_start_time);
+        }
         for (i = 0; i < req->dialect_count; i++) {
                 smb2_set_uint16(iov, 36 + i * sizeof(uint16_t),
                                 req->dialects[i]);
         }
+        if (context_count == 0) {
+                return 0;
+        }
+
+        offset = smb2_encode_negotiate_context(
+                iov, context_offset, SMB2_PREAUTH_INTEGRITY_CAPABILITIES,
+                6 + SMB2_PREAUTH_SALT_SIZE);
+        smb2_set_uint16(iov, offset, 1);
+        smb2_set_uint16(iov, offset + 2, SMB2_PREAUTH_SALT_SIZE);
+        smb2_set_uint16(iov, offset + 4, SMB2_PREAUTH_INTEGRITY_SHA512);
+        memcpy(iov->buf + offset + 6, req->preauth_salt,
+               SMB2_PREAUTH_SALT_SIZE);
+        offset += PAD_TO_64BIT(6 + SMB2_PREAUTH_SALT_SIZE);
+
+        if (req->cipher_count) {
+                offset = smb2_encode_negotiate_context(
+                        iov, offset, SMB2_ENCRYPTION_CAPABILITIES,
+                        2 + req->cipher_count * sizeof(uint16_t));
+                smb2_set_uint16(iov, offset, req->cipher_count);
+                for (i = 0; i < req->cipher_count; i++) {
+                        smb2_set_uint16(iov, offset + 2 +
+                                        i * sizeof(uint16_t),
+                                        req->ciphers[i]);
+                }
+                offset += PAD_TO_64BIT(2 + req->cipher_count *
+                                       sizeof(uint16_t));
+        }
+
+        if (req->signing_algorithm_count) {
+                offset = smb2_encode_negotiate_context(
+                        iov, offset, SMB2_SIGNING_CAPABILITIES,
+                        2 + req->signing_algorithm_count *
+                        sizeof(uint16_t));
+                smb2_set_uint16(iov, offset, req->signing_algorithm_count);
+                for (i = 0; i < req->signing_algorithm_count; i++) {
+                        smb2_set_uint16(iov, offset + 2 +
+                                        i * sizeof(uint16_t),
+                                        req->signing_algorithms[i]);
+                }
+                offset += PAD_TO_64BIT(2 + req->signing_algorithm_count *
+                                       sizeof(uint16_t));
+        }
+
+        if (req->compression_algorithm_count) {
+                offset = smb2_encode_negotiate_context(
+                        iov, offset, SMB2_COMPRESSION_CAPABILITIES,
+                        8 + req->compression_algorithm_count *
+                        sizeof(uint16_t));
+                smb2_set_uint16(iov, offset,
+                                req->compression_algorithm_count);
+                smb2_set_uint32(iov, offset + 4, req->compression_flags);
+                for (i = 0; i < req->compression_algorithm_count; i++) {
+                        smb2_set_uint16(iov, offset + 8 +
+                                        i * sizeof(uint16_t),
+                                        req->compression_algorithms[i]);
+                }
+        }
 
         return 0;
 }
@@ -115,6 +225,7 @@ smb2_process_negotiate_fixed(struct smb2_context *smb2,
         struct smb2_negotiate_reply *rep;
         struct smb2_iovec *iov = &smb2->in.iov[smb2->in.niov - 1];
         uint16_t struct_size;
+        int len;
 
         rep = malloc(sizeof(*rep));
         if (rep == NULL) {
@@ -144,6 +255,17 @@ smb2_process_negotiate_fixed(struct smb2_context *smb2,
         smb2_get_uint64(iov, 48, &rep->server_start_time);
         smb2_get_uint16(iov, 56, &rep->security_buffer_offset);
         smb2_get_uint16(iov, 58, &rep->security_buffer_length);
+        rep->negotiate_context_count = 0;
+        rep->negotiate_context_offset = 0;
+        rep->preauth_hash_algorithm = 0;
+        rep->cipher = 0;
+        rep->signing_algorithm = 0;
+        rep->compression_algorithm_count = 0;
+        rep->compression_flags = 0;
+        if (rep->dialect_revision == SMB2_VERSION_0311) {
+                smb2_get_uint16(iov, 6, &rep->negotiate_context_count);
+                smb2_get_uint32(iov, 60, &rep->negotiate_context_offset);
+        }
 
         if (rep->security_buffer_length == 0) {
                 smb2_set_error(smb2, "No security buffer in Negotiate "
@@ -157,12 +279,110 @@ smb2_process_negotiate_fixed(struct smb2_context *smb2,
                 return -1;
         }
 
+        if (rep->negotiate_context_count) {
+                /* The contexts follow the security buffer and run to the
+                 * end of the reply.
+                 */
+                len = smb2->spl + SMB2_SPL_SIZE - smb2->in.num_done;
+                if (rep->negotiate_context_offset <
+                    rep->security_buffer_offset +
+                    rep->security_buffer_length ||
+                    len < IOV_OFFSET + rep->security_buffer_length) {
+                        smb2_set_error(smb2, "Invalid negotiate context "
+                                       "offset");
+                        return -1;
+                }
+                return len;
+        }
+
         /* Return the amount of data that the security buffer will take up.
          * Including any padding before the security buffer itself.
          */
         return IOV_OFFSET + rep->security_buffer_length;
 }
 
+static int
+smb2_parse_negotiate_contexts(struct smb2_context *smb2,
+                              struct smb2_negotiate_reply *rep,
+                              struct smb2_iovec *iov)
+{
+        uint16_t type, data_len, count;
+        uint32_t offset;
+        int i, j;
+
+        offset = rep->negotiate_context_offset - SMB2_HEADER_SIZE -
+                (SMB2_NEGOTIATE_REPLY_SIZE & 0xfffe);
+        for (i = 0; i < rep->negotiate_context_count; i++) {
+                offset = PAD_TO_64BIT(offset);
+                if (smb2_get_uint16(iov, offset, &type) < 0 ||
+                    smb2_get_uint16(iov, offset + 2, &data_len) < 0 ||
+                    offset + 8 + data_len > iov->len) {
+                        smb2_set_error(smb2, "Negotiate context beyond end "
+                                       "of reply");
+                        return -1;
+                }
+                offset += 8;
+
+                /* The server returns exactly one of each list, compression
+                 * algorithms excepted.
+                 */
+                switch (type) {
+                case SMB2_PREAUTH_INTEGRITY_CAPABILITIES:
+                        smb2_get_uint16(iov, offset, &count);
+                        if (count != 1 || data_len < 6) {
+                                smb2_set_error(smb2, "Invalid preauth "
+                                               "integrity context");
+                                return -1;
+                        }
+                        smb2_get_uint16(iov, offset + 4,
+                                        &rep->preauth_hash_algorithm);
+                        break;
+                case SMB2_ENCRYPTION_CAPABILITIES:
+                        smb2_get_uint16(iov, offset, &count);
+                        if (count != 1 || data_len < 4) {
+                                smb2_set_error(smb2, "Invalid encryption "
+                                               "context");
+                                return -1;
+                        }
+                        smb2_get_uint16(iov, offset + 2, &rep->cipher);
+                        break;
+                case SMB2_SIGNING_CAPABILITIES:
+                        smb2_get_uint16(iov, offset, &count);
+                        if (count != 1 || data_len < 4) {
+                                smb2_set_error(smb2, "Invalid signing "
+                                               "context");
+                                return -1;
+                        }
+                        smb2_get_uint16(iov, offset + 2,
+                                        &rep->signing_algorithm);
+                        break;
+                case SMB2_COMPRESSION_CAPABILITIES:
+                        smb2_get_uint16(iov, offset, &count);
+                        if (count == 0 ||
+                            data_len < 8 + count * sizeof(uint16_t)) {
+                                smb2_set_error(smb2, "Invalid compression "
+                                               "context");
+                                return -1;
+                        }
+                        if (count > SMB2_NEGOTIATE_MAX_COMPRESSION_ALGORITHMS) {
+                                count = SMB2_NEGOTIATE_MAX_COMPRESSION_ALGORITHMS;
+                        }
+                        smb2_get_uint32(iov, offset + 4,
+                                        &rep->compression_flags);
+                        for (j = 0; j < count; j++) {
+                                smb2_get_uint16(iov, offset + 8 +
+                                        j * sizeof(uint16_t),
+                                        &rep->compression_algorithms[j]);
+                        }
+                        rep->compression_algorithm_count = count;
+                        break;
+                }
+                offset += data_len;
+        }
+
+        return 0;
+}
+
 int
 smb2_process_negotiate_variable(struct smb2_context *smb2,
                                 struct smb2_pdu *pdu)
@@ -172,5 +392,9 @@ smb2_process_negotiate_variable(struct smb2_context *smb2,
 
         rep->security_buffer = &iov->buf[IOV_OFFSET];
 
+        if (rep->negotiate_context_count) {
+                return smb2_parse_negotiate_contexts(smb2, rep, iov);
+        }
+
         return 0;
 }
@@ -46,25 +46,44 @@
 #include "libsmb2-private.h"
 
 int
-smb2_decode_fileidfulldirectoryinformation(
+smb2_fileidfulldirectoryinformation_name_size(
     struct smb2_context *smb2,
-    struct smb2_fileidfulldirectoryinformation *fs,
     struct smb2_iovec *vec)
 {
         uint32_t name_len;
-        uint64_t t;
 
         /* Make sure the name fits before end of vector.
          * As the name is the final part of this blob this guarantees
          * that all other fields also fit within the remainder of the
          * vector.
          */
+        if (vec->len < 80) {
+                smb2_set_error(smb2, "Malformed name in query.\n");
+                return -1;
+        }
         smb2_get_uint32(vec, 60, &name_len);
-        if (80 + name_len > vec->len) {
+        if (name_len > vec->len - 80) {
                 smb2_set_error(smb2, "Malformed name in query.\n");
                 return -1;
         }
 
+        return ucs2_to_utf8_len((uint16_t *)&vec->buf[80], name_len / 2);
+}
+
+int
+smb2_decode_fileidfulldirectoryinformation(
+    struct smb2_context *smb2,
+    struct smb2_fileidfulldirectoryinformation *fs,
+    struct smb2_iovec *vec, char *name)
+{
+        uint32_t name_len;
+        uint64_t t;
+
+        if (smb2_fileidfulldirectoryinformation_name_size(smb2, vec) < 0) {
+                return -1;
+        }
+        smb2_get_uint32(vec, 60, &name_len);
+
         smb2_get_uint32(vec, 0, &fs->next_entry_offset);
         smb2_get_uint32(vec, 4, &fs->file_index);
         smb2_get_uint64(vec, 40, &fs->end_of_file);
@@ -73,7 +92,8 @@ smb2_decode_fileidfulldirectoryinformation(
         smb2_get_uint32(vec, 64, &fs->ea_size);
         smb2_get_uint64(vec, 72, &fs->file_id);
 
-        fs->name = ucs2_to_utf8((uint16_t *)&vec->buf[80], name_len / 2);
+        ucs2_to_utf8_buf((uint16_t *)&vec->buf[80], name_len / 2, name);
+        fs->name = name;
 
         smb2_get_uint64(vec, 8, &t);
         win_to_timeval(t, &fs->creation_time);
@@ -109,6 +129,10 @@ smb2_encode_query_directory_request(struct smb2_context *smb2,
         memset(buf, 0, len);
 
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         /* Name */
         if (req->name && req->name[0]) {
@@ -141,6 +165,11 @@ smb2_encode_query_directory_request(struct smb2_context *smb2,
                                         buf,
                                         2 * name->len,
                                         free);
+                if (iov == NULL) {
+                        free(buf);
+                        free(name);
+                        return -1;
+                }
         }
         free(name);
         
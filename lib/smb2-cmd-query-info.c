@@ -69,6 +69,10 @@ smb2_encode_query_info_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         smb2_set_uint16(iov, 0, SMB2_QUERY_INFO_REQUEST_SIZE);
         smb2_set_uint8(iov, 2, req->info_type);
@@ -51,7 +51,7 @@ smb2_encode_read_request(struct smb2_context *smb2,
                          struct smb2_read_request *req)
 {
         int len;
-        uint8_t *buf;
+        uint8_t *buf, flags = req->flags;
         struct smb2_iovec *iov;
 
         len = SMB2_READ_REQUEST_SIZE & 0xfffffffe;
@@ -63,13 +63,22 @@ smb2_encode_read_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         if (!smb2->supports_multi_credit && req->length > 60 * 1024) {
                 req->length = 60 * 1024;
                 req->minimum_count = 0;
         }
+        /* Reads large enough to be worth it may come back compressed */
+        if (smb2->compression_algorithms && smb2->compression_threshold &&
+            req->length >= smb2->compression_threshold) {
+                flags |= SMB2_READFLAG_REQUEST_COMPRESSED;
+        }
         smb2_set_uint16(iov, 0, SMB2_READ_REQUEST_SIZE);
-        smb2_set_uint8(iov, 3, req->flags);
+        smb2_set_uint8(iov, 3, flags);
         smb2_set_uint32(iov, 4, req->length);
         smb2_set_uint64(iov, 8, req->offset);
         memcpy(iov->buf + 16, req->file_id, SMB2_FD_SIZE);
@@ -90,7 +99,10 @@ smb2_encode_read_request(struct smb2_context *smb2,
         if (req->read_channel_info == NULL) {
                 static uint8_t zero;
 
-                smb2_add_iovector(smb2, &pdu->out, &zero, 1, NULL);
+                if (smb2_add_iovector(smb2, &pdu->out, &zero, 1,
+                                      NULL) == NULL) {
+                        return -1;
+                }
         }
 
         return 0;
@@ -114,8 +126,11 @@ smb2_cmd_read_async(struct smb2_context *smb2,
         }
 
         /* Add a vector for the buffer that the application gave us */
-        smb2_add_iovector(smb2, &pdu->in, req->buf,
-                          req->length, NULL);
+        if (smb2_add_iovector(smb2, &pdu->in, req->buf,
+                              req->length, NULL) == NULL) {
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
+        }
 
         if (smb2_pad_to_64bit(smb2, &pdu->out) != 0) {
                 smb2_free_pdu(smb2, pdu);
@@ -64,6 +64,10 @@ smb2_encode_session_setup_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         smb2_set_uint16(iov, 0, SMB2_SESSION_SETUP_REQUEST_SIZE);
         smb2_set_uint8(iov, 2, req->flags);
@@ -86,6 +90,10 @@ smb2_encode_session_setup_request(struct smb2_context *smb2,
                                 buf,
                                 req->security_buffer_length,
                                 free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
         return 0;
 }
 
@@ -67,6 +67,10 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         smb2_set_uint16(iov, 0, SMB2_SET_INFO_REQUEST_SIZE);
         smb2_set_uint8(iov, 2, req->info_type);
@@ -91,6 +95,10 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         memset(buf, 0, len);
                         iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
                                                 free);
+                        if (iov == NULL) {
+                                free(buf);
+                                return -1;
+                        }
                         smb2_encode_file_basic_info(smb2, req->input_data, iov);
                         break;
                 case SMB2_FILE_END_OF_FILE_INFORMATION:
@@ -106,6 +114,10 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         memset(buf, 0, len);
                         iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
                                                 free);
+                        if (iov == NULL) {
+                                free(buf);
+                                return -1;
+                        }
 
                         eofi = req->input_data;
                         smb2_set_uint64(iov, 0, eofi->end_of_file);
@@ -139,6 +151,11 @@ smb2_encode_set_info_request(struct smb2_context *smb2,
                         memset(buf, 0, len);
                         iov = smb2_add_iovector(smb2, &pdu->out, buf, len,
                                                 free);
+                        if (iov == NULL) {
+                                free(buf);
+                                free(name);
+                                return -1;
+                        }
 
                         smb2_set_uint8(iov, 0, rni->replace_if_exist);
                         smb2_set_uint64(iov, 8, 0u);
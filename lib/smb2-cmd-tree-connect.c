@@ -64,6 +64,10 @@ smb2_encode_tree_connect_request(struct smb2_context *smb2,
         memset(buf, 0, len);
         
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
         
         smb2_set_uint16(iov, 0, SMB2_TREE_CONNECT_REQUEST_SIZE);
         smb2_set_uint16(iov, 2, req->flags);
@@ -83,6 +87,10 @@ smb2_encode_tree_connect_request(struct smb2_context *smb2,
                                 buf,
                                 req->path_length,
                                 free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         return 0;
 }
@@ -137,10 +145,10 @@ smb2_process_tree_connect_fixed(struct smb2_context *smb2,
                 return -1;
         }
 
-        smb2_get_uint8(&pdu->in.iov[0], 2, &rep->share_type);
-        smb2_get_uint32(&pdu->in.iov[0], 4, &rep->share_flags);
-        smb2_get_uint32(&pdu->in.iov[0], 4, &rep->capabilities);
-        smb2_get_uint32(&pdu->in.iov[0], 4, &rep->maximal_access);
+        smb2_get_uint8(iov, 2, &rep->share_type);
+        smb2_get_uint32(iov, 4, &rep->share_flags);
+        smb2_get_uint32(iov, 8, &rep->capabilities);
+        smb2_get_uint32(iov, 12, &rep->maximal_access);
 
         /* Update tree ID to use for future PDUs */
         smb2->tree_id = smb2->hdr.sync.tree_id;
@@ -63,6 +63,10 @@ smb2_encode_write_request(struct smb2_context *smb2,
         memset(buf, 0, len);
 
         iov = smb2_add_iovector(smb2, &pdu->out, buf, len, free);
+        if (iov == NULL) {
+                free(buf);
+                return -1;
+        }
 
         if (!smb2->supports_multi_credit && req->length > 60 * 1024) {
                 req->length = 60 * 1024;
@@ -103,8 +107,11 @@ smb2_cmd_write_async(struct smb2_context *smb2,
                 return NULL;
         }
 
-        smb2_add_iovector(smb2, &pdu->out, req->buf,
-                          req->length, NULL);
+        if (smb2_add_iovector(smb2, &pdu->out, req->buf,
+                              req->length, NULL) == NULL) {
+                smb2_free_pdu(smb2, pdu);
+                return NULL;
+        }
         
         if (smb2_pad_to_64bit(smb2, &pdu->out) != 0) {
                 smb2_free_pdu(smb2, pdu);
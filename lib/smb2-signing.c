@@ -51,12 +51,15 @@
 #include <unistd.h>
 #endif
 
+#include <time.h>
+
 #include "smb2-signing.h"
 
 #define EBC 1
 #define CBC 1
 
 #include "aes.h"
+#include "aes128gcm.h"
 #include "sha.h"
 #include "sha-private.h"
 
@@ -94,15 +97,15 @@ void aes_cmac_xor(
 
 static
 void aes_cmac_sub_keys(
-    uint8_t key[AES128_KEY_LEN],
+    const struct AES_ctx *ctx,
     uint8_t sub_key1[AES128_KEY_LEN],
     uint8_t sub_key2[AES128_KEY_LEN]
     )
 {
-        uint8_t zero[AES128_KEY_LEN] = {0};
         static const uint8_t rb[AES128_KEY_LEN] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0x87};
 
-        AES128_ECB_encrypt(zero, key, sub_key1);
+        memset(sub_key1, 0, AES128_KEY_LEN);
+        AES_ECB_encrypt(ctx, sub_key1);
         if (aes_cmac_shift_left(sub_key1)) {
                 aes_cmac_xor(sub_key1, rb);
         }
@@ -114,47 +117,280 @@ void aes_cmac_sub_keys(
         }
 }
 
-void smb3_aes_cmac_128(uint8_t key[AES128_KEY_LEN],
+/* Incremental AES-CMAC. The last block needs the sub key treatment so
+ * update always holds back the final 1..16 bytes it has seen in buf and
+ * only runs a block through the cipher once more data shows up behind it.
+ */
+struct smb3_cmac_ctx {
+        const struct AES_ctx *aes;
+        uint8_t sub_key1[AES128_KEY_LEN];
+        uint8_t sub_key2[AES128_KEY_LEN];
+        uint8_t mac[AES128_KEY_LEN];
+        uint8_t buf[AES128_KEY_LEN];
+        size_t buf_len;
+};
+
+static void
+smb3_aes_cmac_128_init(struct smb3_cmac_ctx *cmac,
+                       const struct AES_ctx *ctx)
+{
+        cmac->aes = ctx;
+        aes_cmac_sub_keys(ctx, cmac->sub_key1, cmac->sub_key2);
+        memset(cmac->mac, 0, AES128_KEY_LEN);
+        cmac->buf_len = 0;
+}
+
+static void
+smb3_aes_cmac_128_update(struct smb3_cmac_ctx *cmac,
+                         const uint8_t *msg, size_t len)
+{
+        size_t n;
+
+        if (len == 0) {
+                return;
+        }
+
+        if (cmac->buf_len > 0) {
+                n = MIN(AES128_KEY_LEN - cmac->buf_len, len);
+                memcpy(&cmac->buf[cmac->buf_len], msg, n);
+                cmac->buf_len += n;
+                msg += n;
+                len -= n;
+                if (len == 0) {
+                        return;
+                }
+                AES_CBC_MAC(cmac->aes, cmac->mac, cmac->buf, 1);
+                cmac->buf_len = 0;
+        }
+
+        /* Everything but the last, possibly partial, block */
+        n = (len - 1) / AES128_KEY_LEN;
+        AES_CBC_MAC(cmac->aes, cmac->mac, msg, n);
+        msg += n * AES128_KEY_LEN;
+        len -= n * AES128_KEY_LEN;
+
+        memcpy(cmac->buf, msg, len);
+        cmac->buf_len = len;
+}
+
+static void
+smb3_aes_cmac_128_final(struct smb3_cmac_ctx *cmac,
+                        uint8_t mac[AES128_KEY_LEN])
+{
+        if (cmac->buf_len == AES128_KEY_LEN) {
+                aes_cmac_xor(cmac->buf, cmac->sub_key1);
+        } else {
+                cmac->buf[cmac->buf_len] = 0x80;
+                memset(&cmac->buf[cmac->buf_len + 1], 0,
+                       AES128_KEY_LEN - (cmac->buf_len + 1));
+                aes_cmac_xor(cmac->buf, cmac->sub_key2);
+        }
+
+        AES_CBC_MAC(cmac->aes, cmac->mac, cmac->buf, 1);
+        memcpy(mac, cmac->mac, AES128_KEY_LEN);
+}
+
+void smb3_aes_cmac_128(const struct AES_ctx *ctx,
                    uint8_t * msg,
                    uint64_t msg_len,
                    uint8_t mac[AES128_KEY_LEN]
                   )
 {
-        uint8_t sub_key1[AES128_KEY_LEN] = {0};
-        uint8_t sub_key2[AES128_KEY_LEN] = {0};
-        uint8_t scratch[AES128_KEY_LEN] = {0};
-        uint64_t n = (msg_len + AES128_KEY_LEN - 1) / AES128_KEY_LEN;
-        uint64_t rem = msg_len % AES128_KEY_LEN;
-        uint64_t i = 0;
-        int is_last_block_complete = n != 0 && rem == 0;
+        struct smb3_cmac_ctx cmac;
+
+        smb3_aes_cmac_128_init(&cmac, ctx);
+        smb3_aes_cmac_128_update(&cmac, msg, msg_len);
+        smb3_aes_cmac_128_final(&cmac, mac);
+}
 
-        if (n == 0) {
-                n = 1;
+void
+smb3_update_preauth_hash(struct smb2_context *smb2,
+                         struct smb2_io_vectors *v, size_t offset)
+{
+        SHA512Context ctx;
+        int i;
+
+        SHA512Reset(&ctx);
+        SHA512Input(&ctx, smb2->preauth_hash, SMB2_PREAUTH_HASH_SIZE);
+        for (i = 0; i < v->niov; i++) {
+                if (offset >= v->iov[i].len) {
+                        offset -= v->iov[i].len;
+                        continue;
+                }
+                SHA512Input(&ctx, v->iov[i].buf + offset,
+                            v->iov[i].len - offset);
+                offset = 0;
         }
+        SHA512Result(&ctx, smb2->preauth_hash);
+}
 
-        aes_cmac_sub_keys(key, sub_key1, sub_key2);
+/* [MS-SMB2] 3.1.4.1, the AES-GMAC nonce is derived from the header.
+ * We never send CANCEL so the cancel bit of the nonce is never set.
+ */
+static void
+smb3_aes_gmac_nonce(struct smb2_header *hdr,
+                    uint8_t nonce[AES128GCM_NONCE_SIZE])
+{
+        struct smb2_iovec iov;
+        uint32_t role = 0;
 
-        memset(mac, 0, AES128_KEY_LEN);
+        if (hdr->flags & SMB2_FLAGS_SERVER_TO_REDIR) {
+                role |= 0x00000001;
+        }
 
-        for (i = 0; i < n - 1; i++) {
-                aes_cmac_xor(mac, &msg[i*AES128_KEY_LEN]);
-                AES128_ECB_encrypt(mac, key, scratch);
-                memcpy(mac, scratch, AES128_KEY_LEN);
+        iov.buf = nonce;
+        iov.len = AES128GCM_NONCE_SIZE;
+        iov.free = NULL;
+        smb2_set_uint64(&iov, 0, hdr->message_id);
+        smb2_set_uint32(&iov, 8, role);
+}
+
+/* The MAC for the dialect and signing algorithm of the session */
+struct smb2_mac_ctx {
+        int alg;
+        union {
+                HMACContext hmac;
+                struct smb3_cmac_ctx cmac;
+                struct aes128gcm_ctx gcm;
+        } u;
+};
+
+static int
+smb2_mac_init(struct smb2_context *smb2, struct smb2_mac_ctx *mac,
+              struct smb2_header *hdr)
+{
+        uint8_t nonce[AES128GCM_NONCE_SIZE];
+
+        if (smb2->dialect <= SMB2_VERSION_0210) {
+                mac->alg = SMB2_SIGNING_HMAC_SHA256;
+                /* The key never changes for the session so the pads
+                 * are hashed once and the state copied per message.
+                 */
+                if (smb2->signing_hmac == NULL) {
+                        smb2->signing_hmac = malloc(sizeof(HMACContext));
+                        if (smb2->signing_hmac == NULL) {
+                                smb2_set_error(smb2, "Failed to allocate "
+                                               "signing context");
+                                return -1;
+                        }
+                        hmacReset(smb2->signing_hmac, SHA256,
+                                  &smb2->signing_key[0], SMB2_KEY_SIZE);
+                }
+                mac->u.hmac = *smb2->signing_hmac;
+                return 0;
+        }
+
+        /* Expand the key once per session instead of per block */
+        if (smb2->signing_ctx == NULL) {
+                smb2->signing_ctx = malloc(sizeof(struct AES_ctx));
+                if (smb2->signing_ctx == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "signing context");
+                        return -1;
+                }
+                AES_init_ctx(smb2->signing_ctx, smb2->signing_key);
         }
 
-        if (is_last_block_complete) {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], AES128_KEY_LEN);
-                aes_cmac_xor(scratch, sub_key1);
+        if (smb2->signing_algorithm == SMB2_SIGNING_AES_GMAC) {
+                /* GMAC is GCM with the message as associated data and
+                 * no payload.
+                 */
+                mac->alg = SMB2_SIGNING_AES_GMAC;
+                smb3_aes_gmac_nonce(hdr, nonce);
+                aes128gcm_init(&mac->u.gcm, smb2->signing_ctx, nonce,
+                               NULL, 0);
         } else {
-                memcpy(scratch, &msg[i*AES128_KEY_LEN], rem);
-                scratch[rem] = 0x80;
-                memset(&scratch[rem + 1], 0, AES128_KEY_LEN - (rem + 1));
-                aes_cmac_xor(scratch, sub_key2);
+                mac->alg = SMB2_SIGNING_AES_CMAC;
+                smb3_aes_cmac_128_init(&mac->u.cmac, smb2->signing_ctx);
         }
+        return 0;
+}
 
-        aes_cmac_xor(mac, scratch);
-        AES128_ECB_encrypt(mac, key, scratch);
-        memcpy(mac, scratch, AES128_KEY_LEN);
+static void
+smb2_mac_update(struct smb2_mac_ctx *mac, const uint8_t *buf, size_t len)
+{
+        switch (mac->alg) {
+        case SMB2_SIGNING_HMAC_SHA256:
+                hmacInput(&mac->u.hmac, buf, len);
+                break;
+        case SMB2_SIGNING_AES_CMAC:
+                smb3_aes_cmac_128_update(&mac->u.cmac, buf, len);
+                break;
+        case SMB2_SIGNING_AES_GMAC:
+                aes128gcm_aad(&mac->u.gcm, buf, len);
+                break;
+        }
+}
+
+static void
+smb2_mac_final(struct smb2_mac_ctx *mac,
+               uint8_t signature[SMB2_SIGNATURE_SIZE])
+{
+        uint8_t digest[USHAMaxHashSize];
+
+        switch (mac->alg) {
+        case SMB2_SIGNING_HMAC_SHA256:
+                hmacResult(&mac->u.hmac, digest);
+                memcpy(signature, digest, SMB2_SIGNATURE_SIZE);
+                break;
+        case SMB2_SIGNING_AES_CMAC:
+                smb3_aes_cmac_128_final(&mac->u.cmac, signature);
+                break;
+        case SMB2_SIGNING_AES_GMAC:
+                aes128gcm_final(&mac->u.gcm, signature);
+                break;
+        }
+}
+
+/* Sign the message held in v, starting offset bytes in, straight from
+ * the vectors. The header must be a vector of its own and the signature
+ * field is treated as zero.
+ */
+static int
+smb2_calc_signature(struct smb2_context *smb2, struct smb2_header *hdr,
+                    struct smb2_io_vectors *v, size_t offset,
+                    uint8_t signature[SMB2_SIGNATURE_SIZE])
+{
+        static const uint8_t zero[SMB2_SIGNATURE_SIZE];
+        struct smb2_mac_ctx mac;
+        int i;
+
+        for (i = 0; i < v->niov && offset; i++) {
+                if (offset < v->iov[i].len) {
+                        break;
+                }
+                offset -= v->iov[i].len;
+        }
+        if (i == v->niov || offset ||
+            v->iov[i].len != SMB2_HEADER_SIZE) {
+                smb2_set_error(smb2, "Header is not a vector of its own");
+                return -1;
+        }
+
+        if (smb2_mac_init(smb2, &mac, hdr) < 0) {
+                return -1;
+        }
+        smb2_mac_update(&mac, v->iov[i].buf, 48);
+        smb2_mac_update(&mac, zero, SMB2_SIGNATURE_SIZE);
+        for (i++; i < v->niov; i++) {
+                smb2_mac_update(&mac, v->iov[i].buf, v->iov[i].len);
+        }
+        smb2_mac_final(&mac, signature);
+
+        return 0;
+}
+
+static uint64_t
+smb2_signing_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+        return 0;
+#endif
 }
 
 int
@@ -163,8 +399,8 @@ smb2_pdu_add_signature(struct smb2_context *smb2,
                        )
 {
         struct smb2_header *hdr = NULL;
-        uint8_t signature[16] = {0};
         struct smb2_iovec *iov = NULL;
+        uint64_t start;
 
         if (pdu->header.command == SMB2_SESSION_SETUP) {
                 return 0;
@@ -195,55 +431,62 @@ smb2_pdu_add_signature(struct smb2_context *smb2,
         /* sign the pdu and store the signature in pdu->header.signature
          * if pdu is signed then add SMB2_FLAGS_SIGNED to pdu->header.flags
          */
-
-        if (smb2->dialect > SMB2_VERSION_0210) {
-                int i = 0, offset = 0;
-                uint8_t aes_mac[AES_BLOCK_SIZE];
-                /* combine the buffers into one */
-                uint8_t *msg = NULL;
-                msg = (uint8_t *) malloc(4);
-                if (msg == NULL) {
-                        smb2_set_error(smb2, "Failed to allocate buffer");
-                        return -1;
-                }
-
-                for (i=0; i < pdu->out.niov; i++) {
-                        msg = (uint8_t *)realloc(msg, offset + pdu->out.iov[i].len);
-                        if (msg == NULL) {
-                                smb2_set_error(smb2, "Failed to allocate buffer");
-                                return -1;
-                        }
-                        memcpy(msg+offset, pdu->out.iov[i].buf, pdu->out.iov[i].len);
-                        offset += pdu->out.iov[i].len;
-                }
-                smb3_aes_cmac_128(smb2->signing_key, msg, offset, aes_mac);
-                free(msg);
-                memcpy(&signature[0], aes_mac, SMB2_SIGNATURE_SIZE);
-        } else {
-                HMACContext ctx;
-                uint8_t digest[USHAMaxHashSize];
-                int i;
-
-                hmacReset(&ctx, SHA256, &smb2->signing_key[0], SMB2_KEY_SIZE);
-                for (i=0; i < pdu->out.niov; i++) {
-                        hmacInput(&ctx,
-                                  pdu->out.iov[i].buf,
-                                  pdu->out.iov[i].len);
-                }
-                hmacResult(&ctx, digest);
-                memcpy(&signature[0], digest, SMB2_SIGNATURE_SIZE);
+        start = smb2_signing_ns();
+        if (smb2_calc_signature(smb2, hdr, &pdu->out, 0,
+                                hdr->signature) < 0) {
+                return -1;
         }
-
-        memcpy(&(hdr->signature[0]), signature, SMB2_SIGNATURE_SIZE);
         memcpy(iov->buf + 48, hdr->signature, 16);
+        smb2->sign_count++;
+        smb2->sign_ns += smb2_signing_ns() - start;
 
         return 0;
 }
 
+/* Verify the signature of the reply that was just read into smb2->in.
+ * READ data is verified where it landed in the application buffers.
+ */
 int
 smb2_pdu_check_signature(struct smb2_context *smb2,
                          struct smb2_pdu *pdu
                          )
 {
+        uint8_t signature[SMB2_SIGNATURE_SIZE];
+        uint8_t diff = 0;
+        size_t offset = smb2->payload_offset - SMB2_HEADER_SIZE;
+        uint64_t start;
+        int i;
+
+        start = smb2_signing_ns();
+        if (smb2_calc_signature(smb2, &smb2->hdr, &smb2->in, offset,
+                                signature) < 0) {
+                return -1;
+        }
+        for (i = 0; i < SMB2_SIGNATURE_SIZE; i++) {
+                diff |= signature[i] ^ smb2->hdr.signature[i];
+        }
+        smb2->verify_count++;
+        smb2->verify_bytes += smb2->in.num_done - offset;
+        smb2->verify_ns += smb2_signing_ns() - start;
+
+        if (diff) {
+                smb2->verify_failures++;
+                smb2_set_error(smb2, "Bad signature on reply to command %d "
+                               "message id %llu", pdu->header.command,
+                               (unsigned long long)smb2->hdr.message_id);
+                return -1;
+        }
         return 0;
 }
+
+void
+smb2_get_signing_stats(struct smb2_context *smb2,
+                       struct smb2_signing_stats *stats)
+{
+        stats->sign_count = smb2->sign_count;
+        stats->sign_ns = smb2->sign_ns;
+        stats->verify_count = smb2->verify_count;
+        stats->verify_failures = smb2->verify_failures;
+        stats->verify_bytes = smb2->verify_bytes;
+        stats->verify_ns = smb2->verify_ns;
+}
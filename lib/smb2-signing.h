@@ -40,6 +40,13 @@ int
 smb2_pdu_add_signature(struct smb2_context *smb2,
                        struct smb2_pdu *pdu);
 
+/* Chain the message in v, starting offset bytes in, into the preauth
+ * integrity hash.
+ */
+void
+smb3_update_preauth_hash(struct smb2_context *smb2,
+                         struct smb2_io_vectors *v, size_t offset);
+
 int
 smb2_pdu_check_signature(struct smb2_context *smb2,
                          struct smb2_pdu *pdu);
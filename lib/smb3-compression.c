@@ -0,0 +1,541 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * SMB 3.1.1 compression, [MS-SMB2] 2.2.42 and 3.1.4.4.
+ *
+ * A compressed message starts with a COMPRESSION_TRANSFORM_HEADER. In the
+ * unchained form the first Offset bytes of the message follow as is and
+ * the rest is compressed with a single algorithm. In the chained form the
+ * message is a sequence of payloads, each with its own algorithm, which
+ * lets us send the SMB2 header uncompressed, runs of identical bytes as
+ * Pattern_V1 and the rest with LZ77 or LZ77+Huffman.
+ *
+ * Only WRITE requests are compressed, into the crypt buffer of the PDU so
+ * that encryption, if any, is applied on top of the compressed message.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef STDC_HEADERS
+#include <stddef.h>
+#endif
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#include "lzxpress.h"
+#include "smb3-compression.h"
+
+/* Offsets into the COMPRESSION_TRANSFORM_HEADER */
+#define SMB3_CTH_ORIGINAL_SIZE  4
+#define SMB3_CTH_ALGORITHM      8
+#define SMB3_CTH_FLAGS          10
+#define SMB3_CTH_OFFSET         12
+
+/* The chained form has the first payload header in place of the
+ * Algorithm, Flags and Offset fields.
+ */
+#define SMB3_CTH_CHAINED_SIZE   8
+#define SMB3_PAYLOAD_HEADER_SIZE 8
+#define SMB3_PATTERN_V1_SIZE    8
+
+#define SMB3_COMPRESSION_FLAG_CHAINED 0x0001
+
+/* Runs of identical bytes at least this long are sent as Pattern_V1 */
+#define SMB3_PATTERN_MIN_RUN    256
+
+/* Header and fixed part of a WRITE request, which are sent as is */
+#define SMB3_WRITE_PREFIX (SMB2_HEADER_SIZE + \
+                           (SMB2_WRITE_REQUEST_SIZE & 0xfffffffe))
+
+struct smb3_chain {
+        uint16_t algorithm;
+        struct smb2_iovec out;
+        size_t pos;
+};
+
+static uint16_t
+smb3_send_algorithm(struct smb2_context *smb2)
+{
+        if (smb2->compression_algorithms & (1 << SMB2_COMPRESSION_LZ77)) {
+                return SMB2_COMPRESSION_LZ77;
+        }
+        if (smb2->compression_algorithms &
+            (1 << SMB2_COMPRESSION_LZ77_HUFFMAN)) {
+                return SMB2_COMPRESSION_LZ77_HUFFMAN;
+        }
+        return SMB2_COMPRESSION_NONE;
+}
+
+static int
+smb3_compress(uint16_t algorithm, const uint8_t *in, size_t in_len,
+              uint8_t *out, size_t out_len)
+{
+        if (algorithm == SMB2_COMPRESSION_LZ77_HUFFMAN) {
+                return lzxpress_huffman_compress(in, in_len, out, out_len);
+        }
+        return lzxpress_compress(in, in_len, out, out_len);
+}
+
+static int
+smb3_decompress(uint16_t algorithm, const uint8_t *in, size_t in_len,
+                uint8_t *out, size_t out_len)
+{
+        if (algorithm == SMB2_COMPRESSION_LZ77_HUFFMAN) {
+                return lzxpress_huffman_decompress(in, in_len, out, out_len);
+        }
+        return lzxpress_decompress(in, in_len, out, out_len);
+}
+
+static int
+smb3_chain_header(struct smb3_chain *c, uint16_t algorithm, size_t len)
+{
+        if (c->out.len - c->pos < SMB3_PAYLOAD_HEADER_SIZE + len) {
+                return -1;
+        }
+        smb2_set_uint16(&c->out, c->pos, algorithm);
+        smb2_set_uint16(&c->out, c->pos + 2, SMB3_COMPRESSION_FLAG_CHAINED);
+        smb2_set_uint32(&c->out, c->pos + 4, len);
+        c->pos += SMB3_PAYLOAD_HEADER_SIZE;
+        return 0;
+}
+
+static int
+smb3_chain_none(struct smb3_chain *c, const uint8_t *in, size_t len)
+{
+        if (len == 0) {
+                return 0;
+        }
+        if (smb3_chain_header(c, SMB2_COMPRESSION_NONE, len) < 0) {
+                return -1;
+        }
+        memcpy(c->out.buf + c->pos, in, len);
+        c->pos += len;
+        return 0;
+}
+
+static int
+smb3_chain_pattern(struct smb3_chain *c, uint8_t pattern, size_t len)
+{
+        if (smb3_chain_header(c, SMB2_COMPRESSION_PATTERN_V1,
+                              SMB3_PATTERN_V1_SIZE) < 0) {
+                return -1;
+        }
+        smb2_set_uint8(&c->out, c->pos, pattern);
+        smb2_set_uint8(&c->out, c->pos + 1, 0);
+        smb2_set_uint16(&c->out, c->pos + 2, 0);
+        smb2_set_uint32(&c->out, c->pos + 4, len);
+        c->pos += SMB3_PATTERN_V1_SIZE;
+        return 0;
+}
+
+/* Compress a span, or send it as is if it does not get smaller */
+static int
+smb3_chain_data(struct smb3_chain *c, const uint8_t *in, size_t len)
+{
+        size_t room;
+        int n = -1;
+
+        if (len == 0) {
+                return 0;
+        }
+        room = c->out.len - c->pos;
+        /* OriginalPayloadSize plus the compressed data must beat the
+         * plain span.
+         */
+        if (len > 4 && room > SMB3_PAYLOAD_HEADER_SIZE + 4) {
+                room -= SMB3_PAYLOAD_HEADER_SIZE + 4;
+                if (room > len - 4) {
+                        room = len - 4;
+                }
+                n = smb3_compress(c->algorithm, in, len,
+                                  c->out.buf + c->pos +
+                                  SMB3_PAYLOAD_HEADER_SIZE + 4, room);
+        }
+        if (n < 0 || (size_t)n >= len - 4) {
+                return smb3_chain_none(c, in, len);
+        }
+
+        smb3_chain_header(c, c->algorithm, 4 + n);
+        smb2_set_uint32(&c->out, c->pos, len);
+        c->pos += 4 + n;
+        return 0;
+}
+
+/* Split the data into runs of identical bytes, sent as Pattern_V1, and
+ * the spans in between. Positions are probed a half run apart so that
+ * every run of SMB3_PATTERN_MIN_RUN or more covers at least one of them.
+ */
+static int
+smb3_chain_runs(struct smb3_chain *c, const uint8_t *in, size_t len)
+{
+        const uint8_t *span = in, *p = in, *end = in + len;
+        const uint8_t *start;
+        size_t run;
+
+        while (end - p >= SMB3_PATTERN_MIN_RUN / 2) {
+                if (p[0] != p[SMB3_PATTERN_MIN_RUN / 2 - 1]) {
+                        p += SMB3_PATTERN_MIN_RUN / 2;
+                        continue;
+                }
+                run = lzxpress_run_length(p, end);
+                start = p;
+                while (start > span && start[-1] == p[0]) {
+                        start--;
+                }
+                run += p - start;
+                if (run < SMB3_PATTERN_MIN_RUN) {
+                        p += SMB3_PATTERN_MIN_RUN / 2;
+                        continue;
+                }
+                if (smb3_chain_data(c, span, start - span) < 0 ||
+                    smb3_chain_pattern(c, start[0], run) < 0) {
+                        return -1;
+                }
+                span = p = start + run;
+        }
+
+        return smb3_chain_data(c, span, end - span);
+}
+
+int
+smb3_compress_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb3_chain c;
+        struct smb2_iovec *data;
+        uint8_t *tail = NULL;
+        size_t total, tail_len;
+        int i, n;
+
+        if (smb2->compression_threshold == 0 || pdu->next_compound ||
+            pdu->header.command != SMB2_WRITE || pdu->out.niov < 3) {
+                return 0;
+        }
+        c.algorithm = smb3_send_algorithm(smb2);
+        data = &pdu->out.iov[2];
+        if (c.algorithm == SMB2_COMPRESSION_NONE ||
+            data->len < smb2->compression_threshold ||
+            pdu->out.iov[0].len + pdu->out.iov[1].len != SMB3_WRITE_PREFIX) {
+                return 0;
+        }
+
+        /* Anything that is not smaller than the plain message is useless */
+        total = pdu->out.total_size;
+        if (total <= SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE +
+            SMB3_WRITE_PREFIX) {
+                return 0;
+        }
+        c.out.buf = malloc(total);
+        if (c.out.buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate compression "
+                               "buffer");
+                return -1;
+        }
+        c.out.len = total;
+        c.out.free = NULL;
+        memset(c.out.buf, 0, SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE);
+        c.out.buf[0] = 0xFC;
+        c.out.buf[1] = 'S';
+        c.out.buf[2] = 'M';
+        c.out.buf[3] = 'B';
+
+        if (smb2->compression_chained) {
+                smb2_set_uint32(&c.out, SMB3_CTH_ORIGINAL_SIZE, total);
+                c.pos = SMB3_CTH_CHAINED_SIZE;
+                if (smb3_chain_header(&c, SMB2_COMPRESSION_NONE,
+                                      SMB3_WRITE_PREFIX) < 0) {
+                        goto plain;
+                }
+                memcpy(c.out.buf + c.pos, pdu->out.iov[0].buf,
+                       pdu->out.iov[0].len);
+                memcpy(c.out.buf + c.pos + pdu->out.iov[0].len,
+                       pdu->out.iov[1].buf, pdu->out.iov[1].len);
+                c.pos += SMB3_WRITE_PREFIX;
+
+                if (smb2->compression_algorithms &
+                    (1 << SMB2_COMPRESSION_PATTERN_V1)) {
+                        n = smb3_chain_runs(&c, data->buf, data->len);
+                } else {
+                        n = smb3_chain_data(&c, data->buf, data->len);
+                }
+                if (n < 0) {
+                        goto plain;
+                }
+                for (i = 3; i < pdu->out.niov; i++) {
+                        if (smb3_chain_none(&c, pdu->out.iov[i].buf,
+                                            pdu->out.iov[i].len) < 0) {
+                                goto plain;
+                        }
+                }
+        } else {
+                /* Everything after the fixed part is compressed in one
+                 * go so it has to be contiguous.
+                 */
+                tail_len = total - SMB3_WRITE_PREFIX;
+                if (pdu->out.niov > 3) {
+                        tail = malloc(tail_len);
+                        if (tail == NULL) {
+                                goto plain;
+                        }
+                        n = 0;
+                        for (i = 2; i < pdu->out.niov; i++) {
+                                memcpy(tail + n, pdu->out.iov[i].buf,
+                                       pdu->out.iov[i].len);
+                                n += pdu->out.iov[i].len;
+                        }
+                }
+
+                smb2_set_uint32(&c.out, SMB3_CTH_ORIGINAL_SIZE, tail_len);
+                smb2_set_uint16(&c.out, SMB3_CTH_ALGORITHM, c.algorithm);
+                smb2_set_uint32(&c.out, SMB3_CTH_OFFSET, SMB3_WRITE_PREFIX);
+                c.pos = SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE;
+                memcpy(c.out.buf + c.pos, pdu->out.iov[0].buf,
+                       pdu->out.iov[0].len);
+                memcpy(c.out.buf + c.pos + pdu->out.iov[0].len,
+                       pdu->out.iov[1].buf, pdu->out.iov[1].len);
+                c.pos += SMB3_WRITE_PREFIX;
+
+                n = smb3_compress(c.algorithm, tail ? tail : data->buf,
+                                  tail_len, c.out.buf + c.pos,
+                                  c.out.len - c.pos - 1);
+                free(tail);
+                if (n < 0) {
+                        goto plain;
+                }
+                c.pos += n;
+        }
+        if (c.pos >= total) {
+                goto plain;
+        }
+
+        pdu->crypt = c.out.buf;
+        pdu->crypt_len = c.pos;
+        return 0;
+
+ plain:
+        free(c.out.buf);
+        return 0;
+}
+
+static int
+smb3_check_algorithm(struct smb2_context *smb2, uint16_t algorithm)
+{
+        switch (algorithm) {
+        case SMB2_COMPRESSION_LZ77:
+        case SMB2_COMPRESSION_LZ77_HUFFMAN:
+        case SMB2_COMPRESSION_PATTERN_V1:
+                if (smb2->compression_algorithms & (1 << algorithm)) {
+                        return 0;
+                }
+        }
+        smb2_set_error(smb2, "Compressed message uses algorithm 0x%04x "
+                       "that was not negotiated", algorithm);
+        return -1;
+}
+
+int
+smb3_decompressed_size(struct smb2_context *smb2, const uint8_t *buf,
+                       size_t len, size_t *size)
+{
+        struct smb2_iovec iov;
+        uint32_t original_size, offset;
+        uint64_t max;
+        uint16_t flags;
+
+        if (smb2->compression_algorithms == 0) {
+                smb2_set_error(smb2, "Received compressed message but "
+                               "compression was not negotiated");
+                return -1;
+        }
+        if (len < SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE) {
+                smb2_set_error(smb2, "Compressed message too short");
+                return -1;
+        }
+
+        iov.buf = discard_const(buf);
+        iov.len = len;
+        iov.free = NULL;
+        smb2_get_uint32(&iov, SMB3_CTH_ORIGINAL_SIZE, &original_size);
+        smb2_get_uint16(&iov, SMB3_CTH_FLAGS, &flags);
+        smb2_get_uint32(&iov, SMB3_CTH_OFFSET, &offset);
+
+        max = smb2_max_message_size(smb2);
+
+        if (flags & SMB3_COMPRESSION_FLAG_CHAINED) {
+                if (!smb2->compression_chained) {
+                        smb2_set_error(smb2, "Received chained compressed "
+                                       "message but chaining was not "
+                                       "negotiated");
+                        return -1;
+                }
+                offset = 0;
+        } else if (offset > max) {
+                smb2_set_error(smb2, "Invalid compressed message offset");
+                return -1;
+        }
+        if (original_size > max - offset) {
+                smb2_set_error(smb2, "Compressed message too large");
+                return -1;
+        }
+
+        *size = original_size + offset;
+        return 0;
+}
+
+static int
+smb3_decompress_chained(struct smb2_context *smb2, struct smb2_iovec *iov,
+                        uint8_t *out, size_t out_len)
+{
+        uint32_t pos = SMB3_CTH_CHAINED_SIZE, length, size;
+        uint16_t algorithm;
+        size_t done = 0;
+        uint8_t pattern;
+        int n;
+
+        while (pos < iov->len) {
+                if (iov->len - pos < SMB3_PAYLOAD_HEADER_SIZE) {
+                        goto truncated;
+                }
+                smb2_get_uint16(iov, pos, &algorithm);
+                smb2_get_uint32(iov, pos + 4, &length);
+                pos += SMB3_PAYLOAD_HEADER_SIZE;
+                if (length > iov->len - pos) {
+                        goto truncated;
+                }
+
+                switch (algorithm) {
+                case SMB2_COMPRESSION_NONE:
+                        if (length > out_len - done) {
+                                goto overflow;
+                        }
+                        memcpy(out + done, iov->buf + pos, length);
+                        done += length;
+                        break;
+                case SMB2_COMPRESSION_PATTERN_V1:
+                        if (smb3_check_algorithm(smb2, algorithm) < 0) {
+                                return -1;
+                        }
+                        if (length < SMB3_PATTERN_V1_SIZE) {
+                                goto truncated;
+                        }
+                        smb2_get_uint8(iov, pos, &pattern);
+                        smb2_get_uint32(iov, pos + 4, &size);
+                        if (size > out_len - done) {
+                                goto overflow;
+                        }
+                        memset(out + done, pattern, size);
+                        done += size;
+                        break;
+                default:
+                        if (smb3_check_algorithm(smb2, algorithm) < 0) {
+                                return -1;
+                        }
+                        if (length < 4) {
+                                goto truncated;
+                        }
+                        smb2_get_uint32(iov, pos, &size);
+                        if (size > out_len - done) {
+                                goto overflow;
+                        }
+                        n = smb3_decompress(algorithm, iov->buf + pos + 4,
+                                            length - 4, out + done, size);
+                        if (n < 0 || (uint32_t)n != size) {
+                                smb2_set_error(smb2, "Failed to decompress "
+                                               "message");
+                                return -1;
+                        }
+                        done += size;
+                }
+                pos += length;
+        }
+
+        if (done != out_len) {
+                smb2_set_error(smb2, "Compressed message size mismatch");
+                return -1;
+        }
+        return 0;
+
+ truncated:
+        smb2_set_error(smb2, "Truncated compressed payload");
+        return -1;
+ overflow:
+        smb2_set_error(smb2, "Compressed message size mismatch");
+        return -1;
+}
+
+int
+smb3_decompress_pdu(struct smb2_context *smb2, const uint8_t *buf,
+                    size_t len, uint8_t *out, size_t out_len)
+{
+        struct smb2_iovec iov;
+        uint32_t offset;
+        uint16_t algorithm, flags;
+        int n;
+
+        iov.buf = discard_const(buf);
+        iov.len = len;
+        iov.free = NULL;
+        smb2_get_uint16(&iov, SMB3_CTH_FLAGS, &flags);
+        if (flags & SMB3_COMPRESSION_FLAG_CHAINED) {
+                return smb3_decompress_chained(smb2, &iov, out, out_len);
+        }
+
+        smb2_get_uint16(&iov, SMB3_CTH_ALGORITHM, &algorithm);
+        smb2_get_uint32(&iov, SMB3_CTH_OFFSET, &offset);
+        if (algorithm == SMB2_COMPRESSION_PATTERN_V1 ||
+            smb3_check_algorithm(smb2, algorithm) < 0) {
+                smb2_set_error(smb2, "Invalid algorithm 0x%04x for an "
+                               "unchained compressed message", algorithm);
+                return -1;
+        }
+        if (offset > len - SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE) {
+                smb2_set_error(smb2, "Invalid compressed message offset");
+                return -1;
+        }
+
+        memcpy(out, buf + SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE, offset);
+        n = smb3_decompress(algorithm,
+                            buf + SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE +
+                            offset,
+                            len - SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE -
+                            offset, out + offset, out_len - offset);
+        if (n < 0 || (size_t)n != out_len - offset) {
+                smb2_set_error(smb2, "Failed to decompress message");
+                return -1;
+        }
+
+        return 0;
+}
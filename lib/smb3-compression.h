@@ -0,0 +1,52 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SMB3_COMPRESSION_H_
+#define _SMB3_COMPRESSION_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compress the chain starting at pdu into pdu->crypt, COMPRESSION_TRANSFORM
+ * header included, if compression was negotiated and the chain is a large
+ * enough WRITE. The chain is left alone if it does not get any smaller.
+ */
+int
+smb3_compress_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
+
+/* Size of the message that the compressed message buf of len bytes, of
+ * which at least the first SMB2_COMPRESSION_TRANSFORM_HEADER_SIZE are
+ * needed, decompresses to.
+ */
+int
+smb3_decompressed_size(struct smb2_context *smb2, const uint8_t *buf,
+                       size_t len, size_t *size);
+
+/* Decompress the compressed message buf of len bytes into the out_len
+ * bytes at out, out_len being what smb3_decompressed_size() returned.
+ */
+int
+smb3_decompress_pdu(struct smb2_context *smb2, const uint8_t *buf,
+                    size_t len, uint8_t *out, size_t out_len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMB3_COMPRESSION_H_ */
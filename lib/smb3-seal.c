@@ -0,0 +1,278 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * SMB 3.x encryption, [MS-SMB2] 3.1.4.3 and 3.1.4.4.
+ *
+ * An encrypted chain is sent as a 52 byte TRANSFORM_HEADER followed by
+ * the ciphertext of the whole compound. The header from the nonce onwards
+ * is the associated data and the signature field holds the tag.
+ *
+ * Outgoing chains are encrypted straight from the PDU vectors, or from
+ * the compressed chain if there is one, into a single buffer. The vectors
+ * can not be encrypted in place since a WRITE references the application's
+ * buffer. Incoming chains are decrypted in place in the receive buffer.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef STDC_HEADERS
+#include <stddef.h>
+#endif
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#include "aes.h"
+#include "aes128ccm.h"
+#include "aes128gcm.h"
+#include "smb3-seal.h"
+
+#define SMB3_CCM_NONCE_SIZE 11
+
+/* Offsets into the TRANSFORM_HEADER */
+#define SMB3_TH_SIGNATURE   4
+#define SMB3_TH_NONCE       20
+#define SMB3_TH_MSG_SIZE    36
+#define SMB3_TH_FLAGS       42
+#define SMB3_TH_SESSION_ID  44
+#define SMB3_TH_AAD_SIZE    (SMB2_TRANSFORM_HEADER_SIZE - SMB3_TH_NONCE)
+
+static int
+smb3_init_seal_ctx(struct smb2_context *smb2)
+{
+        if (smb2->serverin_ctx != NULL) {
+                return 0;
+        }
+        if (!smb2->have_seal_keys) {
+                smb2_set_error(smb2, "No encryption keys for this session");
+                return -1;
+        }
+
+        smb2->serverin_ctx = malloc(sizeof(struct AES_ctx));
+        smb2->serverout_ctx = malloc(sizeof(struct AES_ctx));
+        if (smb2->serverin_ctx == NULL || smb2->serverout_ctx == NULL) {
+                free(smb2->serverin_ctx);
+                free(smb2->serverout_ctx);
+                smb2->serverin_ctx = smb2->serverout_ctx = NULL;
+                smb2_set_error(smb2, "Failed to allocate encryption "
+                               "context");
+                return -1;
+        }
+        AES_init_ctx(smb2->serverin_ctx, smb2->serverin_key);
+        AES_init_ctx(smb2->serverout_ctx, smb2->serverout_key);
+
+        return 0;
+}
+
+void
+smb3_free_seal_keys(struct smb2_context *smb2)
+{
+        free(smb2->serverin_ctx);
+        free(smb2->serverout_ctx);
+        smb2->serverin_ctx = smb2->serverout_ctx = NULL;
+        memset(smb2->serverin_key, 0, SMB2_KEY_SIZE);
+        memset(smb2->serverout_key, 0, SMB2_KEY_SIZE);
+        smb2->have_seal_keys = 0;
+}
+
+static void
+smb3_encrypt_vectors_gcm(struct aes128gcm_ctx *gcm, struct smb2_io_vectors *v,
+                         uint8_t **out)
+{
+        int i;
+
+        for (i = 0; i < v->niov; i++) {
+                aes128gcm_encrypt(gcm, v->iov[i].buf, *out, v->iov[i].len);
+                *out += v->iov[i].len;
+        }
+}
+
+static void
+smb3_encrypt_vectors_ccm(struct aes128ccm_ctx *ccm, struct smb2_io_vectors *v,
+                         uint8_t **out)
+{
+        int i;
+
+        for (i = 0; i < v->niov; i++) {
+                aes128ccm_encrypt(ccm, v->iov[i].buf, *out, v->iov[i].len);
+                *out += v->iov[i].len;
+        }
+}
+
+int
+smb3_encrypt_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_pdu *p;
+        struct smb2_iovec iov;
+        uint8_t *crypt, *out;
+        size_t spl = 0;
+
+        if (smb3_init_seal_ctx(smb2) < 0) {
+                return -1;
+        }
+
+        if (pdu->crypt != NULL) {
+                /* Compressed already, encrypt the compressed chain */
+                spl = pdu->crypt_len;
+        } else {
+                for (p = pdu; p; p = p->next_compound) {
+                        spl += p->out.total_size;
+                }
+        }
+
+        crypt = malloc(SMB2_TRANSFORM_HEADER_SIZE + spl);
+        if (crypt == NULL) {
+                smb2_set_error(smb2, "Failed to allocate encryption buffer");
+                return -1;
+        }
+
+        iov.buf = crypt;
+        iov.len = SMB2_TRANSFORM_HEADER_SIZE;
+        iov.free = NULL;
+        memset(crypt, 0, SMB2_TRANSFORM_HEADER_SIZE);
+        crypt[0] = 0xFD;
+        crypt[1] = 'S';
+        crypt[2] = 'M';
+        crypt[3] = 'B';
+        /* A nonce must never be reused with the same key */
+        smb2_set_uint64(&iov, SMB3_TH_NONCE, smb2->seal_nonce++);
+        smb2_set_uint32(&iov, SMB3_TH_MSG_SIZE, spl);
+        smb2_set_uint16(&iov, SMB3_TH_FLAGS, 0x0001);
+        smb2_set_uint64(&iov, SMB3_TH_SESSION_ID, smb2->session_id);
+
+        out = crypt + SMB2_TRANSFORM_HEADER_SIZE;
+        if (smb2->cipher == SMB2_ENCRYPTION_AES128_GCM) {
+                struct aes128gcm_ctx gcm;
+
+                aes128gcm_init(&gcm, smb2->serverin_ctx,
+                               &crypt[SMB3_TH_NONCE],
+                               &crypt[SMB3_TH_NONCE], SMB3_TH_AAD_SIZE);
+                if (pdu->crypt != NULL) {
+                        aes128gcm_encrypt(&gcm, pdu->crypt, out, spl);
+                } else {
+                        for (p = pdu; p; p = p->next_compound) {
+                                smb3_encrypt_vectors_gcm(&gcm, &p->out, &out);
+                        }
+                }
+                aes128gcm_final(&gcm, &crypt[SMB3_TH_SIGNATURE]);
+        } else {
+                struct aes128ccm_ctx ccm;
+
+                aes128ccm_init(&ccm, smb2->serverin_ctx,
+                               &crypt[SMB3_TH_NONCE], SMB3_CCM_NONCE_SIZE,
+                               &crypt[SMB3_TH_NONCE], SMB3_TH_AAD_SIZE, spl);
+                if (pdu->crypt != NULL) {
+                        aes128ccm_encrypt(&ccm, pdu->crypt, out, spl);
+                } else {
+                        for (p = pdu; p; p = p->next_compound) {
+                                smb3_encrypt_vectors_ccm(&ccm, &p->out, &out);
+                        }
+                }
+                aes128ccm_final(&ccm, &crypt[SMB3_TH_SIGNATURE]);
+        }
+
+        free(pdu->crypt);
+        pdu->crypt = crypt;
+        pdu->crypt_len = SMB2_TRANSFORM_HEADER_SIZE + spl;
+
+        return 0;
+}
+
+int
+smb3_decrypt_pdu(struct smb2_context *smb2, const uint8_t *hdr,
+                 uint8_t *buf, size_t len)
+{
+        struct smb2_iovec iov;
+        uint8_t tag[16];
+        uint8_t diff = 0;
+        uint64_t session_id;
+        uint32_t msg_size;
+        uint16_t flags;
+        int i;
+
+        iov.buf = discard_const(hdr);
+        iov.len = SMB2_TRANSFORM_HEADER_SIZE;
+        iov.free = NULL;
+        smb2_get_uint32(&iov, SMB3_TH_MSG_SIZE, &msg_size);
+        smb2_get_uint16(&iov, SMB3_TH_FLAGS, &flags);
+        smb2_get_uint64(&iov, SMB3_TH_SESSION_ID, &session_id);
+
+        if (flags != 0x0001) {
+                smb2_set_error(smb2, "Unknown TRANSFORM_HEADER flags 0x%04x",
+                               flags);
+                return -1;
+        }
+        if (session_id != smb2->session_id) {
+                smb2_set_error(smb2, "Encrypted message for unknown session");
+                return -1;
+        }
+        if (msg_size != len) {
+                smb2_set_error(smb2, "Encrypted message size mismatch");
+                return -1;
+        }
+        if (smb3_init_seal_ctx(smb2) < 0) {
+                return -1;
+        }
+
+        if (smb2->cipher == SMB2_ENCRYPTION_AES128_GCM) {
+                struct aes128gcm_ctx gcm;
+
+                aes128gcm_init(&gcm, smb2->serverout_ctx,
+                               &hdr[SMB3_TH_NONCE],
+                               &hdr[SMB3_TH_NONCE], SMB3_TH_AAD_SIZE);
+                aes128gcm_decrypt(&gcm, buf, buf, len);
+                aes128gcm_final(&gcm, tag);
+        } else {
+                struct aes128ccm_ctx ccm;
+
+                aes128ccm_init(&ccm, smb2->serverout_ctx,
+                               &hdr[SMB3_TH_NONCE], SMB3_CCM_NONCE_SIZE,
+                               &hdr[SMB3_TH_NONCE], SMB3_TH_AAD_SIZE, len);
+                aes128ccm_decrypt(&ccm, buf, buf, len);
+                aes128ccm_final(&ccm, tag);
+        }
+
+        for (i = 0; i < 16; i++) {
+                diff |= tag[i] ^ hdr[SMB3_TH_SIGNATURE + i];
+        }
+        if (diff) {
+                smb2_set_error(smb2, "Encrypted message failed "
+                               "verification");
+                return -1;
+        }
+
+        return 0;
+}
@@ -0,0 +1,48 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _SMB3_SEAL_H_
+#define _SMB3_SEAL_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Encrypt the chain starting at pdu into pdu->crypt, TRANSFORM_HEADER
+ * included. If pdu->crypt already holds the compressed chain that is
+ * what gets encrypted.
+ */
+int
+smb3_encrypt_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu);
+
+/* Decrypt the len bytes following the TRANSFORM_HEADER hdr in place and
+ * verify the signature.
+ */
+int
+smb3_decrypt_pdu(struct smb2_context *smb2, const uint8_t *hdr,
+                 uint8_t *buf, size_t len);
+
+/* Forget the encryption keys of the session */
+void
+smb3_free_seal_keys(struct smb2_context *smb2);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _SMB3_SEAL_H_ */
@@ -68,10 +68,23 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <sys/time.h>
+#include <linux/errqueue.h>
+#endif
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(MSG_ZEROCOPY) && \
+    defined(SO_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_ZEROCOPY
+#endif
+
 #include "slist.h"
 #include "smb2.h"
 #include "libsmb2.h"
 #include "libsmb2-private.h"
+#include "smb2-signing.h"
+#include "smb3-compression.h"
+#include "smb3-seal.h"
 
 #define MAX_URL_SIZE 256
 
@@ -88,24 +101,392 @@ smb2_get_credit_charge(struct smb2_context *smb2, struct smb2_pdu *pdu)
         return credits;
 }
 
+/* Where the file id is in the body of the commands that can be sent ahead
+ * of a chain waiting for credits. 0 if the command has no file id and -1
+ * if it must always be sent in order.
+ */
+static int
+smb2_file_id_offset(enum smb2_command command)
+{
+        switch (command) {
+        case SMB2_CREATE:
+        case SMB2_ECHO:
+                return 0;
+        case SMB2_CLOSE:
+        case SMB2_FLUSH:
+        case SMB2_IOCTL:
+        case SMB2_QUERY_DIRECTORY:
+                return 8;
+        case SMB2_READ:
+        case SMB2_WRITE:
+        case SMB2_SET_INFO:
+                return 16;
+        case SMB2_QUERY_INFO:
+                return 24;
+        default:
+                return -1;
+        }
+}
+
+/* Can the commands in the chain be sent out of order? */
+static int
+smb2_can_reorder(struct smb2_pdu *pdu)
+{
+        for (; pdu; pdu = pdu->next_compound) {
+                if (smb2_file_id_offset(pdu->header.command) < 0) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* Does any PDU in the chain use the file id? */
+static int
+smb2_chain_uses_file_id(struct smb2_pdu *pdu, const uint8_t *file_id)
+{
+        int offset;
+
+        for (; pdu; pdu = pdu->next_compound) {
+                offset = smb2_file_id_offset(pdu->header.command);
+                if (offset <= 0 || pdu->out.niov < 2 ||
+                    pdu->out.iov[1].len < (size_t)offset + SMB2_FD_SIZE) {
+                        continue;
+                }
+                if (!memcmp(pdu->out.iov[1].buf + offset, file_id,
+                            SMB2_FD_SIZE)) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* Can the chain be sent ahead of all the chains from head up to it? Only
+ * commands on open handles and CREATE may go early, and never ahead of a
+ * chain that uses one of the same handles.
+ */
+static int
+smb2_can_bypass(struct smb2_pdu *head, struct smb2_pdu *chain)
+{
+        static const uint8_t related_id[SMB2_FD_SIZE] = {
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+                0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+        };
+        struct smb2_pdu *pdu, *p;
+        const uint8_t *file_id;
+        int offset;
+
+        if (!smb2_can_reorder(chain)) {
+                return 0;
+        }
+        for (pdu = chain; pdu; pdu = pdu->next_compound) {
+                offset = smb2_file_id_offset(pdu->header.command);
+                if (offset == 0 || pdu->out.niov < 2 ||
+                    pdu->out.iov[1].len < (size_t)offset + SMB2_FD_SIZE) {
+                        continue;
+                }
+                file_id = pdu->out.iov[1].buf + offset;
+                if (!memcmp(file_id, related_id, SMB2_FD_SIZE)) {
+                        continue;
+                }
+                for (p = head; p != chain; p = p->next) {
+                        if (smb2_chain_uses_file_id(p, file_id)) {
+                                return 0;
+                        }
+                }
+        }
+        return 1;
+}
+
+/* Pick the chain to send next. A chain that is partially written must be
+ * finished first. Otherwise it is the first chain we have the credits for
+ * so that small requests are not blocked behind a large one that has to
+ * wait for credits. Message ids are only assigned when a chain is sent so
+ * the chains sent early still take the next ids in the granted window.
+ * A chain can only be bypassed SMB2_MAX_CREDIT_BYPASS times so that it is
+ * not starved, and a chain that was skipped is never overtaken by one that
+ * depends on it.
+ */
+static struct smb2_pdu *
+smb2_next_to_send(struct smb2_context *smb2, int update_stats)
+{
+        struct smb2_pdu *head = smb2->outqueue.head;
+        struct smb2_pdu *pdu;
+        int i;
+
+        if (smb2->writing) {
+                return smb2->writing;
+        }
+        if (head == NULL) {
+                return NULL;
+        }
+        if (smb2->dialect <= SMB2_VERSION_0202 ||
+            smb2_get_credit_charge(smb2, head) <= smb2->credits) {
+                return head;
+        }
+
+        if (head->bypassed < SMB2_MAX_CREDIT_BYPASS) {
+                for (pdu = head->next, i = 0;
+                     pdu && i < SMB2_CREDIT_BYPASS_SCAN;
+                     pdu = pdu->next, i++) {
+                        /* Nothing may overtake a chain we cannot reorder */
+                        if (!smb2_can_reorder(pdu->prev)) {
+                                break;
+                        }
+                        if (smb2_get_credit_charge(smb2, pdu) >
+                            smb2->credits) {
+                                continue;
+                        }
+                        if (!smb2_can_bypass(head, pdu)) {
+                                continue;
+                        }
+                        if (update_stats) {
+                                head->bypassed++;
+                                smb2->credit_bypasses++;
+                        }
+                        return pdu;
+                }
+        }
+
+        if (update_stats) {
+                smb2->credit_stalls++;
+        }
+        return NULL;
+}
+
 int
 smb2_which_events(struct smb2_context *smb2)
 {
 	int events = smb2->is_connected ? POLLIN : POLLOUT;
 
-        if (smb2->outqueue != NULL &&
-            smb2_get_credit_charge(smb2, smb2->outqueue) <= smb2->credits) {
+        smb2_drain_submitted(smb2);
+
+        if (smb2->io_uring && smb2_io_uring_write_busy(smb2)) {
+                return events;
+        }
+
+        if (smb2_next_to_send(smb2, 0) != NULL) {
                 events |= POLLOUT;
         }
         
 	return events;
 }
 
+void
+smb2_get_credit_stats(struct smb2_context *smb2,
+                      struct smb2_credit_stats *stats)
+{
+        stats->available = smb2->credits;
+        stats->outstanding = smb2->credits_outstanding;
+        stats->queued = smb2->credits_queued;
+        stats->target = smb2->credit_target;
+        stats->granted = smb2->credits_granted;
+        stats->stalls = smb2->credit_stalls;
+        stats->bypasses = smb2->credit_bypasses;
+}
+
+void
+smb2_get_recv_stats(struct smb2_context *smb2,
+                    struct smb2_recv_stats *stats)
+{
+        stats->alloc_count = smb2->recv_alloc_count;
+}
+
+/* The largest message the server may send us. That is a READ reply, or
+ * the replies to an opendir compound which holds two QUERY_DIRECTORY of
+ * up to max_transact_size, plus room for the headers.
+ */
+uint64_t
+smb2_max_message_size(struct smb2_context *smb2)
+{
+        uint64_t max = 2 * (uint64_t)smb2->max_transact_size;
+
+        if (max < smb2->max_read_size) {
+                max = smb2->max_read_size;
+        }
+
+        return max + 65536;
+}
+
 t_socket smb2_get_fd(struct smb2_context *smb2)
 {
+        if (smb2->io_uring) {
+                return smb2_io_uring_get_fd(smb2);
+        }
         return smb2->fd;
 }
 
+/* Account for count bytes of the chain we are writing having been written
+ * to the socket.
+ */
+static void
+smb2_written_to_socket(struct smb2_context *smb2, size_t count,
+                       int zerocopy)
+{
+        struct smb2_pdu *pdu = smb2->writing;
+        struct smb2_pdu *tmp_pdu;
+        size_t spl = 0;
+
+        if (pdu->crypt) {
+                spl = pdu->crypt_len;
+        } else {
+                for (tmp_pdu = pdu; tmp_pdu;
+                     tmp_pdu = tmp_pdu->next_compound) {
+                        spl += tmp_pdu->out.total_size;
+                }
+        }
+
+        pdu->out.num_done += count;
+
+        /* The application buffers of a WRITE must not be released before
+         * the kernel is done with them so remember the last send that
+         * referenced them.
+         */
+        if (zerocopy) {
+                for (tmp_pdu = pdu; tmp_pdu;
+                     tmp_pdu = tmp_pdu->next_compound) {
+                        if (tmp_pdu->header.command == SMB2_WRITE) {
+                                tmp_pdu->zerocopy = 1;
+                                tmp_pdu->zerocopy_seq = smb2->zerocopy_next;
+                        }
+                }
+                smb2->zerocopy_next++;
+        }
+
+        if (pdu->out.num_done == SMB2_SPL_SIZE + spl) {
+                SMB2_DLIST_REMOVE(&smb2->outqueue, pdu);
+                smb2->writing = NULL;
+                free(pdu->crypt);
+                pdu->crypt = NULL;
+                while (pdu) {
+                        tmp_pdu = pdu->next_compound;
+
+                        /* As we have now sent all the PDUs we
+                         * can remove the chaining.
+                         * On the receive side we will treat all
+                         * PDUs as individual PDUs.
+                         */
+                        pdu->next_compound = NULL;
+                        smb2->credits -= pdu->header.credit_charge;
+                        smb2->credits_queued -= pdu->header.credit_charge;
+                        smb2->credits_outstanding +=
+                                pdu->header.credit_charge;
+
+                        smb2_add_to_waitqueue(smb2, pdu);
+                        pdu = tmp_pdu;
+                }
+        }
+}
+
+/* Should this chain be sent with MSG_ZEROCOPY? */
+static int
+smb2_use_zerocopy(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        /* A sealed chain is sent from our own buffer */
+        if (smb2->zerocopy_threshold == 0 || smb2->io_uring || pdu->crypt) {
+                return 0;
+        }
+
+        for (; pdu; pdu = pdu->next_compound) {
+                if (pdu->header.command == SMB2_WRITE &&
+                    pdu->out.total_size >= smb2->zerocopy_threshold) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+static ssize_t
+smb2_writev_zerocopy(struct smb2_context *smb2, struct iovec *iov, int niov)
+{
+#ifdef HAVE_ZEROCOPY
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = niov;
+
+        return sendmsg(smb2->fd, &msg, MSG_ZEROCOPY);
+#else
+        errno = EOPNOTSUPP;
+        return -1;
+#endif
+}
+
+/* Complete the WRITEs whose pages the kernel has released */
+static void
+smb2_zerocopy_complete(struct smb2_context *smb2)
+{
+        struct smb2_pdu *pdu;
+
+        while ((pdu = smb2->zerocopy_queue.head) != NULL) {
+                if ((int32_t)(pdu->zerocopy_seq - smb2->zerocopy_done) >= 0) {
+                        break;
+                }
+                SMB2_DLIST_REMOVE(&smb2->zerocopy_queue, pdu);
+                pdu->cb(smb2, pdu->zerocopy_status, pdu->payload,
+                        pdu->cb_data);
+                smb2_free_pdu(smb2, pdu);
+        }
+}
+
+/* Complete all parked WRITEs, for example when the context is destroyed */
+void
+smb2_zerocopy_flush(struct smb2_context *smb2)
+{
+        smb2->zerocopy_done = smb2->zerocopy_next;
+        smb2_zerocopy_complete(smb2);
+}
+
+/* Read the zerocopy completion notifications from the socket error queue */
+static int
+smb2_zerocopy_reap(struct smb2_context *smb2)
+{
+#ifdef HAVE_ZEROCOPY
+        struct msghdr msg;
+        struct cmsghdr *cm;
+        struct sock_extended_err *serr;
+        char control[128];
+
+        for (;;) {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_control = control;
+                msg.msg_controllen = sizeof(control);
+
+                if (recvmsg(smb2->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+                        if (errno == EAGAIN || errno == EWOULDBLOCK ||
+                            errno == EINTR) {
+                                break;
+                        }
+                        smb2_set_error(smb2, "Failed to read socket error "
+                                       "queue. Errno:%s(%d).",
+                                       strerror(errno), errno);
+                        return -1;
+                }
+
+                for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+                        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+                        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                            serr->ee_errno != 0) {
+                                continue;
+                        }
+                        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                                smb2->zerocopy_copied++;
+                        }
+                        /* ee_info..ee_data is the range of sends that
+                         * completed. TCP completes them in order.
+                         */
+                        if ((int32_t)(serr->ee_data + 1 -
+                                      smb2->zerocopy_done) > 0) {
+                                smb2->zerocopy_done = serr->ee_data + 1;
+                        }
+                }
+        }
+
+        smb2_zerocopy_complete(smb2);
+#endif
+        return 0;
+}
+
 static int
 smb2_write_to_socket(struct smb2_context *smb2)
 {
@@ -116,36 +497,56 @@ smb2_write_to_socket(struct smb2_context *smb2)
 		return -1;
 	}
 
-	while ((pdu = smb2->outqueue) != NULL) {
-                struct iovec iov[SMB2_MAX_VECTORS];
+	while ((pdu = smb2_next_to_send(smb2, 1)) != NULL) {
+                /* One extra vector for the SPL */
+                struct iovec iov[SMB2_MAX_VECTORS + 1];
                 struct iovec *tmpiov;
                 struct smb2_pdu *tmp_pdu;
                 size_t num_done = pdu->out.num_done;
-                int i, niov = 1;
+                int i, niov = 1, zerocopy;
                 ssize_t count;
-                uint32_t spl = 0, tmp_spl, credit_charge = 0;
+                uint32_t spl = 0;
 
-                /* Count/copy all the vectors from all PDUs in the
-                 * compound set.
+                /* Encode the headers, then compress and/or encrypt the
+                 * whole chain the first time we try to send it.
                  */
-                for (tmp_pdu = pdu; tmp_pdu; tmp_pdu = tmp_pdu->next_compound) {
-                        credit_charge += pdu->header.credit_charge;
-                        for (i = 0; i < tmp_pdu->out.niov; i++, niov++) {
-                                iov[niov].iov_base = tmp_pdu->out.iov[i].buf;
-                                iov[niov].iov_len = tmp_pdu->out.iov[i].len;
-                                spl += tmp_pdu->out.iov[i].len;
+                if (!pdu->transformed) {
+                        pdu->transformed = 1;
+                        smb2_encode_chain(smb2, pdu);
+                        if (smb3_compress_pdu(smb2, pdu) < 0) {
+                                return -1;
+                        }
+                        if (pdu->seal && smb3_encrypt_pdu(smb2, pdu) < 0) {
+                                return -1;
                         }
                 }
 
-                if (smb2->dialect > SMB2_VERSION_0202) {
-                        if (credit_charge > smb2->credits) {
-                                return 0;
+                /* Count/copy all the vectors from all PDUs in the
+                 * compound set.
+                 */
+                if (pdu->crypt) {
+                        iov[niov].iov_base = pdu->crypt;
+                        iov[niov].iov_len = pdu->crypt_len;
+                        spl = pdu->crypt_len;
+                        niov++;
+                } else {
+                        for (tmp_pdu = pdu; tmp_pdu;
+                             tmp_pdu = tmp_pdu->next_compound) {
+                                for (i = 0; i < tmp_pdu->out.niov;
+                                     i++, niov++) {
+                                        iov[niov].iov_base =
+                                                tmp_pdu->out.iov[i].buf;
+                                        iov[niov].iov_len =
+                                                tmp_pdu->out.iov[i].len;
+                                        spl += tmp_pdu->out.iov[i].len;
+                                }
                         }
                 }
+                smb2->writing = pdu;
 
                 /* Add the SPL vector as the first vector */
-                tmp_spl = htobe32(spl);
-                iov[0].iov_base = &tmp_spl;
+                pdu->spl = htobe32(spl);
+                iov[0].iov_base = &pdu->spl;
                 iov[0].iov_len = SMB2_SPL_SIZE;
 
                 tmpiov = iov;
@@ -161,7 +562,27 @@ smb2_write_to_socket(struct smb2_context *smb2)
                 tmpiov->iov_base = (char *)tmpiov->iov_base + num_done;
                 tmpiov->iov_len -= num_done;
 
-                count = writev(smb2->fd, tmpiov, niov);
+                if (smb2->io_uring) {
+                        /* Completion is handled in smb2_service() */
+                        if (smb2_io_uring_write_busy(smb2)) {
+                                return 0;
+                        }
+                        return smb2_io_uring_writev(smb2, tmpiov, niov);
+                }
+
+                zerocopy = smb2_use_zerocopy(smb2, pdu);
+                if (zerocopy) {
+                        count = smb2_writev_zerocopy(smb2, tmpiov, niov);
+                        if (count == -1 && errno == ENOBUFS) {
+                                /* Out of optmem for tracking zerocopy
+                                 * sends, just copy this one.
+                                 */
+                                zerocopy = 0;
+                                count = writev(smb2->fd, tmpiov, niov);
+                        }
+                } else {
+                        count = writev(smb2->fd, tmpiov, niov);
+                }
                 if (count == -1) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) {
                                 return 0;
@@ -171,41 +592,171 @@ smb2_write_to_socket(struct smb2_context *smb2)
                                        smb2_get_error(smb2));
                         return -1;
                 }
-                
-                pdu->out.num_done += count;
 
-                if (pdu->out.num_done == SMB2_SPL_SIZE + spl) {
-                        SMB2_LIST_REMOVE(&smb2->outqueue, pdu);
-                        while (pdu) {
-                                tmp_pdu = pdu->next_compound;
+                smb2_written_to_socket(smb2, count, zerocopy);
+	}
+	return 0;
+}
 
-                                /* As we have now sent all the PDUs we
-                                 * can remove the chaining.
-                                 * On the receive side we will treat all
-                                 * PDUs as individual PDUs.
-                                 */
-                                pdu->next_compound = NULL;
-                                smb2->credits -= pdu->header.credit_charge;
+/* Prepare the receive scratch buffer for a new reply chain.
+ * Nothing from the previous chain references the buffer at this point so
+ * this is where we can grow it.
+ */
+static int
+smb2_reset_recv_buf(struct smb2_context *smb2)
+{
+        size_t size;
+        uint8_t *buf;
 
-                                SMB2_LIST_ADD_END(&smb2->waitqueue, pdu);
-                                pdu = tmp_pdu;
-                        }
+        smb2->recv_buf_used = 0;
+
+        if (smb2->recv_buf != NULL &&
+            smb2->recv_buf_needed <= smb2->recv_buf_size) {
+                return 0;
+        }
+
+        size = smb2->recv_buf_size ? smb2->recv_buf_size : SMB2_RECV_BUF_SIZE;
+        while (size < smb2->recv_buf_needed) {
+                size *= 2;
+        }
+
+        buf = malloc(size);
+        if (buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate receive buffer");
+                return -1;
+        }
+        smb2->recv_alloc_count++;
+
+        free(smb2->recv_buf);
+        smb2->recv_buf = buf;
+        smb2->recv_buf_size = size;
+
+        return 0;
+}
+
+/* Add a vector of len bytes to smb2->in, backed by the receive scratch
+ * buffer. Falls back to malloc() if the scratch buffer is full.
+ */
+static int
+smb2_add_recv_iovector(struct smb2_context *smb2, size_t len)
+{
+        size_t used;
+        uint8_t *buf;
+
+        /* Keep every buffer 8 byte aligned */
+        used = (smb2->recv_buf_used + 7) & ~(size_t)7;
+
+        if (used + len > smb2->recv_buf_needed) {
+                smb2->recv_buf_needed = used + len;
+        }
+
+        if (smb2->recv_buf != NULL && used + len <= smb2->recv_buf_size) {
+                smb2->recv_buf_used = used + len;
+                if (smb2_add_iovector(smb2, &smb2->in, smb2->recv_buf + used,
+                                      len, NULL) == NULL) {
+                        return -1;
                 }
-	}
-	return 0;
+                return 0;
+        }
+
+        buf = malloc(len);
+        if (buf == NULL) {
+                smb2_set_error(smb2, "Failed to allocate receive buffer");
+                return -1;
+        }
+        smb2->recv_alloc_count++;
+        smb2->recv_buf_used = used + len;
+
+        if (smb2_add_iovector(smb2, &smb2->in, buf, len, free) == NULL) {
+                free(buf);
+                return -1;
+        }
+        return 0;
+}
+
+/* Copy as much data as we have in the readahead buffer into the vectors */
+static ssize_t
+smb2_read_from_readahead(struct smb2_context *smb2,
+                         struct iovec *iov, int niov)
+{
+        size_t avail, num;
+        ssize_t count = 0;
+        int i;
+
+        for (i = 0; i < niov; i++) {
+                avail = smb2->readahead_end - smb2->readahead_start;
+                if (avail == 0) {
+                        break;
+                }
+                num = iov[i].iov_len;
+                if (num > avail) {
+                        num = avail;
+                }
+                memcpy(iov[i].iov_base,
+                       &smb2->readahead[smb2->readahead_start], num);
+                smb2->readahead_start += num;
+                count += num;
+        }
+
+        return count;
+}
+
+static int
+smb2_read_from_socket(struct smb2_context *smb2);
+
+/* Run a decrypted or decompressed chain of len bytes, which starts
+ * SMB2_SPL_SIZE bytes into buf, through the state machine as if it had
+ * been read from the socket.
+ */
+static int
+smb2_read_from_buffer(struct smb2_context *smb2, uint8_t *buf, size_t len)
+{
+        uint8_t *readahead = smb2->readahead;
+        size_t readahead_start = smb2->readahead_start;
+        size_t readahead_end = smb2->readahead_end;
+        uint32_t spl = htobe32(len);
+        int ret;
+
+        memcpy(buf, &spl, SMB2_SPL_SIZE);
+        smb2->readahead = buf;
+        smb2->readahead_start = 0;
+        smb2->readahead_end = len + SMB2_SPL_SIZE;
+        smb2->in.num_done = 0;
+
+        ret = smb2_read_from_socket(smb2);
+
+        smb2->readahead = readahead;
+        smb2->readahead_start = readahead_start;
+        smb2->readahead_end = readahead_end;
+        return ret;
 }
 
 static int
 smb2_read_from_socket(struct smb2_context *smb2)
 {
-        struct iovec iov[SMB2_MAX_VECTORS];
+        /* One extra vector for the readahead buffer */
+        struct iovec iov[SMB2_MAX_VECTORS + 1];
         struct iovec *tmpiov;
         size_t num_done;
 	ssize_t count, len;
         int i, niov, is_chained;
         static char magic[4] = {0xFE, 'S', 'M', 'B'};
+        static char transform_magic[4] = {0xFD, 'S', 'M', 'B'};
+        static char compression_magic[4] = {0xFC, 'S', 'M', 'B'};
         struct smb2_pdu *pdu = smb2->pdu;
 
+        if (smb2->readahead == NULL && smb2->io_uring == NULL) {
+                smb2->readahead = malloc(SMB2_READAHEAD_SIZE);
+                if (smb2->readahead == NULL) {
+                        smb2_set_error(smb2, "Failed to allocate readahead "
+                                       "buffer");
+                        return -1;
+                }
+                smb2->recv_alloc_count++;
+                smb2->readahead_start = smb2->readahead_end = 0;
+        }
+
+read_next_chain:
         /* initialize the input vectors to the spl and the header
          * which are both static data in the smb2 context.
          * additional vectors will be added when we can map this to
@@ -216,8 +767,13 @@ smb2_read_from_socket(struct smb2_context *smb2)
                 smb2->spl = 0;
 
                 smb2_free_iovector(smb2, &smb2->in);
-                smb2_add_iovector(smb2, &smb2->in, (uint8_t *)&smb2->spl,
-                                  SMB2_SPL_SIZE, NULL);
+                if (smb2_reset_recv_buf(smb2) < 0) {
+                        return -1;
+                }
+                if (smb2_add_iovector(smb2, &smb2->in, (uint8_t *)&smb2->spl,
+                                      SMB2_SPL_SIZE, NULL) == NULL) {
+                        return -1;
+                }
         }
 
 read_more_data:
@@ -242,8 +798,34 @@ read_more_data:
         tmpiov->iov_base = (char *)tmpiov->iov_base + num_done;
         tmpiov->iov_len -= num_done;
 
-        /* Read into our trimmed iovectors */
-        count = readv(smb2->fd, tmpiov, niov);
+        /* Serve the read from data we already have if possible */
+        if (smb2->readahead_start < smb2->readahead_end) {
+                count = smb2_read_from_readahead(smb2, tmpiov, niov);
+                goto got_data;
+        }
+
+        /* A decrypted or decompressed message is fed from smb2->enc or
+         * smb2->dec and must be complete.
+         */
+        if (smb2->decrypting || smb2->decompressing) {
+                smb2_set_error(smb2, "Truncated %s message",
+                               smb2->decompressing ? "compressed" :
+                               "encrypted");
+                return -1;
+        }
+
+        /* With io_uring we only see data once the receive completes */
+        if (smb2->io_uring) {
+                return 0;
+        }
+
+        /* Read into our trimmed iovectors and any excess into the
+         * readahead buffer.
+         */
+        smb2->readahead_start = smb2->readahead_end = 0;
+        tmpiov[niov].iov_base = smb2->readahead;
+        tmpiov[niov].iov_len = SMB2_READAHEAD_SIZE;
+        count = readv(smb2->fd, tmpiov, niov + 1);
         if (count < 0) {
 #ifdef _WIN32
                 int err = WSAGetLastError();
@@ -262,6 +844,13 @@ read_more_data:
                 /* remote side has closed the socket. */
                 return -1;
         }
+        len = smb2->in.total_size - smb2->in.num_done;
+        if (count > len) {
+                smb2->readahead_end = count - len;
+                count = len;
+        }
+
+ got_data:
         smb2->in.num_done += count;
 
         if (smb2->in.num_done < smb2->in.total_size) {
@@ -273,10 +862,125 @@ read_more_data:
         case SMB2_RECV_SPL:
                 smb2->spl = be32toh(smb2->spl);
                 smb2->recv_state = SMB2_RECV_HEADER;
-                smb2_add_iovector(smb2, &smb2->in, &smb2->header[0],
-                                  SMB2_HEADER_SIZE, NULL);
+                if (smb2_add_iovector(smb2, &smb2->in, &smb2->header[0],
+                                      SMB2_HEADER_SIZE, NULL) == NULL) {
+                        return -1;
+                }
                 goto read_more_data;
         case SMB2_RECV_HEADER:
+                if (!memcmp(smb2->header, transform_magic, 4)) {
+                        uint8_t *enc;
+
+                        /* An encrypted message. We have the
+                         * TRANSFORM_HEADER and the start of the encrypted
+                         * data in smb2->header, read the rest of it into
+                         * smb2->enc, leaving room for an SPL in front.
+                         */
+                        if (smb2->decrypting || smb2->decompressing) {
+                                smb2_set_error(smb2, "Nested encrypted "
+                                               "message");
+                                return -1;
+                        }
+                        if (smb2->spl < SMB2_TRANSFORM_HEADER_SIZE +
+                            SMB2_HEADER_SIZE) {
+                                smb2_set_error(smb2, "Encrypted message too "
+                                               "short");
+                                return -1;
+                        }
+                        if (smb2->spl > smb2_max_message_size(smb2)) {
+                                smb2_set_error(smb2, "Encrypted message too "
+                                               "large");
+                                return -1;
+                        }
+                        len = smb2->spl - SMB2_TRANSFORM_HEADER_SIZE +
+                                SMB2_SPL_SIZE;
+                        if (smb2->enc_size < (size_t)len) {
+                                enc = realloc(smb2->enc, len);
+                                if (enc == NULL) {
+                                        smb2_set_error(smb2, "Failed to "
+                                                       "allocate decryption "
+                                                       "buffer");
+                                        return -1;
+                                }
+                                smb2->enc = enc;
+                                smb2->enc_size = len;
+                                smb2->recv_alloc_count++;
+                        }
+                        len = SMB2_HEADER_SIZE - SMB2_TRANSFORM_HEADER_SIZE;
+                        memcpy(&smb2->enc[SMB2_SPL_SIZE],
+                               &smb2->header[SMB2_TRANSFORM_HEADER_SIZE],
+                               len);
+                        smb2->recv_state = SMB2_RECV_TRANSFORM;
+                        if (smb2_add_iovector(smb2, &smb2->in,
+                                              &smb2->enc[SMB2_SPL_SIZE + len],
+                                              smb2->spl - SMB2_HEADER_SIZE,
+                                              NULL) == NULL) {
+                                return -1;
+                        }
+                        goto read_more_data;
+                }
+                if (!memcmp(smb2->header, compression_magic, 4)) {
+                        size_t size;
+                        uint8_t *buf;
+
+                        /* A compressed message. Read all of it into
+                         * smb2->cmp and make room in smb2->dec for what
+                         * it decompresses to and an SPL in front.
+                         */
+                        if (smb2->decompressing) {
+                                smb2_set_error(smb2, "Nested compressed "
+                                               "message");
+                                return -1;
+                        }
+                        if (smb2->spl < SMB2_HEADER_SIZE) {
+                                smb2_set_error(smb2, "Compressed message "
+                                               "too short");
+                                return -1;
+                        }
+                        if (smb2->spl > smb2_max_message_size(smb2)) {
+                                smb2_set_error(smb2, "Compressed message "
+                                               "too large");
+                                return -1;
+                        }
+                        if (smb3_decompressed_size(smb2, smb2->header,
+                                                   SMB2_HEADER_SIZE,
+                                                   &size) < 0) {
+                                return -1;
+                        }
+                        if (smb2->cmp_size < smb2->spl) {
+                                buf = realloc(smb2->cmp, smb2->spl);
+                                if (buf == NULL) {
+                                        goto cmp_nomem;
+                                }
+                                smb2->cmp = buf;
+                                smb2->cmp_size = smb2->spl;
+                                smb2->recv_alloc_count++;
+                        }
+                        if (smb2->dec_size < size + SMB2_SPL_SIZE) {
+                                buf = realloc(smb2->dec,
+                                              size + SMB2_SPL_SIZE);
+                                if (buf == NULL) {
+                                        goto cmp_nomem;
+                                }
+                                smb2->dec = buf;
+                                smb2->dec_size = size + SMB2_SPL_SIZE;
+                                smb2->recv_alloc_count++;
+                        }
+                        memcpy(smb2->cmp, smb2->header, SMB2_HEADER_SIZE);
+                        smb2->recv_state = SMB2_RECV_COMPRESSED;
+                        if (smb2_add_iovector(smb2, &smb2->in,
+                                              &smb2->cmp[SMB2_HEADER_SIZE],
+                                              smb2->spl - SMB2_HEADER_SIZE,
+                                              NULL) == NULL) {
+                                return -1;
+                        }
+                        goto read_more_data;
+                cmp_nomem:
+                        smb2_set_error(smb2, "Failed to allocate "
+                                       "decompression buffer");
+                        return -1;
+                }
+
                 /* Record the offset for the start of payload data. */
                 smb2->payload_offset = smb2->in.num_done;
 
@@ -287,6 +991,7 @@ read_more_data:
                         return -1;
                 }
                 smb2->credits += smb2->hdr.credit_request_response;
+                smb2->credits_granted += smb2->hdr.credit_request_response;
 
                 if (memcmp(&smb2->hdr.protocol_id, magic, 4)) {
                         smb2_set_error(smb2, "received non-SMB2 blob");
@@ -306,9 +1011,9 @@ read_more_data:
 
                         /* Add padding before the next PDU */
                         smb2->recv_state = SMB2_RECV_PAD;
-                        smb2_add_iovector(smb2, &smb2->in,
-                                          malloc(len),
-                                          len, free);
+                        if (smb2_add_recv_iovector(smb2, len) < 0) {
+                                return -1;
+                        }
                         goto read_more_data;
                 }
 
@@ -317,7 +1022,15 @@ read_more_data:
                         smb2_set_error(smb2, "no matching PDU found");
                         return -1;
                 }
-                SMB2_LIST_REMOVE(&smb2->waitqueue, pdu);
+                if (pdu->seal && !smb2->decrypting) {
+                        smb2_set_error(smb2, "Received unencrypted reply to "
+                                       "an encrypted request");
+                        return -1;
+                }
+                smb2_remove_from_waitqueue(smb2, pdu);
+                smb2->credits_outstanding -= pdu->header.credit_charge;
+                smb2->credits_requested -=
+                        pdu->header.credit_request_response;
 
                 len = smb2_get_fixed_size(smb2, pdu);
                 if (len < 0) {
@@ -326,9 +1039,9 @@ read_more_data:
                 }
 
                 smb2->recv_state = SMB2_RECV_FIXED;
-                smb2_add_iovector(smb2, &smb2->in,
-                                  malloc(len & 0xfffe),
-                                  len & 0xfffe, free);
+                if (smb2_add_recv_iovector(smb2, len & 0xfffe) < 0) {
+                        return -1;
+                }
                 goto read_more_data;
         case SMB2_RECV_FIXED:
                 len = smb2_process_payload_fixed(smb2, pdu);
@@ -347,9 +1060,11 @@ read_more_data:
                                 if (num > len) {
                                         num = len;
                                 }
-                                smb2_add_iovector(smb2, &smb2->in,
-                                                  pdu->in.iov[i].buf,
-                                                  num, NULL);
+                                if (smb2_add_iovector(smb2, &smb2->in,
+                                                      pdu->in.iov[i].buf,
+                                                      num, NULL) == NULL) {
+                                        return -1;
+                                }
                                 len -= num;
 
                                 if (len == 0) {
@@ -359,9 +1074,9 @@ read_more_data:
                         }
                         if (len > 0) {
                                 smb2->recv_state = SMB2_RECV_VARIABLE;
-                                smb2_add_iovector(smb2, &smb2->in,
-                                                  malloc(len),
-                                                  len, free);
+                                if (smb2_add_recv_iovector(smb2, len) < 0) {
+                                        return -1;
+                                }
                                 goto read_more_data;
                         }
                 }
@@ -382,9 +1097,9 @@ read_more_data:
                 if (len > 0) {
                         /* Add padding before the next PDU */
                         smb2->recv_state = SMB2_RECV_PAD;
-                        smb2_add_iovector(smb2, &smb2->in,
-                                          malloc(len),
-                                          len, free);
+                        if (smb2_add_recv_iovector(smb2, len) < 0) {
+                                return -1;
+                        }
                         goto read_more_data;
                 }
 
@@ -415,9 +1130,9 @@ read_more_data:
                 if (len > 0) {
                         /* Add padding before the next PDU */
                         smb2->recv_state = SMB2_RECV_PAD;
-                        smb2_add_iovector(smb2, &smb2->in,
-                                          malloc(len),
-                                          len, free);
+                        if (smb2_add_recv_iovector(smb2, len) < 0) {
+                                return -1;
+                        }
                         goto read_more_data;
                 }
 
@@ -429,6 +1144,52 @@ read_more_data:
                  * PDU. Break out of the switch and invoke the callback.
                  */
                 break;
+        case SMB2_RECV_TRANSFORM: {
+                int ret;
+
+                len = smb2->spl - SMB2_TRANSFORM_HEADER_SIZE;
+                if (smb3_decrypt_pdu(smb2, smb2->header,
+                                     &smb2->enc[SMB2_SPL_SIZE], len) < 0) {
+                        return -1;
+                }
+
+                smb2->decrypting = 1;
+                ret = smb2_read_from_buffer(smb2, smb2->enc, len);
+                smb2->decrypting = 0;
+                if (ret < 0) {
+                        return -1;
+                }
+
+                smb2->in.num_done = 0;
+                if (smb2->readahead_start < smb2->readahead_end) {
+                        goto read_next_chain;
+                }
+                return 0;
+        }
+        case SMB2_RECV_COMPRESSED: {
+                size_t size;
+                int ret;
+
+                smb3_decompressed_size(smb2, smb2->cmp, smb2->spl, &size);
+                if (smb3_decompress_pdu(smb2, smb2->cmp, smb2->spl,
+                                        &smb2->dec[SMB2_SPL_SIZE],
+                                        size) < 0) {
+                        return -1;
+                }
+
+                smb2->decompressing = 1;
+                ret = smb2_read_from_buffer(smb2, smb2->dec, size);
+                smb2->decompressing = 0;
+                if (ret < 0) {
+                        return -1;
+                }
+
+                smb2->in.num_done = 0;
+                if (smb2->readahead_start < smb2->readahead_end) {
+                        goto read_next_chain;
+                }
+                return 0;
+        }
         }
 
         if (smb2->hdr.status == SMB2_STATUS_PENDING) {
@@ -436,37 +1197,112 @@ read_more_data:
                  * to read the next chain.
                  */
                 smb2->in.num_done = 0;
+                if (smb2->readahead_start < smb2->readahead_end) {
+                        goto read_next_chain;
+                }
                 return 0;
         }
 
         is_chained = smb2->hdr.next_command;
 
-        pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
-        smb2_free_pdu(smb2, pdu);
+        /* Verify signed replies before anyone looks at them. Encrypted
+         * replies are protected by the encryption instead and the final
+         * SESSION_SETUP reply can only be verified once the callback has
+         * derived the keys.
+         */
+        if (smb2->signing_required && !smb2->decrypting &&
+            pdu->header.command != SMB2_SESSION_SETUP &&
+            pdu->header.flags & SMB2_FLAGS_SIGNED) {
+                if (smb2->hdr.flags & SMB2_FLAGS_SIGNED) {
+                        if (smb2_pdu_check_signature(smb2, pdu) < 0) {
+                                return -1;
+                        }
+                } else {
+                        /* Whatever the status. Only interim responses
+                         * may be unsigned and those were skipped above,
+                         * [MS-SMB2] 3.2.5.1.3.
+                         */
+                        smb2_set_error(smb2, "Unsigned reply to a signed "
+                                       "request");
+                        return -1;
+                }
+        }
+
+        /* The final SESSION_SETUP reply is not part of the preauth hash */
+        if (smb2->preauth &&
+            (pdu->header.command == SMB2_NEGOTIATE ||
+             (pdu->header.command == SMB2_SESSION_SETUP &&
+              smb2->hdr.status != SMB2_STATUS_SUCCESS))) {
+                smb3_update_preauth_hash(smb2, &smb2->in,
+                                         smb2->payload_offset -
+                                         SMB2_HEADER_SIZE);
+        }
+
+        if (pdu->zerocopy &&
+            (int32_t)(pdu->zerocopy_seq - smb2->zerocopy_done) >= 0) {
+                /* The kernel may still reference the application buffer.
+                 * Complete the WRITE once it has released it.
+                 */
+                pdu->zerocopy_status = smb2->hdr.status;
+                SMB2_DLIST_ADD_END(&smb2->zerocopy_queue, pdu);
+        } else {
+                pdu->cb(smb2, smb2->hdr.status, pdu->payload, pdu->cb_data);
+                smb2_free_pdu(smb2, pdu);
+        }
         smb2->pdu = NULL;
 
         if (is_chained) {
                 smb2->recv_state = SMB2_RECV_HEADER;
-                smb2_add_iovector(smb2, &smb2->in, &smb2->header[0],
-                                  SMB2_HEADER_SIZE, NULL);
+                if (smb2_add_iovector(smb2, &smb2->in, &smb2->header[0],
+                                      SMB2_HEADER_SIZE, NULL) == NULL) {
+                        return -1;
+                }
                 goto read_more_data;
         }
 
         /* We are all done now with this chain. Reset num_done to 0
          * and restart with a new SPL for the next chain.
          */
-        smb2->in.num_done = 0;        
+        smb2->in.num_done = 0;
+        if (smb2->readahead_start < smb2->readahead_end) {
+                goto read_next_chain;
+        }
 
 	return 0;
 }
 
-int
-smb2_service(struct smb2_context *smb2, int revents)
+/* Data received through io_uring. Feed it to the receive state machine
+ * through the readahead buffer.
+ */
+static int
+smb2_io_uring_recv_cb(struct smb2_context *smb2, uint8_t *buf, size_t len)
 {
-	if (smb2->fd < 0) {
-		return 0;
-	}
+        int ret;
+
+        smb2->readahead = buf;
+        smb2->readahead_start = 0;
+        smb2->readahead_end = len;
+
+        ret = smb2_read_from_socket(smb2);
+
+        smb2->readahead = NULL;
+        smb2->readahead_start = smb2->readahead_end = 0;
+
+        return ret;
+}
 
+static void
+smb2_io_uring_written_cb(struct smb2_context *smb2, size_t count)
+{
+        smb2_written_to_socket(smb2, count, 0);
+}
+
+/* Sets the error and returns -1 if revents report a socket error or a
+ * hangup.
+ */
+static int
+smb2_service_error(struct smb2_context *smb2, int revents)
+{
         if (revents & POLLERR) {
 		int err = 0;
 		socklen_t err_size = sizeof(err);
@@ -491,6 +1327,71 @@ smb2_service(struct smb2_context *smb2, int revents)
                 return -1;
 	}
 
+        return 0;
+}
+
+static int
+smb2_service_io_uring(struct smb2_context *smb2, int revents)
+{
+        if (smb2_service_error(smb2, revents) < 0) {
+                return -1;
+        }
+
+        if (revents & POLLIN) {
+                if (smb2_io_uring_process(smb2, smb2_io_uring_recv_cb,
+                                          smb2_io_uring_written_cb) < 0) {
+                        return -1;
+                }
+        }
+
+        if (smb2->io_uring && smb2->outqueue.head != NULL &&
+            !smb2_io_uring_write_busy(smb2)) {
+                if (smb2_write_to_socket(smb2) != 0) {
+                        return -1;
+                }
+        }
+
+        return 0;
+}
+
+int
+smb2_service(struct smb2_context *smb2, int revents)
+{
+	if (smb2->fd < 0) {
+		return 0;
+	}
+
+        /* Queue what other threads submitted and try to send it right
+         * away, the socket is non-blocking.
+         */
+        if (smb2_drain_submitted(smb2) > 0 && smb2->is_connected) {
+                revents |= POLLOUT;
+        }
+
+        if (smb2->io_uring) {
+                return smb2_service_io_uring(smb2, revents);
+        }
+
+        if (revents & POLLERR && smb2->zerocopy_threshold) {
+		int err = 0;
+		socklen_t err_size = sizeof(err);
+
+                /* Zerocopy completions are signalled through the error
+                 * queue which also raises POLLERR.
+                 */
+                if (smb2_zerocopy_reap(smb2) < 0) {
+                        return -1;
+                }
+		if (getsockopt(smb2->fd, SOL_SOCKET, SO_ERROR,
+			       (char *)&err, &err_size) == 0 && err == 0) {
+                        revents &= ~POLLERR;
+                }
+        }
+
+        if (smb2_service_error(smb2, revents) < 0) {
+                return -1;
+        }
+
 	if (smb2->is_connected == 0 && revents & POLLOUT) {
 		int err = 0;
 		socklen_t err_size = sizeof(err);
@@ -512,6 +1413,15 @@ smb2_service(struct smb2_context *smb2, int revents)
 		}
 
 		smb2->is_connected = 1;
+                if (smb2->io_uring_entries &&
+                    smb2_io_uring_start(smb2) < 0) {
+                        if (smb2->connect_cb) {
+                                smb2->connect_cb(smb2, -EIO, NULL,
+                                                 smb2->connect_data);
+                                smb2->connect_cb = NULL;
+                        }
+                        return -1;
+                }
 		if (smb2->connect_cb) {
 			smb2->connect_cb(smb2, 0, NULL,	smb2->connect_data);
 			smb2->connect_cb = NULL;
@@ -525,7 +1435,7 @@ smb2_service(struct smb2_context *smb2, int revents)
 		}
 	}
         
-	if (revents & POLLOUT && smb2->outqueue != NULL) {
+	if (revents & POLLOUT && smb2->outqueue.head != NULL) {
 		if (smb2_write_to_socket(smb2) != 0) {
                         return -1;
 		}
@@ -567,6 +1477,45 @@ set_tcp_sockopt(t_socket sockfd, int optname, int value)
 	return setsockopt(sockfd, level, optname, (char *)&value, sizeof(value));
 }
 
+static int
+smb2_enable_zerocopy(struct smb2_context *smb2)
+{
+#ifdef HAVE_ZEROCOPY
+        int one = 1;
+
+        if (setsockopt(smb2->fd, SOL_SOCKET, SO_ZEROCOPY,
+                       (char *)&one, sizeof(one)) != 0) {
+                smb2_set_error(smb2, "Failed to enable SO_ZEROCOPY. "
+                               "Errno:%s(%d).", strerror(errno), errno);
+                return -1;
+        }
+        return 0;
+#else
+        smb2_set_error(smb2, "MSG_ZEROCOPY is not supported");
+        return -1;
+#endif
+}
+
+int
+smb2_set_zerocopy_threshold(struct smb2_context *smb2, size_t threshold)
+{
+#ifdef HAVE_ZEROCOPY
+        if (threshold && smb2->fd != -1 && smb2->zerocopy_threshold == 0) {
+                if (smb2_enable_zerocopy(smb2) < 0) {
+                        return -1;
+                }
+        }
+        smb2->zerocopy_threshold = threshold;
+        return 0;
+#else
+        if (threshold == 0) {
+                return 0;
+        }
+        smb2_set_error(smb2, "MSG_ZEROCOPY is not supported");
+        return -1;
+#endif
+}
+
 int
 smb2_connect_async(struct smb2_context *smb2, const char *server,
                    smb2_command_cb cb, void *private_data)
@@ -666,6 +1615,11 @@ smb2_connect_async(struct smb2_context *smb2, const char *server,
 
 	set_nonblocking(smb2->fd);
 	set_tcp_sockopt(smb2->fd, TCP_NODELAY, 1);
+
+        if (smb2->zerocopy_threshold && smb2_enable_zerocopy(smb2) < 0) {
+                /* Not supported by the kernel, just copy */
+                smb2->zerocopy_threshold = 0;
+        }
         
 	if (connect(smb2->fd, (struct sockaddr *)&ss, socksize) != 0
 #ifndef _MSC_VER
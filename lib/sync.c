@@ -49,19 +49,24 @@ static int wait_for_reply(struct smb2_context *smb2,
                           struct sync_cb_data *cb_data)
 {
         while (!cb_data->is_finished) {
-                struct pollfd pfd;
+                struct pollfd pfd[2];
 
-		pfd.fd = smb2_get_fd(smb2);
-		pfd.events = smb2_which_events(smb2);
+		pfd[0].fd = smb2_get_fd(smb2);
+		pfd[0].events = smb2_which_events(smb2);
+                pfd[0].revents = 0;
+                /* Requests submitted by other threads in thread-safe mode */
+                pfd[1].fd = smb2_get_wakeup_fd(smb2);
+                pfd[1].events = POLLIN;
+                pfd[1].revents = 0;
 
-		if (poll(&pfd, 1, 1000) < 0) {
+		if (poll(pfd, 2, 1000) < 0) {
 			smb2_set_error(smb2, "Poll failed");
 			return -1;
 		}
-                if (pfd.revents == 0) {
+                if (pfd[0].revents == 0 && pfd[1].revents == 0) {
                         continue;
                 }
-		if (smb2_service(smb2, pfd.revents) < 0) {
+		if (smb2_service(smb2, pfd[0].revents) < 0) {
 			smb2_set_error(smb2, "smb2_service failed with : "
                                        "%s\n", smb2_get_error(smb2));
                         return -1;
@@ -71,6 +76,15 @@ static int wait_for_reply(struct smb2_context *smb2,
         return 0;
 }
 
+static void generic_status_cb(struct smb2_context *smb2, int status,
+                    void *command_data, void *private_data)
+{
+        struct sync_cb_data *cb_data = private_data;
+
+        cb_data->is_finished = 1;
+        cb_data->status = status;
+}
+
 static void connect_cb(struct smb2_context *smb2, int status,
                        void *command_data, void *private_data)
 {
@@ -158,6 +172,72 @@ struct smb2dir *smb2_opendir(struct smb2_context *smb2, const char *path)
 	return cb_data.ptr;
 }
 
+struct smb2dir *smb2_opendir_stream(struct smb2_context *smb2,
+                                    const char *path)
+{
+        struct sync_cb_data cb_data;
+
+	cb_data.is_finished = 0;
+
+	if (smb2_opendir_stream_async(smb2, path,
+                                      opendir_cb, &cb_data) != 0) {
+		smb2_set_error(smb2, "smb2_opendir_stream_async failed");
+		return NULL;
+	}
+
+	if (wait_for_reply(smb2, &cb_data) < 0) {
+                return NULL;
+        }
+
+	return cb_data.ptr;
+}
+
+/*
+ * readdir_next()
+ */
+int smb2_readdir_next(struct smb2_context *smb2, struct smb2dir *dir)
+{
+        struct sync_cb_data cb_data;
+        int rc;
+
+	cb_data.is_finished = 0;
+
+	rc = smb2_readdir_next_async(smb2, dir, generic_status_cb, &cb_data);
+	if (rc < 0) {
+		return rc;
+	}
+
+	if (wait_for_reply(smb2, &cb_data) < 0) {
+                return -EIO;
+        }
+
+	return cb_data.status;
+}
+
+/*
+ * walk()
+ */
+int smb2_walk(struct smb2_context *smb2, const char *path,
+              const struct smb2_walk_options *opts)
+{
+        struct sync_cb_data cb_data;
+        int rc;
+
+        cb_data.is_finished = 0;
+
+        rc = smb2_walk_async(smb2, path, opts, generic_status_cb,
+                             &cb_data);
+        if (rc < 0) {
+                return rc;
+        }
+
+        if (wait_for_reply(smb2, &cb_data) < 0) {
+                return -EIO;
+        }
+
+        return cb_data.status;
+}
+
 /*
  * open()
  */
@@ -252,15 +332,6 @@ int smb2_fsync(struct smb2_context *smb2, struct smb2fh *fh)
 /*
  * pread()
  */
-static void generic_status_cb(struct smb2_context *smb2, int status,
-                    void *command_data, void *private_data)
-{
-        struct sync_cb_data *cb_data = private_data;
-
-        cb_data->is_finished = 1;
-        cb_data->status = status;
-}
-
 int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
                uint8_t *buf, uint32_t count, uint64_t offset)
 {
@@ -281,6 +352,26 @@ int smb2_pread(struct smb2_context *smb2, struct smb2fh *fh,
 	return cb_data.status;
 }
 
+int smb2_pread_parallel(struct smb2_context *smb2, struct smb2fh *fh,
+                        uint8_t *buf, uint32_t count, uint64_t offset)
+{
+        struct sync_cb_data cb_data;
+
+	cb_data.is_finished = 0;
+
+	if (smb2_pread_parallel_async(smb2, fh, buf, count, offset,
+                                      generic_status_cb, &cb_data) != 0) {
+		smb2_set_error(smb2, "smb2_pread_parallel_async failed");
+		return -1;
+	}
+
+	if (wait_for_reply(smb2, &cb_data) < 0) {
+                return -1;
+        }
+
+	return cb_data.status;
+}
+
 int smb2_pwrite(struct smb2_context *smb2, struct smb2fh *fh,
                 uint8_t *buf, uint32_t count, uint64_t offset)
 {
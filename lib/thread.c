@@ -0,0 +1,370 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Thread-safe mode, see smb2_set_thread_safe().
+ *
+ * The context is still driven by a single service thread, the one that
+ * turned thread-safe mode on. It owns the socket and everything that goes
+ * into the header of a PDU when it is queued: message ids, credits,
+ * signatures and the preauth hash. Other threads only build PDUs and hand
+ * the finished chains over through a lock-free multi-producer queue.
+ *
+ * The queue is a LIFO that producers push onto with compare-and-swap.
+ * The service thread takes the whole list over with a single exchange and
+ * reverses it, so chains are queued in the order they were submitted. An
+ * eventfd, or a pipe where there is none, wakes the service thread when
+ * the queue goes from empty to non-empty.
+ *
+ * What building a PDU shares with the service thread, the PDU pool and
+ * the lists of open files and directories, is protected by a mutex.
+ * Errors set on other threads go to a per-thread buffer so that threads
+ * do not clobber each other's error strings.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+
+#if defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+#define SMB2_THREADS
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+
+#ifdef SMB2_THREADS
+
+struct smb2_thread {
+        pthread_t service;
+        pthread_mutex_t lock;
+        /* Chains submitted by other threads, newest first */
+        struct smb2_pdu *submitted;
+        /* Set when the wakeup fd may be readable */
+        int signalled;
+        /* The same eventfd twice, or the two ends of a pipe */
+        int wakeup_rfd;
+        int wakeup_wfd;
+};
+
+static __thread char smb2_thread_error[MAX_ERROR_SIZE];
+
+static int
+smb2_thread_is_service(struct smb2_thread *t)
+{
+        return pthread_equal(pthread_self(), t->service);
+}
+
+static void
+smb2_thread_free(struct smb2_thread *t)
+{
+        if (t->wakeup_wfd != t->wakeup_rfd) {
+                close(t->wakeup_wfd);
+        }
+        close(t->wakeup_rfd);
+        pthread_mutex_destroy(&t->lock);
+        free(t);
+}
+
+static struct smb2_thread *
+smb2_thread_new(struct smb2_context *smb2)
+{
+        struct smb2_thread *t;
+
+        t = malloc(sizeof(struct smb2_thread));
+        if (t == NULL) {
+                smb2_set_error(smb2, "Failed to allocate thread state");
+                return NULL;
+        }
+        memset(t, 0, sizeof(struct smb2_thread));
+        t->service = pthread_self();
+
+#ifdef HAVE_SYS_EVENTFD_H
+        t->wakeup_rfd = t->wakeup_wfd = eventfd(0, EFD_NONBLOCK |
+                                                EFD_CLOEXEC);
+        if (t->wakeup_rfd < 0) {
+                smb2_set_error(smb2, "Failed to create eventfd. %s",
+                               strerror(errno));
+                free(t);
+                return NULL;
+        }
+#else
+        {
+                int fds[2];
+
+                if (pipe(fds) < 0) {
+                        smb2_set_error(smb2, "Failed to create wakeup "
+                                       "pipe. %s", strerror(errno));
+                        free(t);
+                        return NULL;
+                }
+                fcntl(fds[0], F_SETFL, O_NONBLOCK);
+                fcntl(fds[1], F_SETFL, O_NONBLOCK);
+                t->wakeup_rfd = fds[0];
+                t->wakeup_wfd = fds[1];
+        }
+#endif
+        if (pthread_mutex_init(&t->lock, NULL) != 0) {
+                smb2_set_error(smb2, "Failed to initialize mutex");
+                if (t->wakeup_wfd != t->wakeup_rfd) {
+                        close(t->wakeup_wfd);
+                }
+                close(t->wakeup_rfd);
+                free(t);
+                return NULL;
+        }
+
+        return t;
+}
+
+int
+smb2_set_thread_safe(struct smb2_context *smb2, int val)
+{
+        if (!val) {
+                if (smb2->thread == NULL) {
+                        return 0;
+                }
+                if (!smb2_thread_is_service(smb2->thread)) {
+                        smb2_set_error(smb2, "Thread-safe mode can only be "
+                                       "turned off by the service thread");
+                        return -EINVAL;
+                }
+                smb2_drain_submitted(smb2);
+                smb2_thread_free(smb2->thread);
+                smb2->thread = NULL;
+                return 0;
+        }
+
+        if (smb2->thread != NULL) {
+                return 0;
+        }
+        if (smb2_any_write_behind(smb2)) {
+                smb2_set_error(smb2, "Thread-safe mode can not be used "
+                               "with write-behind");
+                return -EINVAL;
+        }
+        smb2->thread = smb2_thread_new(smb2);
+        if (smb2->thread == NULL) {
+                return -ENOMEM;
+        }
+        return 0;
+}
+
+t_socket
+smb2_get_wakeup_fd(struct smb2_context *smb2)
+{
+        return smb2->thread ? smb2->thread->wakeup_rfd : -1;
+}
+
+int
+smb2_is_service_thread(struct smb2_context *smb2)
+{
+        return smb2->thread == NULL || smb2_thread_is_service(smb2->thread);
+}
+
+void
+smb2_submit_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+        struct smb2_thread *t = smb2->thread;
+        struct smb2_pdu *head;
+        uint64_t one = 1;
+
+        head = __atomic_load_n(&t->submitted, __ATOMIC_RELAXED);
+        do {
+                pdu->next = head;
+        } while (!__atomic_compare_exchange_n(&t->submitted, &head, pdu, 1,
+                                              __ATOMIC_RELEASE,
+                                              __ATOMIC_RELAXED));
+
+        /* Only the first chain in an empty queue needs to wake the
+         * service thread up, it takes all of them at once.
+         */
+        if (head == NULL) {
+                /* Write before publishing signalled so that a drain
+                 * that sees it always finds the fd readable.
+                 */
+                if (write(t->wakeup_wfd, &one, sizeof(one)) < 0) {
+                        /* A full pipe is readable already */
+                }
+                __atomic_store_n(&t->signalled, 1, __ATOMIC_RELEASE);
+        }
+}
+
+int
+smb2_drain_submitted(struct smb2_context *smb2)
+{
+        struct smb2_thread *t = smb2->thread;
+        struct smb2_pdu *pdu, *next, *list = NULL;
+        uint8_t buf[64];
+        int count = 0;
+
+        if (t == NULL || !smb2_thread_is_service(t)) {
+                return 0;
+        }
+
+        /* Clear the wakeup before taking the queue over. A chain pushed
+         * onto the empty queue after that signals again.
+         */
+        if (__atomic_exchange_n(&t->signalled, 0, __ATOMIC_ACQUIRE)) {
+                /* One read resets an eventfd, a pipe is read until empty */
+                while (read(t->wakeup_rfd, buf, sizeof(buf)) ==
+                       sizeof(buf)) {
+                }
+        }
+        if (__atomic_load_n(&t->submitted, __ATOMIC_RELAXED) == NULL) {
+                return 0;
+        }
+        pdu = __atomic_exchange_n(&t->submitted, NULL, __ATOMIC_ACQUIRE);
+
+        /* Oldest first */
+        while (pdu) {
+                next = pdu->next;
+                pdu->next = list;
+                list = pdu;
+                pdu = next;
+        }
+        while (list) {
+                pdu = list;
+                list = pdu->next;
+                pdu->next = NULL;
+                smb2_queue_pdu(smb2, pdu);
+                count++;
+        }
+
+        return count;
+}
+
+void
+smb2_lock(struct smb2_context *smb2)
+{
+        if (smb2->thread) {
+                pthread_mutex_lock(&smb2->thread->lock);
+        }
+}
+
+void
+smb2_unlock(struct smb2_context *smb2)
+{
+        if (smb2->thread) {
+                pthread_mutex_unlock(&smb2->thread->lock);
+        }
+}
+
+char *
+smb2_error_buffer(struct smb2_context *smb2)
+{
+        if (smb2->thread && !smb2_thread_is_service(smb2->thread)) {
+                return smb2_thread_error;
+        }
+        return smb2->error_string;
+}
+
+void
+smb2_free_thread(struct smb2_context *smb2)
+{
+        if (smb2->thread) {
+                smb2_thread_free(smb2->thread);
+                smb2->thread = NULL;
+        }
+}
+
+#else /* SMB2_THREADS */
+
+int
+smb2_set_thread_safe(struct smb2_context *smb2, int val)
+{
+        if (val) {
+                smb2_set_error(smb2, "Thread-safe mode is not supported "
+                               "on this platform");
+                return -ENOTSUP;
+        }
+        return 0;
+}
+
+t_socket
+smb2_get_wakeup_fd(struct smb2_context *smb2)
+{
+        return -1;
+}
+
+int
+smb2_is_service_thread(struct smb2_context *smb2)
+{
+        return 1;
+}
+
+void
+smb2_submit_pdu(struct smb2_context *smb2, struct smb2_pdu *pdu)
+{
+}
+
+int
+smb2_drain_submitted(struct smb2_context *smb2)
+{
+        return 0;
+}
+
+void
+smb2_lock(struct smb2_context *smb2)
+{
+}
+
+void
+smb2_unlock(struct smb2_context *smb2)
+{
+}
+
+char *
+smb2_error_buffer(struct smb2_context *smb2)
+{
+        return smb2->error_string;
+}
+
+void
+smb2_free_thread(struct smb2_context *smb2)
+{
+}
+
+#endif /* SMB2_THREADS */
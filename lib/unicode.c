@@ -155,23 +155,28 @@ ucs2_cp_size(uint16_t cp)
         return 1;
 }
 
-/* Convert a UCS2 string into UTF8
+/* Returns how many bytes we need to store a UCS2 string as UTF8,
+ * including the terminating NUL.
  */
-const char *
-ucs2_to_utf8(const uint16_t *ucs2, int ucs2_len)
+int
+ucs2_to_utf8_len(const uint16_t *ucs2, int ucs2_len)
 {
         int i, utf8_len = 1;
-        char *str, *tmp;
 
-        /* How many bytes do we need for utf8 ? */
         for (i = 0; i < ucs2_len; i++) {
                 utf8_len += ucs2_cp_size(ucs2[i]);
         }
-        str = tmp = malloc(utf8_len);
-        if (str == NULL) {
-                return NULL;
-        }
-        str[utf8_len - 1] = 0;
+        return utf8_len;
+}
+
+/* Convert a UCS2 string into UTF8 in a buffer of
+ * ucs2_to_utf8_len() bytes.
+ */
+void
+ucs2_to_utf8_buf(const uint16_t *ucs2, int ucs2_len, char *str)
+{
+        char *tmp = str;
+        int i;
 
         for (i = 0; i < ucs2_len; i++) {
                 uint16_t c = le32toh(ucs2[i]);
@@ -192,6 +197,21 @@ ucs2_to_utf8(const uint16_t *ucs2, int ucs2_len)
                         break;
                 }
         }
+        *tmp = 0;
+}
+
+/* Convert a UCS2 string into UTF8
+ */
+const char *
+ucs2_to_utf8(const uint16_t *ucs2, int ucs2_len)
+{
+        char *str;
+
+        str = malloc(ucs2_to_utf8_len(ucs2, ucs2_len));
+        if (str == NULL) {
+                return NULL;
+        }
+        ucs2_to_utf8_buf(ucs2, ucs2_len, str);
 
         return str;
 }
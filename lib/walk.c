@@ -0,0 +1,479 @@
+/* -*-  mode:c; tab-width:8; c-basic-offset:8; indent-tabs-mode:nil;  -*- */
+/*
+   Copyright (C) 2026 by Ronnie Sahlberg <ronniesahlberg@gmail.com>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Recursive directory walk, see smb2_walk_async().
+ *
+ * Every directory is read with smb2_opendir_stream_async() so only a batch
+ * or two of each is held in memory. A directory is in one of three states
+ * once it has been found:
+ *  - queued, waiting in the work queue to be opened,
+ *  - busy, its opendir or smb2_readdir_next_async() is in flight, or its
+ *    current batch is being handed to the callbacks,
+ *  - paused, its next entry is a subdirectory that does not fit in the
+ *    queue.
+ * walk_schedule() resumes paused directories when the queue has room and
+ * opens queued ones while fewer than max_dirs directories are open. When
+ * nothing is in flight and nothing can be opened it lets the directory
+ * paused last open its subdirectory without queueing it, which is how a
+ * recursive walk would go on, so the walk always makes progress.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#ifdef HAVE_STRING_H
+#include <string.h>
+#endif
+
+#include <errno.h>
+
+#include "smb2.h"
+#include "libsmb2.h"
+#include "libsmb2-private.h"
+#include "slist.h"
+
+#define WALK_DEFAULT_QUEUE 4096
+#define WALK_MAX_DIRS      64
+
+struct smb2_walk;
+
+struct walk_dir {
+        struct walk_dir *next;
+        struct walk_dir *prev;
+        struct smb2_walk *walk;
+        struct smb2dir *dir;
+        /* Open the next subdirectory even if the queue is full */
+        int descend;
+        int is_root;
+        /* Relative to the share, allocated with the structure */
+        char *path;
+};
+
+struct walk_dir_list {
+        struct walk_dir *head;
+        struct walk_dir *tail;
+};
+
+struct smb2_walk {
+        struct smb2_context *smb2;
+        struct smb2_walk_options opts;
+        smb2_command_cb cb;
+        void *cb_data;
+
+        struct walk_dir_list queue;
+        int queued;
+        struct walk_dir_list paused;
+        /* Directories opened or being opened */
+        int open;
+        /* Requests in flight */
+        int inflight;
+        /* -errno once the walk has been stopped */
+        int status;
+        /* Inside a callback or walk_schedule(). Callbacks can be invoked
+         * from within each other, only the outermost one may schedule.
+         */
+        int busy;
+
+        /* Largest QUERY_DIRECTORY reply, one credit per query */
+        uint32_t query_size;
+
+        /* Path of the entry handed to the callbacks */
+        char *path;
+        size_t path_size;
+};
+
+static void
+walk_schedule(struct smb2_walk *walk);
+
+static struct walk_dir *
+walk_dir_new(struct smb2_walk *walk, const char *path, size_t len)
+{
+        struct walk_dir *wd;
+
+        wd = malloc(sizeof(struct walk_dir) + len + 1);
+        if (wd == NULL) {
+                smb2_set_error(walk->smb2, "Failed to allocate walk_dir");
+                return NULL;
+        }
+        memset(wd, 0, sizeof(struct walk_dir));
+        wd->walk = walk;
+        wd->path = (char *)(wd + 1);
+        memcpy(wd->path, path, len);
+        wd->path[len] = 0;
+
+        return wd;
+}
+
+/* wd has been read or has failed, forget about it */
+static void
+walk_dir_done(struct walk_dir *wd, int status)
+{
+        struct smb2_walk *walk = wd->walk;
+
+        if (wd->dir) {
+                smb2_closedir(walk->smb2, wd->dir);
+                walk->open--;
+        }
+        if (walk->status == 0) {
+                if (walk->opts.dir_cb) {
+                        walk->opts.dir_cb(walk->smb2, wd->path, status,
+                                          walk->opts.cb_data);
+                }
+                /* Nothing more can be read once the connection is gone,
+                 * the requests were cancelled.
+                 */
+                if (status == -ECONNRESET ||
+                    (wd->is_root && status < 0)) {
+                        walk->status = status;
+                }
+        }
+        free(wd);
+}
+
+static void
+walk_stop(struct smb2_walk *walk, int status)
+{
+        if (walk->status == 0) {
+                walk->status = status;
+        }
+}
+
+/* Path of entry name in wd */
+static const char *
+walk_entry_path(struct walk_dir *wd, const char *name, size_t *len)
+{
+        struct smb2_walk *walk = wd->walk;
+        size_t dlen = strlen(wd->path);
+        size_t nlen = strlen(name);
+        size_t size = dlen + nlen + 2;
+
+        if (size > walk->path_size) {
+                char *buf;
+
+                size = size * 2 > 256 ? size * 2 : 256;
+                buf = realloc(walk->path, size);
+                if (buf == NULL) {
+                        smb2_set_error(walk->smb2, "Failed to allocate "
+                                       "walk path");
+                        return NULL;
+                }
+                walk->path = buf;
+                walk->path_size = size;
+        }
+
+        *len = 0;
+        if (dlen) {
+                memcpy(walk->path, wd->path, dlen);
+                walk->path[dlen] = '/';
+                *len = dlen + 1;
+        }
+        memcpy(walk->path + *len, name, nlen + 1);
+        *len += nlen;
+
+        return walk->path;
+}
+
+static void
+walk_next_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *private_data);
+static void
+walk_open(struct walk_dir *wd);
+
+/* Hand the rest of the current batch of wd to the callbacks and ask for
+ * the next one. wd must not be used after this returns.
+ */
+static void
+walk_read(struct walk_dir *wd)
+{
+        struct smb2_walk *walk = wd->walk;
+        struct smb2_context *smb2 = walk->smb2;
+        struct smb2dirent *ent;
+        struct walk_dir *child;
+        const char *path;
+        size_t len;
+        long pos;
+        int rc;
+
+        while (walk->status == 0) {
+                pos = smb2_telldir(smb2, wd->dir);
+                ent = smb2_readdir(smb2, wd->dir);
+                if (ent == NULL) {
+                        walk->inflight++;
+                        rc = smb2_readdir_next_async(smb2, wd->dir,
+                                                     walk_next_cb, wd);
+                        if (rc < 0) {
+                                walk->inflight--;
+                                walk_dir_done(wd, rc);
+                        }
+                        return;
+                }
+                if (!strcmp(ent->name, ".") || !strcmp(ent->name, "..")) {
+                        continue;
+                }
+
+                if (ent->st.smb2_type == SMB2_TYPE_DIRECTORY &&
+                    walk->queued >= walk->opts.max_queue && !wd->descend) {
+                        smb2_seekdir(smb2, wd->dir, pos);
+                        SMB2_DLIST_ADD_END(&walk->paused, wd);
+                        return;
+                }
+
+                path = walk_entry_path(wd, ent->name, &len);
+                if (path == NULL) {
+                        walk_stop(walk, -ENOMEM);
+                        break;
+                }
+                if (walk->opts.entry_cb) {
+                        rc = walk->opts.entry_cb(smb2, path, ent,
+                                                 walk->opts.cb_data);
+                        if (rc < 0) {
+                                walk_stop(walk, rc);
+                                break;
+                        }
+                }
+                if (ent->st.smb2_type != SMB2_TYPE_DIRECTORY) {
+                        continue;
+                }
+                if (walk->opts.prune_cb &&
+                    walk->opts.prune_cb(smb2, path, ent,
+                                        walk->opts.cb_data)) {
+                        continue;
+                }
+
+                child = walk_dir_new(walk, path, len);
+                if (child == NULL) {
+                        walk_stop(walk, -ENOMEM);
+                        break;
+                }
+                if (wd->descend) {
+                        wd->descend = 0;
+                        walk_open(child);
+                        continue;
+                }
+                SMB2_DLIST_ADD_END(&walk->queue, child);
+                walk->queued++;
+        }
+
+        walk_dir_done(wd, walk->status);
+}
+
+static void
+walk_next_cb(struct smb2_context *smb2, int status,
+             void *command_data, void *private_data)
+{
+        struct walk_dir *wd = private_data;
+        struct smb2_walk *walk = wd->walk;
+
+        walk->busy++;
+        walk->inflight--;
+        if (status <= 0 || walk->status) {
+                walk_dir_done(wd, status);
+        } else {
+                walk_read(wd);
+        }
+        walk->busy--;
+        walk_schedule(walk);
+}
+
+static void
+walk_opendir_cb(struct smb2_context *smb2, int status,
+                void *command_data, void *private_data)
+{
+        struct walk_dir *wd = private_data;
+        struct smb2_walk *walk = wd->walk;
+
+        walk->busy++;
+        walk->inflight--;
+        if (status < 0) {
+                walk->open--;
+                walk_dir_done(wd, status);
+        } else {
+                wd->dir = command_data;
+                if (walk->status) {
+                        walk_dir_done(wd, walk->status);
+                } else {
+                        walk_read(wd);
+                }
+        }
+        walk->busy--;
+        walk_schedule(walk);
+}
+
+static void
+walk_open(struct walk_dir *wd)
+{
+        struct smb2_walk *walk = wd->walk;
+        int rc;
+
+        walk->open++;
+        walk->inflight++;
+        rc = smb2_opendir_sized_async(walk->smb2, wd->path,
+                                      walk->query_size,
+                                      walk_opendir_cb, wd);
+        if (rc < 0) {
+                walk->open--;
+                walk->inflight--;
+                walk_stop(walk, -ENOMEM);
+                walk_dir_done(wd, -ENOMEM);
+        }
+}
+
+static void
+walk_free(struct smb2_walk *walk)
+{
+        struct walk_dir *wd;
+
+        while ((wd = walk->paused.head)) {
+                SMB2_DLIST_REMOVE(&walk->paused, wd);
+                smb2_closedir(walk->smb2, wd->dir);
+                free(wd);
+        }
+        while ((wd = walk->queue.head)) {
+                SMB2_DLIST_REMOVE(&walk->queue, wd);
+                free(wd);
+        }
+        free(walk->path);
+        free(walk);
+}
+
+static void
+walk_schedule(struct smb2_walk *walk)
+{
+        struct walk_dir *wd;
+
+        if (walk->busy) {
+                return;
+        }
+        walk->busy = 1;
+
+        while (walk->status == 0) {
+                if (walk->paused.tail &&
+                    walk->queued < walk->opts.max_queue) {
+                        wd = walk->paused.tail;
+                        SMB2_DLIST_REMOVE(&walk->paused, wd);
+                        walk_read(wd);
+                        continue;
+                }
+                if (walk->queue.head && walk->open < walk->opts.max_dirs) {
+                        if (walk->opts.order == SMB2_WALK_BREADTH_FIRST) {
+                                wd = walk->queue.head;
+                        } else {
+                                wd = walk->queue.tail;
+                        }
+                        SMB2_DLIST_REMOVE(&walk->queue, wd);
+                        walk->queued--;
+                        walk_open(wd);
+                        continue;
+                }
+                if (walk->paused.tail && walk->inflight == 0) {
+                        wd = walk->paused.tail;
+                        SMB2_DLIST_REMOVE(&walk->paused, wd);
+                        wd->descend = 1;
+                        walk_read(wd);
+                        continue;
+                }
+                break;
+        }
+
+        walk->busy = 0;
+        if (walk->inflight) {
+                return;
+        }
+        if (walk->status == 0 && (walk->queue.head || walk->paused.head)) {
+                return;
+        }
+
+        walk->cb(walk->smb2, walk->status, NULL, walk->cb_data);
+        walk_free(walk);
+}
+
+int
+smb2_walk_async(struct smb2_context *smb2, const char *path,
+                const struct smb2_walk_options *opts,
+                smb2_command_cb cb, void *cb_data)
+{
+        struct smb2_walk *walk;
+        struct walk_dir *wd;
+        size_t len;
+
+        if (path == NULL) {
+                path = "";
+        }
+        len = strlen(path);
+        while (len && path[len - 1] == '/') {
+                len--;
+        }
+
+        walk = malloc(sizeof(struct smb2_walk));
+        if (walk == NULL) {
+                smb2_set_error(smb2, "Failed to allocate smb2_walk");
+                return -ENOMEM;
+        }
+        memset(walk, 0, sizeof(struct smb2_walk));
+        walk->smb2 = smb2;
+        walk->cb = cb;
+        walk->cb_data = cb_data;
+        if (opts) {
+                walk->opts = *opts;
+        }
+        if (walk->opts.max_queue <= 0) {
+                walk->opts.max_queue = WALK_DEFAULT_QUEUE;
+        }
+        if (walk->opts.max_dirs <= 0) {
+                /* Opening a directory takes three requests */
+                walk->opts.max_dirs = smb2->credits / 3;
+                if (walk->opts.max_dirs > WALK_MAX_DIRS) {
+                        walk->opts.max_dirs = WALK_MAX_DIRS;
+                }
+                if (walk->opts.max_dirs == 0) {
+                        walk->opts.max_dirs = 1;
+                }
+        }
+
+        wd = walk_dir_new(walk, path, len);
+        if (wd == NULL) {
+                free(walk);
+                return -ENOMEM;
+        }
+        wd->is_root = 1;
+
+        /* One credit per query */
+        walk->query_size = smb2->dir_query_size;
+        if (walk->query_size == 0 || walk->query_size > 65536) {
+                walk->query_size = 65536;
+        }
+
+        walk->open++;
+        walk->inflight++;
+        if (smb2_opendir_sized_async(smb2, wd->path, walk->query_size,
+                                     walk_opendir_cb, wd) < 0) {
+                free(wd);
+                free(walk);
+                return -ENOMEM;
+        }
+
+        return 0;
+}